@@ -0,0 +1,184 @@
+// Compares the speed and size of palette PNGs written by `pngsave` with those
+// written by the worker’s own encoder (src/worker/png.cpp), at each
+// compression level. Pages are converted to greyscale and quantized to the
+// given bit depth first, as e-ink output is. Only filtering and compression
+// are timed, since the quantizing is done once beforehand.
+//
+// Usage: png_benchmark [-bit_depth 1|2|4|8] IMAGE...
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <vips/vips8>
+
+#include "../src/worker/include/png.hpp"
+
+// Each encode is timed this many times, and the fastest run is reported.
+const auto RUNS = 5;
+
+struct Result {
+    double milliseconds;
+    size_t bytes;
+};
+
+static Result best_of_runs(const auto &encode);
+static std::vector<uint8_t> pack_indices(
+    const vips::VImage &grey, int bit_depth, std::vector<uint8_t> &palette
+);
+static vips::VImage index_samples(
+    const vips::VImage &grey, int bit_depth, const std::vector<uint8_t> &palette
+);
+
+int main(int argc, char *argv[]) {
+    if (VIPS_INIT(argv[0])) {
+        vips_error_exit(nullptr);
+    }
+
+    auto bit_depth = 4;
+    auto paths = std::vector<std::string>();
+    for (auto i = 1; i < argc; i += 1) {
+        auto arg = std::string(argv[i]);
+        if (arg == "-bit_depth" && i + 1 < argc) {
+            bit_depth = std::stoi(argv[i + 1]);
+            i += 1;
+        }
+        else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.empty()) {
+        std::fprintf(
+            stderr, "Usage: %s [-bit_depth 1|2|4|8] IMAGE...\n", argv[0]
+        );
+        return 1;
+    }
+
+    for (const auto &path : paths) {
+        auto grey = vips::VImage::new_from_file(path.c_str())
+                        .colourspace(VIPS_INTERPRETATION_B_W)[0]
+                        .cast(VIPS_FORMAT_UCHAR)
+                        .copy_memory();
+
+        // Both encoders start from the same quantized pixels.
+        auto blob = grey.pngsave_buffer(
+            vips::VImage::option()
+                ->set("palette", true)
+                ->set("bitdepth", bit_depth)
+                ->set("compression", 0)
+        );
+        size_t size = 0;
+        auto data = vips_blob_get(blob, &size);
+        auto quantized = vips::VImage::new_from_buffer(data, size, "")[0]
+                             .copy_memory();
+        vips_area_unref(VIPS_AREA(blob));
+
+        auto palette = std::vector<uint8_t>();
+        auto rows = pack_indices(quantized, bit_depth, palette);
+        auto samples = index_samples(quantized, bit_depth, palette);
+
+        std::printf(
+            "%s (%dx%d, %d-bit)\n",
+            path.c_str(),
+            grey.width(),
+            grey.height(),
+            bit_depth
+        );
+        std::printf(
+            "%5s %12s %12s %12s %12s\n",
+            "level",
+            "pngsave ms",
+            "pngsave B",
+            "png.cpp ms",
+            "png.cpp B"
+        );
+        for (auto level = 0; level <= 9; level += 1) {
+            // With `palette` set, `pngsave` runs libimagequant again on every
+            // save, which would swamp the time taken to compress. Instead, it
+            // writes the palette indices as grey samples, which are the same
+            // rows that the worker’s encoder compresses, less the palette.
+            auto vips_result = best_of_runs([&] {
+                auto blob = samples.pngsave_buffer(
+                    vips::VImage::option()
+                        ->set("bitdepth", bit_depth)
+                        ->set("compression", level)
+                );
+                size_t size = 0;
+                vips_blob_get(blob, &size);
+                vips_area_unref(VIPS_AREA(blob));
+                return size;
+            });
+            auto own_result = best_of_runs([&] {
+                return encode_grey_png(
+                           quantized.width(),
+                           quantized.height(),
+                           bit_depth,
+                           palette,
+                           rows,
+                           level
+                )
+                    .size();
+            });
+            std::printf(
+                "%5d %12.1f %12zu %12.1f %12zu\n",
+                level,
+                vips_result.milliseconds,
+                vips_result.bytes,
+                own_result.milliseconds,
+                own_result.bytes
+            );
+        }
+        std::printf("\n");
+    }
+
+    vips_shutdown();
+    return 0;
+}
+
+Result best_of_runs(const auto &encode) {
+    auto result = Result{.milliseconds = 0.0, .bytes = 0};
+    for (auto run = 0; run < RUNS; run += 1) {
+        auto start = std::chrono::steady_clock::now();
+        result.bytes = encode();
+        auto elapsed = std::chrono::duration<double, std::milli>(
+                           std::chrono::steady_clock::now() - start
+        )
+                           .count();
+        if (run == 0 || elapsed < result.milliseconds) {
+            result.milliseconds = elapsed;
+        }
+    }
+    return result;
+}
+
+// Packs a quantized page into PNG rows of palette indices, as
+// `save_indexed_grey_png` does, and returns its grey levels in `palette`.
+std::vector<uint8_t> pack_indices(
+    const vips::VImage &grey, int bit_depth, std::vector<uint8_t> &palette
+) {
+    size_t size = 0;
+    auto pixels = static_cast<uint8_t *>(grey.write_to_memory(&size));
+    auto rows = pack_grey_indices(
+        pixels, grey.width(), grey.height(), bit_depth, palette
+    );
+    g_free(pixels);
+    return rows;
+}
+
+// Replaces each grey level of a quantized page with its palette index, in the
+// top bits of the sample, which is where `pngsave` takes samples from when
+// writing fewer than 8 bits.
+vips::VImage index_samples(
+    const vips::VImage &grey, int bit_depth, const std::vector<uint8_t> &palette
+) {
+    auto lut = std::vector<uint8_t>(256, 0);
+    for (size_t i = 0; i < palette.size(); i += 1) {
+        lut[palette[i]] = static_cast<uint8_t>(i << (8 - bit_depth));
+    }
+    auto lut_image = vips::VImage::new_from_memory(
+        lut.data(), lut.size(), 256, 1, 1, VIPS_FORMAT_UCHAR
+    );
+    return grey.maplut(lut_image).copy_memory();
+}
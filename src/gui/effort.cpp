@@ -0,0 +1,195 @@
+#include "include/window.hpp"
+#include "include/window_util.hpp"
+
+#include <QProcess>
+#include <QSpinBox>
+#include <QTextEdit>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+
+// Until it has been measured, each step of compression effort is assumed to
+// multiply a page’s encode time by this much.
+const auto EFFORT_TIME_GROWTH = 1.6;
+
+static int64_t now_ms();
+// The range of compression effort of a format, or nothing if it has none that
+// the time budget can adjust.
+static std::optional<std::pair<int, int>>
+effort_range(const std::string &format);
+
+void Window::reset_effort_budget() {
+    this->effort_samples.clear();
+    this->effort_records.clear();
+    this->task_start_times.clear();
+    this->task_encode_times.clear();
+    this->budget_effort = this->options.image_compression_spin_box->value();
+
+    auto minutes = this->options.time_budget_spin_box->value();
+    auto format
+        = this->options.image_format_combo_box->currentText().toStdString();
+    if (minutes == 0 || !effort_range(format)) {
+        this->time_budget_ms = std::nullopt;
+    }
+    else {
+        this->time_budget_ms = static_cast<int64_t>(minutes) * 60 * 1000;
+    }
+}
+
+int Window::choose_compression_effort(const PageTask &task) {
+    auto range = effort_range(task.image_format);
+    if (!this->time_budget_ms.has_value() || !range.has_value()
+        || !this->start_time.has_value()) {
+        return task.compression_effort;
+    }
+    // Until a page has finished, there’s nothing to go on.
+    if (this->effort_samples.isEmpty()) {
+        return this->budget_effort;
+    }
+    auto [min_effort, max_effort] = *range;
+
+    // The time each remaining page may take, given that pages run
+    // `max_concurrent_workers` at a time. The pages already running have had
+    // their effort chosen.
+    auto elapsed = now_ms() - *this->start_time;
+    auto remaining_ms = static_cast<double>(*this->time_budget_ms - elapsed);
+    auto remaining_pages = this->total_pages - this->pages_processed
+                         - static_cast<int>(this->running_processes.size());
+    auto page_budget = remaining_ms * this->max_concurrent_workers
+                     / std::max(remaining_pages, 1);
+
+    // Decoding and the rest of the processing don’t depend on the effort.
+    auto other_ms = 0.0;
+    auto pages = 0;
+    for (const auto &samples : this->effort_samples) {
+        other_ms += samples.other_ms;
+        pages += samples.pages;
+    }
+    other_ms /= pages;
+
+    // Encode time at an effort is taken from the nearest measured effort.
+    auto predicted_ms = [&](int effort) {
+        auto nearest = this->effort_samples.firstKey();
+        for (auto measured : this->effort_samples.keys()) {
+            if (std::abs(measured - effort) < std::abs(nearest - effort)) {
+                nearest = measured;
+            }
+        }
+        const auto &samples = this->effort_samples[nearest];
+        return other_ms
+             + samples.encode_ms / samples.pages
+                   * std::pow(EFFORT_TIME_GROWTH, effort - nearest);
+    };
+
+    auto target = min_effort;
+    for (auto effort = max_effort; effort >= min_effort; effort -= 1) {
+        if (predicted_ms(effort) <= page_budget) {
+            target = effort;
+            break;
+        }
+    }
+
+    // Move one step per page, so that a single slow page doesn’t swing the
+    // effort from one end of the range to the other.
+    this->budget_effort = std::clamp(
+        std::clamp(target, this->budget_effort - 1, this->budget_effort + 1),
+        min_effort,
+        max_effort
+    );
+    return this->budget_effort;
+}
+
+void Window::record_worker_status(QProcess *process, const QString &line) {
+    // Reports for the user, such as the image format chosen for a page, go to
+    // the log. Being status lines, they don’t count as errors.
+    if (line.startsWith("@info ")) {
+        this->handle_log_message(line.mid(6));
+        return;
+    }
+    auto parts = line.mid(1).split(' ');
+    if (parts.size() == 2 && parts[0] == "encode_ms") {
+        this->task_encode_times[process] += parts[1].toLongLong();
+    }
+}
+
+void Window::record_page_time(QProcess *process, const PageTask &task) {
+    // Pages that weren’t encoded, such as those copied as they are, say
+    // nothing about the effort.
+    if (!this->task_start_times.contains(process)
+        || !this->task_encode_times.contains(process)) {
+        this->task_start_times.remove(process);
+        return;
+    }
+    auto wall_ms = now_ms() - this->task_start_times.take(process);
+    auto encode_ms = this->task_encode_times.take(process);
+    if (!this->time_budget_ms.has_value()) {
+        return;
+    }
+
+    auto &samples = this->effort_samples[task.compression_effort];
+    samples.encode_ms += encode_ms;
+    samples.other_ms += std::max<int64_t>(wall_ms - encode_ms, 0);
+    samples.pages += 1;
+
+    this->effort_records.append(
+        {.source_file = task.source_file,
+         .page_number = task.page_number,
+         .effort = task.compression_effort,
+         .encode_ms = encode_ms}
+    );
+}
+
+void Window::write_effort_report() {
+    if (!this->time_budget_ms.has_value() || !this->start_time.has_value()) {
+        return;
+    }
+
+    auto elapsed = now_ms() - *this->start_time;
+    auto summary
+        = QString("Finished in %1 of a %2 time budget.")
+              .arg(QString::fromStdString(time_to_str(elapsed)))
+              .arg(QString::fromStdString(time_to_str(*this->time_budget_ms)));
+    this->log_output->setVisible(true);
+
+    // A library sync writes into the user’s mirror of their library, so the
+    // report would end up among their books and be rewritten by every sync.
+    if (this->library_sync) {
+        this->log_output->append(summary);
+        return;
+    }
+
+    auto report_path = this->output_path / "effort_report.tsv";
+    auto report = std::ofstream(report_path);
+    report << "file\tpage\teffort\tencode_ms\n";
+    for (const auto &record : this->effort_records) {
+        report << record.source_file.filename().string() << '\t'
+               << record.page_number + 1 << '\t' << record.effort << '\t'
+               << record.encode_ms << '\n';
+    }
+    this->log_output->append(
+        summary + " Compression efforts are listed in "
+        + QString::fromStdString(report_path.filename().string()) + "."
+    );
+}
+
+int64_t now_ms() {
+    auto now = std::chrono::system_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               now.time_since_epoch()
+    )
+        .count();
+}
+
+std::optional<std::pair<int, int>> effort_range(const std::string &format) {
+    if (format == "AVIF" || format == "PNG") {
+        return std::pair(0, 9);
+    }
+    if (format == "JPEG XL") {
+        return std::pair(1, 9);
+    }
+    if (format == "WebP") {
+        return std::pair(0, 6);
+    }
+    return std::nullopt;
+}
@@ -87,3 +87,18 @@ const BrandMap DISPLAY_PRESETS = {
          {"Paper Pro Move", {954, 1696, BitDepthIndex::FOUR, true}},
      }},
 };
+
+// The display of a preset, or nothing for “None” and unknown presets.
+inline std::optional<DisplaySpec>
+find_display_spec(const std::string &brand, const std::string &model) {
+    auto brand_it = DISPLAY_PRESETS.find(brand);
+    if (brand_it == DISPLAY_PRESETS.end() || !brand_it->second) {
+        return std::nullopt;
+    }
+    for (const auto &[model_name, display] : *brand_it->second) {
+        if (model_name == model) {
+            return display;
+        }
+    }
+    return std::nullopt;
+}
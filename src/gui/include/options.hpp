@@ -59,8 +59,16 @@ void add_convert_to_greyscale_widget(QStyle *style, Options *options);
 void add_double_page_spread_widget(QStyle *style, Options *options);
 void add_linear_light_resampling_widget(QStyle *style, Options *options);
 void add_remove_spine_widget(QStyle *style, Options *options);
+void add_crop_margins_widget(QStyle *style, Options *options);
+void add_map_colour_eink_widget(QStyle *style, Options *options);
+void add_slice_long_strips_widget(QStyle *style, Options *options);
+void add_deduplicate_pages_widget(QStyle *style, Options *options);
 void add_contrast_widget(QStyle *style, Options *options);
 void add_scaling_widgets(QStyle *style, Options *options);
 void add_quantization_widgets(QStyle *style, Options *options);
 void add_image_format_widgets(QStyle *style, Options *options);
 void add_parallel_workers_widget(QStyle *style, Options *options);
+void add_optimize_when_idle_widget(QStyle *style, Options *options);
+void add_cache_pages_widget(QStyle *style, Options *options);
+void add_source_cache_widget(QStyle *style, Options *options);
+void add_reuse_pages_widget(QStyle *style, Options *options);
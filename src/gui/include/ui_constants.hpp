@@ -10,13 +10,22 @@ static const char *PDF_TOOLTIP = R"(
 )";
 #endif
 
+static const char *EXTRA_DEVICES_TOOLTIP = R"(
+    Converts the same files for more devices in one run. Each page is read and
+    decoded once, then scaled and saved for every device, which is much faster
+    than a run per device. The files for each extra device go into a folder
+    named after it in the output folder. Every other option applies to all of
+    them.
+)";
+
 static const char *OUTPUT_FORMAT_TOOLTIP = R"(
     EPUB is the standard format on ereaders and is recommended in most cases.
     When the same image format is chosen in the advanced options menu, there is
     practically no file size difference between EPUB and CBZ, but EPUB is more
     widely supported. However, EPUB does not officially support the image
     formats JPEG XL and AVIF, so only use CBZ if you’re using one of those image
-    formats.
+    formats. <i>EPUB and CBZ</i> writes both from the same converted pages, at
+    little more cost than one.
 )";
 
 static const char *GREYSCALE_TOOLTIP = R"(
@@ -25,9 +34,22 @@ static const char *GREYSCALE_TOOLTIP = R"(
     quality.
 )";
 
+static const char *MAP_COLOUR_EINK_TOOLTIP = R"(
+    Adjusts coloured pages for colour e-ink screens, such as those in the
+    Kindle Colorsoft and Kobo Libra Colour. Colours are made more vivid to make
+    up for the muted screen and are reduced to the 4096 colours it can show.
+    This has no effect on pages converted to greyscale.
+)";
+
 static const char *DOUBLE_PAGE_SPREAD_TOOLTIP = R"(
     What to do when a two-page spread (when two pages are put together into a
-    single page).
+    single page). Splitting produces two pages that each use the full screen.
+    <i>Rotate and split</i> keeps the rotated spread followed by its two halves.
+)";
+
+static const char *READING_DIRECTION_TOOLTIP = R"(
+    The order in which the halves of a split two-page spread are placed. Choose
+    <i>Right to left</i> for manga.
 )";
 
 static const char *LINEAR_LIGHT_RESAMPLING_TOOLTIP = R"(
@@ -42,6 +64,33 @@ static const char *REMOVE_SPINE_TOOLTIP = R"(
     the actual pages.
 )";
 
+static const char *CROP_MARGINS_TOOLTIP = R"(
+    Crops uniform white margins around pages. This makes the artwork larger on
+    the ereader’s screen and reduces processing time and file size, since fewer
+    pixels are left to scale and compress.
+)";
+
+static const char *CROP_MARGINS_PER_BOOK_TOOLTIP = R"(
+    Crops every page in a book by the same amount so that facing pages stay the
+    same size and page content doesn’t shift between page turns. The margins are
+    measured across the whole book before the first page is processed.
+)";
+
+static const char *SLICE_LONG_STRIPS_TOOLTIP = R"(
+    Cuts long vertical strips, as used by webtoons, into several pages that fit
+    the screen, instead of shrinking each strip until it’s unreadable. Cuts are
+    made through the gaps between panels where possible. This only applies to
+    images in archives and folders, not to PDF pages.
+)";
+
+static const char *DEDUPLICATE_PAGES_TOOLTIP = R"(
+    Stores pages that appear more than once in a book, such as repeated credit
+    pages, only once, and replaces blank pages with a tiny image. Only pages
+    that are identical pixel for pixel count as repeats, so pages that merely
+    look alike are always kept. This makes the output smaller and saves
+    processing time. In CBZ files, repeated pages are still stored each time.
+)";
+
 static const char *CONTRAST_TOOLTIP = R"(
     Automatically adjusts the page’s black and white points to maximize
     contrast. This is highly recommended when reading on an ereader, as it makes
@@ -83,9 +132,24 @@ static const char *DITHERING_TOOLTIP = R"(
     value of 1.0 to significantly improve quality.
 )";
 
+static const char *BOOK_PALETTE_TOOLTIP = R"(
+    Quantizes every greyscale page of a book to the same grey levels, chosen
+    once from all of its pages, instead of choosing new levels for each page.
+    This is faster and keeps tones consistent from page to page. Colour pages
+    still get a palette of their own.
+)";
+
 static const char *IMG_FORMAT_TOOLTIP = R"(
     Sets the image format for each page.
     <dl>
+        <dt>Auto</dt>
+        <dd>
+            Chooses for each page, keeping whichever format gives the smallest
+            file. Line art is saved as PNG and colour photographs as WebP, or
+            JPEG XL for CBZ; other pages are saved in each format to find out.
+            Slower than choosing one format yourself.
+        </dd>
+
         <dt>AVIF</dt>
         <dd>
             Good for photographs, but not optimal for comics. Results in large
@@ -125,7 +189,57 @@ static const char *IMAGE_COMPRESSION_TYPE_TOOLTIP = R"(
     when <i>Quantize pages</i> is enabled because it results in smaller file
     sizes as well as better quality. If <i>Quantize pages</i> is disabled,
     <i>Lossy</i> is recommended because it decreases file sizes significantly
-    with only a minor negative impact on quality.
+    with only a minor negative impact on quality. <i>Target quality</i> is
+    lossy too, but chooses the quality of each page for you.
+)";
+
+static const char *TIME_BUDGET_TOOLTIP = R"(
+    Sets how long the whole run may take. The compression effort is then
+    adjusted page by page, starting from the one above: raised while the run
+    is ahead of time, for smaller files, and lowered when it falls behind.
+    The effort of each page is listed in <code>effort_report.tsv</code> in the
+    output folder.
+)";
+
+static const char *OPTIMIZE_WHEN_IDLE_TOOLTIP = R"(
+    Once every page has been handed out, recompresses the pages of each
+    finished file again at the lowest priority, with much more effort: PNG
+    pages with every filter and the strongest compression, and lossless WebP
+    pages at the highest effort. Pages are only replaced if they get smaller,
+    and never lose quality. The conversion itself is no slower.
+)";
+
+static const char *CACHE_PAGES_TOOLTIP = R"(
+    Keeps every page after processing and before it’s saved in its image
+    format, in your cache folder. When the same files are converted again with
+    only the image format, quality or compression effort changed, the pages are
+    saved straight from the cache instead of being decoded and processed again.
+    The cache is lossless, so it takes a lot of space.
+)";
+
+static const char *SOURCE_CACHE_TOOLTIP = R"(
+    Keeps every page as it was decoded from the source file, before any
+    processing, in your cache folder, up to this size. When the same files are
+    converted again, with any settings, PDF pages aren’t rendered again and
+    images in archives aren’t decoded again. Once the cache is full, the pages
+    used longest ago are removed. The cache is uncompressed, so it fills
+    quickly.
+)";
+
+static const char *REUSE_PAGES_TOOLTIP = R"(
+    Keeps a copy of every finished page in your cache folder. When a page is
+    converted again from the same image with the same settings, for example
+    after a crash or with a few more files added, the copy is used instead of
+    converting the page again. Pages that repeat an earlier page aren’t kept,
+    and a kept page isn’t checked for repeats when it’s reused.
+)";
+
+static const char *IMAGE_TARGET_QUALITY_TOOLTIP = R"(
+    Sets how close each page must stay to the original, as a structural
+    similarity (SSIM) score from 0 to 1. The quality setting of each page is
+    lowered until its score would drop below this, so simple pages use fewer
+    bytes and detailed pages keep the quality they need. This costs a few quick
+    trial encodes of a small copy of each page.
 )";
 
 static const char *IMAGE_QUALITY_JPEG_XL_TOOLTIP = R"(
@@ -1,11 +1,16 @@
 #pragma once
 
+#include <QJsonObject>
 #include <QMainWindow>
+#include <QSet>
+#include <chrono>
 #include <deque>
+#include <memory>
 #include <optional>
 #include <qtconfigmacros.h>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "../../include/task.hpp"
 
@@ -68,13 +73,20 @@ struct Options {
     QSpinBox *pdf_pixel_density_spin_box;
 #endif
     QCheckBox *convert_to_greyscale;
+    QCheckBox *map_colour_eink_check_box;
     QComboBox *double_page_spread_combo_box;
     QLabel *linear_light_resampling_label;
     QCheckBox *linear_light_resampling_check_box;
     QWidget *linear_light_resampling_container;
     QCheckBox *remove_spine_check_box;
+    QCheckBox *crop_margins_check_box;
+    QWidget *crop_margins_options_container;
+    QCheckBox *crop_margins_per_book_check_box;
+    QCheckBox *slice_long_strips_check_box;
+    QCheckBox *deduplicate_pages_check_box;
     QCheckBox *contrast_check_box;
     QPushButton *display_preset_button;
+    QPushButton *extra_devices_button;
     QComboBox *output_format_combo_box;
     QLabel *scale_pages_label;
     QWidget *scale_pages_container;
@@ -89,12 +101,16 @@ struct Options {
     QWidget *quantization_options_container;
     QComboBox *bit_depth_combo_box;
     QDoubleSpinBox *dithering_spin_box;
+    QCheckBox *share_book_palette_check_box;
     QLabel *image_format_label;
     QWidget *image_format_container;
     QWidget *image_format_options_container;
     QComboBox *image_format_combo_box;
     QLabel *image_compression_label;
     QSpinBox *image_compression_spin_box;
+    QLabel *time_budget_label;
+    QWidget *time_budget_container;
+    QSpinBox *time_budget_spin_box;
     QComboBox *image_compression_type_combo_box;
     QLabel *image_compression_type_label;
     QLabel *image_compression_type_tooltip;
@@ -103,10 +119,27 @@ struct Options {
     QWidget *image_quality_label;
     QLabel *image_quality_label_original;
     QComboBox *image_quality_label_jpeg_xl;
+    QLabel *image_target_quality_label;
+    QWidget *image_target_quality_container;
+    QDoubleSpinBox *image_target_quality_spin_box;
     QLabel *workers_label;
     QSpinBox *workers_spin_box;
+    QLabel *optimize_when_idle_label;
+    QWidget *optimize_when_idle_container;
+    QCheckBox *optimize_when_idle_check_box;
+    QLabel *cache_pages_label;
+    QWidget *cache_pages_container;
+    QCheckBox *cache_pages_check_box;
+    QLabel *source_cache_label;
+    QWidget *source_cache_container;
+    QSpinBox *source_cache_spin_box;
+    QLabel *reuse_pages_label;
+    QWidget *reuse_pages_container;
+    QCheckBox *reuse_pages_check_box;
     QWidget *rotation_options_container;
     QComboBox *rotation_direction_combo_box;
+    QWidget *reading_direction_container;
+    QComboBox *reading_direction_combo_box;
 };
 
 struct FileTimer {
@@ -119,11 +152,69 @@ struct FileTimer {
     }
 };
 
+// Page times measured at one compression effort, for the time budget.
+struct EffortSamples {
+    double encode_ms = 0.0;
+    double other_ms = 0.0;
+    int pages = 0;
+};
+
+// The compression effort that a page was encoded at, for the effort report.
+struct EffortRecord {
+    fs::path source_file;
+    int page_number;
+    int effort;
+    int64_t encode_ms;
+};
+
+// A library folder that is kept in step with a converted mirror of it, in the
+// output folder. The index records what each source was converted from and
+// into, so that a sync converts only what changed.
+struct LibrarySync {
+    fs::path library_dir;
+    fs::path mirror_dir;
+    // Each source’s entry, by its path in the library.
+    QJsonObject files;
+    // Identifies the settings that the sources are converted with.
+    QString options_fingerprint;
+    std::chrono::steady_clock::time_point saved_at;
+};
+
+// What an interrupted run had finished, read back from its journal when the
+// same batch is started again.
+struct RunJournal {
+    fs::path path;
+    bool resumed = false;
+    std::optional<fs::path> output_dir;
+    // Staging folder names, by source.
+    QMap<QString, QString> staging_names;
+    // Page numbers and output base names of the finished pages, by source.
+    QMap<QString, QSet<int>> finished_pages;
+    QMap<QString, QSet<QString>> finished_base_names;
+    // The output archives of the packaged books, by source.
+    QMap<QString, QStringList> finished_archives;
+};
+
+// A book of the current run, with what its queued pages share.
+struct RunBook {
+    fs::path source_file;
+    fs::path staging_dir;
+    // The archive entries of the book’s pages, in page order. PDFs have none.
+    std::vector<std::string> entries;
+    int page_count;
+};
+
 struct DisplayPreset {
     std::string brand;
     std::string model;
 };
 
+// An extra device, with its settings for one book.
+struct ExtraDisplayTarget {
+    DisplayPreset preset;
+    DisplayTarget target;
+};
+
 class Window : public QMainWindow {
     Q_OBJECT
 
@@ -132,6 +223,9 @@ class Window : public QMainWindow {
         .brand = "Custom",
         .model = "",
     };
+    // Devices converted for in the same run as the display preset, from the
+    // same decoded pages. Their files go into a folder named after each one.
+    std::vector<DisplayPreset> extra_display_presets;
     explicit Window(QWidget *parent = nullptr);
     ~Window();
 
@@ -142,8 +236,11 @@ class Window : public QMainWindow {
     void handle_task_finished();
     void start_next_task();
     void on_worker_finished(int exitCode, QProcess::ExitStatus exitStatus);
+    void
+    on_optimizer_finished(int exitCode, QProcess::ExitStatus exitStatus);
     void on_worker_output();
     void on_add_files_clicked();
+    void on_sync_library_clicked();
     void on_remove_selected_clicked();
     void on_clear_all_clicked();
     void on_browse_output_clicked();
@@ -155,6 +252,7 @@ class Window : public QMainWindow {
     void on_pdf_pixel_density_combo_box_changed(const QString &text);
 #endif
     void on_double_page_spread_changed(const QString &text);
+    void on_crop_margins_changed(int state);
     void on_display_preset_changed();
     void on_preset_option_modified();
     void on_advanced_options_changed(int state);
@@ -182,6 +280,7 @@ class Window : public QMainWindow {
     // Input and output
     QListWidget *file_list;
     QPushButton *add_files_button;
+    QPushButton *sync_library_button;
     QPushButton *remove_selected_button;
     QPushButton *clear_all_button;
     QLineEdit *output_dir_field;
@@ -210,7 +309,10 @@ class Window : public QMainWindow {
     QPushButton *cancel_button;
 
     // Process Management
-    QQueue<PageTask> task_queue;
+    // The settings of the current run, shared by all of its pages.
+    std::shared_ptr<const JobOptions> job_options;
+    std::vector<RunBook> run_books;
+    QQueue<PageRecord> task_queue;
     QList<QProcess *> running_processes;
     QMap<QProcess *, PageTask> running_tasks;
     QMap<QString, int> archive_task_counts;
@@ -227,12 +329,67 @@ class Window : public QMainWindow {
     bool is_programmatically_changing_values;
 
     fs::path create_unique_temp_dir(const std::string &stem);
+    void start_conversion(const QStringList &input_file_paths);
+
+    // Run journal. Every finished page and book is appended to a journal in
+    // the run’s temp directory. A run that is interrupted keeps its temp
+    // directory, and starting the same batch again skips what it finished.
+    RunJournal run_journal;
+    fs::path batch_temp_dir(const QStringList &input_file_paths);
+    void load_run_journal();
+    void append_to_journal(const QStringList &fields);
+    // Whether a book was packaged before the interruption and its output
+    // archives are all still there. A book whose archives have gone is
+    // forgotten, so that it’s converted again from the start.
+    bool is_archive_finished(const QString &source);
+    // The staging folder of a source: the one it had before the interruption,
+    // cleared of unfinished pages, or a new one.
+    fs::path staging_dir_for(const QString &source, const std::string &stem);
+
+    // Library sync. Sources that are new, changed or were converted with other
+    // settings are converted into the mirror, and the outputs of deleted
+    // sources are removed from it.
+    std::optional<LibrarySync> library_sync;
+    void start_library_sync(const fs::path &library_dir);
+    QString options_fingerprint();
+    // The folder of a source within the library, or nothing outside a sync.
+    fs::path sync_relative_dir(const QString &source) const;
+    void record_synced_source(
+        const QString &source, const std::vector<fs::path> &outputs
+    );
+    void save_sync_index();
+    // Saves the index and ends the sync, when its run ends.
+    void finish_library_sync();
 
     // Timer
     void update_time_labels();
     void update_overall_time_labels();
     void update_file_time_labels(const QString &file);
 
+    // Time budget. With a budget, the compression effort of each page is
+    // chosen from the encode times of the pages before it, so that the run
+    // finishes in time at the highest effort it can afford.
+    std::optional<int64_t> time_budget_ms;
+    int budget_effort;
+    QMap<int, EffortSamples> effort_samples;
+    QMap<QProcess *, int64_t> task_start_times;
+    QMap<QProcess *, int64_t> task_encode_times;
+    QList<EffortRecord> effort_records;
+    void reset_effort_budget();
+    int choose_compression_effort(const PageTask &task);
+    // Handles a `@key value` status line from a worker.
+    void record_worker_status(QProcess *process, const QString &line);
+    void record_page_time(QProcess *process, const PageTask &task);
+    void write_effort_report();
+
+    // Optimization when idle. Finished archives wait here until no pages are
+    // left to hand out, then get a low-priority worker each that recompresses
+    // their pages harder.
+    QQueue<fs::path> optimize_queue;
+    QMap<QProcess *, fs::path> optimize_processes;
+    void start_next_optimization();
+    void cancel_optimizations();
+
     // UI setup
     void setup_ui();
     QGroupBox *create_io_group();
@@ -241,18 +398,35 @@ class Window : public QMainWindow {
     QGroupBox *log_group;
 
     void add_display_presets_widget();
+    void add_extra_devices_widget();
+    void update_extra_devices_button();
+    // The extra devices’ settings for a book staged in `staging_dir`, each
+    // with a staging directory of its own. Presets without a known display
+    // are left out.
+    std::vector<ExtraDisplayTarget>
+    extra_display_targets(const fs::path &staging_dir) const;
 
     // Helper methods
-    PageTask
-    create_task(fs::path source_file, fs::path output_dir, int page_num);
+    JobOptions create_job_options();
+    // The full task of a queued page, built when a worker starts on it.
+    PageTask create_task(const PageRecord &record) const;
+    // Adds a book to the run and queues its pages that aren’t finished yet.
+    void enqueue_book(RunBook book, const QSet<int> &finished_pages);
     void update_file_list_buttons();
     void connect_signals();
     void set_display_preset(std::string brand, std::string model);
     void create_archive(const QString &source_archive_path);
+    // Returns the archives written, or nothing when the book failed.
+    std::vector<fs::path> write_output_archive(
+        const QString &source_archive_path,
+        const fs::path &temp_dir,
+        const fs::path &output_dir
+    );
 
     int total_pages;
     int pages_processed;
 
+    int auto_quality = 80;
     int avif_compression_effort = 4;
     int avif_quality = 50;
     int jpeg_quality = 80;
@@ -0,0 +1,262 @@
+#include "include/window.hpp"
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QTextEdit>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <system_error>
+
+// The journal is kept at the top of the run’s temp directory, next to the
+// books’ staging folders.
+const auto JOURNAL_NAME = "journal";
+// Temp directories of interrupted runs that were never resumed are removed
+// after this long without a change.
+const auto STALE_RUN_AGE = std::chrono::hours(7 * 24);
+
+static void remove_stale_runs(const fs::path &current_run);
+static void remove_book_state(const fs::path &run_dir);
+static void remove_unfinished_pages(
+    const fs::path &staging_dir, const QSet<QString> &base_names
+);
+static bool
+is_finished_page_file(const QString &path, const QSet<QString> &base_names);
+
+fs::path Window::batch_temp_dir(const QStringList &input_file_paths) {
+    // A batch is its sources as they are now, its settings and its output
+    // folder. Changing any of them starts a new batch.
+    auto hash = QCryptographicHash(QCryptographicHash::Sha256);
+    hash.addData(this->options_fingerprint().toUtf8());
+    hash.addData(this->effective_output_dir().toUtf8());
+    for (const auto &source : input_file_paths) {
+        auto path = fs::path(source.toStdString());
+        auto ec = std::error_code();
+        auto size = fs::file_size(path, ec);
+        auto modified = fs::last_write_time(path, ec).time_since_epoch();
+        auto stream = std::ostringstream();
+        stream << '\n' << path.string() << '\n' << size << ' '
+               << modified.count();
+        hash.addData(QByteArray::fromStdString(stream.str()));
+    }
+
+    auto id = hash.result().toHex().left(16).toStdString();
+    return fs::temp_directory_path() / ("comicpress_" + id);
+}
+
+void Window::load_run_journal() {
+    this->run_journal = RunJournal();
+    this->run_journal.path = fs::path(this->temp_base_dir) / JOURNAL_NAME;
+    remove_stale_runs(this->temp_base_dir);
+
+    auto file = std::ifstream(this->run_journal.path, std::ios::binary);
+    if (!file) {
+        return;
+    }
+    auto contents = std::string(std::istreambuf_iterator<char>(file), {});
+
+    // A line is complete once its newline is written, so the last piece is
+    // either empty or the remains of a write that was cut short.
+    auto lines = QString::fromStdString(contents).split('\n');
+    lines.removeLast();
+    auto &journal = this->run_journal;
+    for (const auto &line : lines) {
+        auto fields = line.split('\t');
+        if (fields[0] == "output" && fields.size() == 2) {
+            journal.output_dir = fs::path(fields[1].toStdString());
+        }
+        else if (fields[0] == "stage" && fields.size() == 3) {
+            journal.staging_names.insert(fields[1], fields[2]);
+        }
+        else if (fields[0] == "page" && fields.size() == 4) {
+            auto is_number = false;
+            auto page_number = fields[2].toInt(&is_number);
+            if (is_number) {
+                journal.finished_pages[fields[1]].insert(page_number);
+                journal.finished_base_names[fields[1]].insert(fields[3]);
+            }
+        }
+        else if (fields[0] == "archive" && fields.size() >= 2) {
+            journal.finished_archives.insert(fields[1], fields.mid(2));
+        }
+        else if (fields[0] == "restart" && fields.size() == 2) {
+            journal.staging_names.remove(fields[1]);
+            journal.finished_pages.remove(fields[1]);
+            journal.finished_base_names.remove(fields[1]);
+            journal.finished_archives.remove(fields[1]);
+        }
+    }
+    journal.resumed = true;
+
+    // The book state may have been left half written, and the pages that it
+    // recorded may not have finished, so it’s worked out again.
+    remove_book_state(this->temp_base_dir);
+
+    auto finished_pages = 0;
+    for (const auto &pages : journal.finished_pages) {
+        finished_pages += pages.size();
+    }
+    this->log_output->setVisible(true);
+    this->log_output->append(
+        QString("Resuming an interrupted run: %1 pages and %2 books were "
+                "already finished.")
+            .arg(finished_pages)
+            .arg(journal.finished_archives.size())
+    );
+}
+
+void Window::append_to_journal(const QStringList &fields) {
+    if (this->run_journal.path.empty()) {
+        return;
+    }
+    auto file = std::ofstream(
+        this->run_journal.path, std::ios::binary | std::ios::app
+    );
+    file << fields.join('\t').toStdString() << '\n';
+    file.flush();
+}
+
+bool Window::is_archive_finished(const QString &source) {
+    auto &journal = this->run_journal;
+    if (!journal.finished_archives.contains(source)) {
+        return false;
+    }
+    auto archives = journal.finished_archives.value(source);
+    auto ec = std::error_code();
+    auto all_exist
+        = std::all_of(archives.begin(), archives.end(), [&](const auto &path) {
+              return fs::is_regular_file(path.toStdString(), ec);
+          });
+    if (!archives.isEmpty() && all_exist) {
+        return true;
+    }
+
+    // Its staged pages were removed once it was packaged, so none of them
+    // count as finished any more.
+    journal.staging_names.remove(source);
+    journal.finished_pages.remove(source);
+    journal.finished_base_names.remove(source);
+    journal.finished_archives.remove(source);
+    this->append_to_journal({"restart", source});
+    return false;
+}
+
+fs::path
+Window::staging_dir_for(const QString &source, const std::string &stem) {
+    auto name = this->run_journal.staging_names.value(source);
+    auto staging_dir = fs::path();
+    if (name.isEmpty()) {
+        staging_dir = this->create_unique_temp_dir(stem);
+        this->append_to_journal(
+            {"stage",
+             source,
+             QString::fromStdString(staging_dir.filename().string())}
+        );
+    }
+    else {
+        staging_dir = fs::path(this->temp_base_dir) / name.toStdString();
+        fs::create_directories(staging_dir);
+    }
+
+    // Pages that didn’t finish are converted again, so anything they left
+    // behind goes.
+    auto base_names = this->run_journal.finished_base_names.value(source);
+    if (!name.isEmpty()) {
+        remove_unfinished_pages(staging_dir, base_names);
+    }
+    for (const auto &extra : this->extra_display_targets(staging_dir)) {
+        fs::create_directories(extra.target.output_dir);
+        if (!name.isEmpty()) {
+            remove_unfinished_pages(extra.target.output_dir, base_names);
+        }
+    }
+    return staging_dir;
+}
+
+void remove_stale_runs(const fs::path &current_run) {
+    auto now = fs::file_time_type::clock::now();
+    auto ec = std::error_code();
+    for (const auto &entry :
+         fs::directory_iterator(fs::temp_directory_path(), ec)) {
+        auto name = entry.path().filename().string();
+        if (!name.starts_with("comicpress_") || entry.path() == current_run
+            || !entry.is_directory(ec)) {
+            continue;
+        }
+
+        auto journal = entry.path() / JOURNAL_NAME;
+        auto modified = fs::last_write_time(
+            fs::exists(journal, ec) ? journal : entry.path(), ec
+        );
+        if (!ec && now - modified >= STALE_RUN_AGE) {
+            fs::remove_all(entry.path(), ec);
+        }
+    }
+}
+
+// Books keep their state in `.state` next to their staging folders, and each
+// extra device has its own in its `target<n>` folder.
+void remove_book_state(const fs::path &run_dir) {
+    auto ec = std::error_code();
+    fs::remove_all(run_dir / ".state", ec);
+    for (const auto &entry : fs::directory_iterator(run_dir, ec)) {
+        if (entry.path().filename().string().starts_with("target")) {
+            fs::remove_all(entry.path() / ".state", ec);
+        }
+    }
+}
+
+void remove_unfinished_pages(
+    const fs::path &staging_dir, const QSet<QString> &base_names
+) {
+    auto unfinished = std::vector<fs::path>();
+    auto ec = std::error_code();
+    for (const auto &entry :
+         fs::recursive_directory_iterator(staging_dir, ec)) {
+        if (!entry.is_regular_file()) {
+            continue;
+        }
+        auto path = QString::fromStdString(
+            fs::relative(entry.path(), staging_dir).generic_string()
+        );
+        if (!is_finished_page_file(path, base_names)) {
+            unfinished.push_back(entry.path());
+        }
+    }
+    for (const auto &path : unfinished) {
+        fs::remove(path, ec);
+    }
+}
+
+// Page files are named after their page’s base name, then any part suffixes
+// such as `_1` or `_0001`, then an extension. Candidates and files that were
+// still being written have another extension before that, so they never match.
+bool is_finished_page_file(
+    const QString &path, const QSet<QString> &base_names
+) {
+    auto name_start = path.lastIndexOf('/') + 1;
+    auto dot = path.lastIndexOf('.');
+    if (dot < name_start) {
+        return false;
+    }
+
+    auto stem = path.left(dot);
+    while (!base_names.contains(stem)) {
+        auto underscore = stem.lastIndexOf('_');
+        if (underscore < name_start) {
+            return false;
+        }
+        auto suffix = stem.mid(underscore + 1);
+        auto is_number
+            = !suffix.isEmpty()
+           && std::all_of(suffix.begin(), suffix.end(), [](QChar c) {
+                  return c.isDigit();
+              });
+        if (!is_number) {
+            return false;
+        }
+        stem = stem.left(underscore);
+    }
+    return true;
+}
@@ -0,0 +1,91 @@
+#include "include/window.hpp"
+
+#include <QCoreApplication>
+#include <QProcess>
+#include <QPushButton>
+#include <QTextEdit>
+#include <system_error>
+
+// Removes the copy that an optimization worker writes before replacing the
+// archive, in case the worker didn’t get to.
+static void remove_partial_archive(const fs::path &archive_path);
+
+void Window::start_next_optimization() {
+    // Only once every page has been handed out, so that optimization never
+    // takes a core that the conversion could use.
+    while (!this->optimize_queue.isEmpty() && this->task_queue.isEmpty()
+           && !this->is_processing_cancelled
+           && this->running_processes.size() + this->optimize_processes.size()
+                  < this->max_concurrent_workers) {
+        auto archive_path = this->optimize_queue.dequeue();
+        auto process = new QProcess(this);
+        this->optimize_processes.insert(process, archive_path);
+
+        connect(
+            process,
+            &QProcess::readyReadStandardOutput,
+            this,
+            &Window::on_worker_output
+        );
+        connect(
+            process,
+            QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished),
+            this,
+            &Window::on_optimizer_finished
+        );
+
+        process->start(
+            QCoreApplication::applicationFilePath(),
+            {"-optimize_archive", QString::fromStdString(archive_path.string())}
+        );
+    }
+}
+
+void Window::cancel_optimizations() {
+    this->optimize_queue.clear();
+    for (auto [process, archive_path] :
+         this->optimize_processes.asKeyValueRange()) {
+        process->disconnect(this);
+        process->kill();
+        process->waitForFinished();
+        remove_partial_archive(archive_path);
+        process->deleteLater();
+    }
+    this->optimize_processes.clear();
+}
+
+void Window::on_optimizer_finished(
+    int exitCode, QProcess::ExitStatus exitStatus
+) {
+    auto process = qobject_cast<QProcess *>(sender());
+    if (!process || !this->optimize_processes.contains(process)) {
+        return;
+    }
+    auto archive_path = this->optimize_processes.take(process);
+
+    if (exitStatus == QProcess::CrashExit || exitCode != 0) {
+        remove_partial_archive(archive_path);
+        log_output->setVisible(true);
+        log_output->append(QString("Optimizing %1 failed. Exit code: %2")
+                               .arg(
+                                   QString::fromStdString(
+                                       archive_path.filename().string()
+                                   )
+                               )
+                               .arg(exitCode));
+    }
+    process->deleteLater();
+
+    this->start_next_optimization();
+    if (this->optimize_processes.isEmpty() && this->optimize_queue.isEmpty()
+        && this->running_processes.isEmpty() && this->task_queue.isEmpty()) {
+        this->cancel_button->setEnabled(false);
+    }
+}
+
+void remove_partial_archive(const fs::path &archive_path) {
+    auto temp_path = archive_path;
+    temp_path += ".optimizing";
+    auto ec = std::error_code();
+    fs::remove(temp_path, ec);
+}
@@ -58,6 +58,16 @@ void add_convert_to_greyscale_widget(QStyle *style, Options *options) {
     options->settings_layout->addRow(label, control_container);
 }
 
+void add_map_colour_eink_widget(QStyle *style, Options *options) {
+    auto label = new QLabel("Colour e-ink mapping");
+    options->map_colour_eink_check_box = new QCheckBox("Enable");
+    auto control_container = create_control_with_info(
+        style, options->map_colour_eink_check_box, MAP_COLOUR_EINK_TOOLTIP
+    );
+
+    options->settings_layout->addRow(label, control_container);
+}
+
 void add_double_page_spread_widget(QStyle *style, Options *options) {
     auto label = new QLabel("Two-page spreads");
     options->double_page_spread_combo_box = create_combo_box(
@@ -95,6 +105,32 @@ void add_double_page_spread_widget(QStyle *style, Options *options) {
     );
 
     options->settings_layout->addWidget(options->rotation_options_container);
+
+    // Reading direction, which decides which half of a split spread comes
+    // first.
+    options->reading_direction_container = new QWidget();
+    auto reading_layout
+        = new QFormLayout(options->reading_direction_container);
+    reading_layout->setContentsMargins(25, 0, 0, 0);
+    reading_layout->setHorizontalSpacing(10);
+    reading_layout->setLabelAlignment(Qt::AlignRight | Qt::AlignVCenter);
+    reading_layout->setFieldGrowthPolicy(QFormLayout::FieldsStayAtSizeHint);
+
+    auto reading_label = new QLabel("Reading direction");
+    options->reading_direction_combo_box = new QComboBox();
+    options->reading_direction_combo_box->addItems(
+        {"Left to right", "Right to left"}
+    );
+    options->reading_direction_combo_box->setSizePolicy(
+        QSizePolicy::Maximum, QSizePolicy::Fixed
+    );
+    auto reading_container = create_control_with_info(
+        style, options->reading_direction_combo_box, READING_DIRECTION_TOOLTIP
+    );
+    reading_layout->addRow(reading_label, reading_container);
+
+    options->reading_direction_container->setVisible(false);
+    options->settings_layout->addWidget(options->reading_direction_container);
 }
 
 void add_linear_light_resampling_widget(QStyle *style, Options *options) {
@@ -122,6 +158,58 @@ void add_remove_spine_widget(QStyle *style, Options *options) {
     options->settings_layout->addRow(label, control_container);
 }
 
+void add_crop_margins_widget(QStyle *style, Options *options) {
+    auto label = new QLabel("Crop margins");
+    options->crop_margins_check_box = new QCheckBox("Enable");
+    auto control_container = create_control_with_info(
+        style, options->crop_margins_check_box, CROP_MARGINS_TOOLTIP
+    );
+
+    options->settings_layout->addRow(label, control_container);
+
+    options->crop_margins_options_container = new QWidget();
+    auto crop_layout = new QFormLayout(options->crop_margins_options_container);
+    crop_layout->setContentsMargins(25, 0, 0, 0);
+    crop_layout->setHorizontalSpacing(10);
+    crop_layout->setLabelAlignment(Qt::AlignRight | Qt::AlignVCenter);
+    crop_layout->setFieldGrowthPolicy(QFormLayout::FieldsStayAtSizeHint);
+
+    auto per_book_label = new QLabel("Same crop for every page");
+    options->crop_margins_per_book_check_box = new QCheckBox("Enable");
+    auto per_book_container = create_control_with_info(
+        style,
+        options->crop_margins_per_book_check_box,
+        CROP_MARGINS_PER_BOOK_TOOLTIP
+    );
+    crop_layout->addRow(per_book_label, per_book_container);
+
+    options->crop_margins_options_container->setVisible(false);
+    options->settings_layout->addWidget(
+        options->crop_margins_options_container
+    );
+}
+
+void add_slice_long_strips_widget(QStyle *style, Options *options) {
+    auto label = new QLabel("Slice long strips");
+    options->slice_long_strips_check_box = new QCheckBox("Enable");
+    auto control_container = create_control_with_info(
+        style, options->slice_long_strips_check_box, SLICE_LONG_STRIPS_TOOLTIP
+    );
+
+    options->settings_layout->addRow(label, control_container);
+}
+
+void add_deduplicate_pages_widget(QStyle *style, Options *options) {
+    auto label = new QLabel("Reuse duplicate pages");
+    options->deduplicate_pages_check_box = new QCheckBox("Enable");
+    options->deduplicate_pages_check_box->setChecked(false);
+    auto control_container = create_control_with_info(
+        style, options->deduplicate_pages_check_box, DEDUPLICATE_PAGES_TOOLTIP
+    );
+
+    options->settings_layout->addRow(label, control_container);
+}
+
 void add_contrast_widget(QStyle *style, Options *options) {
     auto label = new QLabel("Stretch contrast");
     options->contrast_check_box = new QCheckBox("Enable");
@@ -254,6 +342,14 @@ void add_quantization_widgets(QStyle *style, Options *options) {
     );
     quantization_layout->addRow(dithering_label, dithering_container);
 
+    // Book palette
+    auto book_palette_label = new QLabel("Same palette for every page");
+    options->share_book_palette_check_box = new QCheckBox("Enable");
+    auto book_palette_container = create_control_with_info(
+        style, options->share_book_palette_check_box, BOOK_PALETTE_TOOLTIP
+    );
+    quantization_layout->addRow(book_palette_label, book_palette_container);
+
     options->settings_layout->addWidget(
         options->quantization_options_container
     );
@@ -261,7 +357,9 @@ void add_quantization_widgets(QStyle *style, Options *options) {
 
 void add_image_format_widgets(QStyle *style, Options *options) {
     options->image_format_combo_box
-        = create_combo_box({"AVIF", "JPEG", "JPEG XL", "PNG", "WebP"}, "PNG");
+        = create_combo_box(
+            {"Auto", "AVIF", "JPEG", "JPEG XL", "PNG", "WebP"}, "PNG"
+        );
     auto image_format_label = new QLabel("Image format");
     options->image_format_label = image_format_label;
     auto image_format_container = create_control_with_info(
@@ -287,7 +385,9 @@ void add_image_format_widgets(QStyle *style, Options *options) {
     auto compression_type_label = new QLabel("Compression type");
     options->image_compression_type_label = compression_type_label;
     options->image_compression_type_combo_box = new QComboBox();
-    options->image_compression_type_combo_box->addItems({"Lossless", "Lossy"});
+    options->image_compression_type_combo_box->addItems(
+        {"Lossless", "Lossy", "Target quality"}
+    );
     options->image_compression_type_combo_box->setCurrentText("Lossless");
     options->image_compression_type_combo_box->setSizePolicy(
         QSizePolicy::Maximum, QSizePolicy::Fixed
@@ -319,6 +419,24 @@ void add_image_format_widgets(QStyle *style, Options *options) {
         options->image_compression_label, options->image_compression_spin_box
     );
 
+    // Time budget
+    options->time_budget_label = new QLabel("Time budget");
+    options->time_budget_spin_box = new QSpinBox();
+    options->time_budget_spin_box->setRange(0, 24 * 60);
+    options->time_budget_spin_box->setSingleStep(5);
+    options->time_budget_spin_box->setValue(0);
+    options->time_budget_spin_box->setSuffix(" min");
+    options->time_budget_spin_box->setSpecialValueText("Off");
+    options->time_budget_spin_box->setSizePolicy(
+        QSizePolicy::Maximum, QSizePolicy::Fixed
+    );
+    options->time_budget_container = create_control_with_info(
+        style, options->time_budget_spin_box, TIME_BUDGET_TOOLTIP
+    );
+    image_format_layout->addRow(
+        options->time_budget_label, options->time_budget_container
+    );
+
     // Quality label container (for dynamic switching)
     auto quality_label_container = new QWidget();
     auto quality_label_hbox = new QHBoxLayout(quality_label_container);
@@ -359,6 +477,28 @@ void add_image_format_widgets(QStyle *style, Options *options) {
     options->image_quality_jpeg_xl_tooltip = image_quality_jpeg_xl_pair.second;
     options->image_quality_jpeg_xl_tooltip->setVisible(false);
 
+    // Target quality
+    options->image_target_quality_label = new QLabel("Target SSIM");
+    options->image_target_quality_spin_box = new QDoubleSpinBox();
+    options->image_target_quality_spin_box->setRange(0.5, 0.999);
+    options->image_target_quality_spin_box->setSingleStep(0.005);
+    options->image_target_quality_spin_box->setDecimals(3);
+    options->image_target_quality_spin_box->setValue(0.98);
+    options->image_target_quality_spin_box->setSizePolicy(
+        QSizePolicy::Maximum, QSizePolicy::Fixed
+    );
+    options->image_target_quality_container = create_control_with_info(
+        style,
+        options->image_target_quality_spin_box,
+        IMAGE_TARGET_QUALITY_TOOLTIP
+    );
+    image_format_layout->addRow(
+        options->image_target_quality_label,
+        options->image_target_quality_container
+    );
+    options->image_target_quality_label->setVisible(false);
+    options->image_target_quality_container->setVisible(false);
+
     options->settings_layout->addWidget(image_format_options_container);
 }
 
@@ -376,3 +516,59 @@ void add_parallel_workers_widget(QStyle *, Options *options) {
 
     options->settings_layout->addRow(label, options->workers_spin_box);
 }
+
+void add_optimize_when_idle_widget(QStyle *style, Options *options) {
+    options->optimize_when_idle_label = new QLabel("Optimize when idle");
+    options->optimize_when_idle_check_box = new QCheckBox("Enable");
+    options->optimize_when_idle_container = create_control_with_info(
+        style, options->optimize_when_idle_check_box, OPTIMIZE_WHEN_IDLE_TOOLTIP
+    );
+
+    options->settings_layout->addRow(
+        options->optimize_when_idle_label,
+        options->optimize_when_idle_container
+    );
+}
+
+void add_cache_pages_widget(QStyle *style, Options *options) {
+    options->cache_pages_label = new QLabel("Cache processed pages");
+    options->cache_pages_check_box = new QCheckBox("Enable");
+    options->cache_pages_container = create_control_with_info(
+        style, options->cache_pages_check_box, CACHE_PAGES_TOOLTIP
+    );
+
+    options->settings_layout->addRow(
+        options->cache_pages_label, options->cache_pages_container
+    );
+}
+
+void add_source_cache_widget(QStyle *style, Options *options) {
+    options->source_cache_label = new QLabel("Cache decoded pages");
+    options->source_cache_spin_box = new QSpinBox();
+    options->source_cache_spin_box->setRange(0, 1000);
+    options->source_cache_spin_box->setValue(0);
+    options->source_cache_spin_box->setSuffix(" GiB");
+    options->source_cache_spin_box->setSpecialValueText("Off");
+    options->source_cache_spin_box->setSizePolicy(
+        QSizePolicy::Maximum, QSizePolicy::Fixed
+    );
+    options->source_cache_container = create_control_with_info(
+        style, options->source_cache_spin_box, SOURCE_CACHE_TOOLTIP
+    );
+
+    options->settings_layout->addRow(
+        options->source_cache_label, options->source_cache_container
+    );
+}
+
+void add_reuse_pages_widget(QStyle *style, Options *options) {
+    options->reuse_pages_label = new QLabel("Reuse unchanged pages");
+    options->reuse_pages_check_box = new QCheckBox("Enable");
+    options->reuse_pages_container = create_control_with_info(
+        style, options->reuse_pages_check_box, REUSE_PAGES_TOOLTIP
+    );
+
+    options->settings_layout->addRow(
+        options->reuse_pages_label, options->reuse_pages_container
+    );
+}
@@ -1,6 +1,8 @@
 #include "include/output_formats.hpp"
 #include <cstdint>
 #include <fstream>
+#include <map>
+#include <optional>
 namespace fs = std::filesystem;
 
 static std::string create_epub_container_xml() {
@@ -31,9 +33,11 @@ static std::string create_epub_container_xml() {
 
 // Constructing a QCollator builds locale tables, so keep one around rather than
 // paying for it on every comparison. Pinned to the en_US locale so page order
-// doesn’t shift with the user’s system locale.
+// doesn’t shift with the user’s system locale. A QCollator can’t be shared
+// between threads, and EPUB and CBZ files can be written at once, so each
+// thread has its own.
 static QCollator &filename_collator() {
-    static auto collator = [] {
+    thread_local auto collator = [] {
         auto collator
             = QCollator(QLocale(QLocale::English, QLocale::UnitedStates));
         collator.setNumericMode(true);
@@ -263,23 +267,60 @@ static std::string create_epub_style_css() {
            "block; }\n";
 }
 
-struct EpubImage {
+// A page and the image shown on it. These differ for pages that reuse another
+// page’s image, which the worker records in a `.ref` file in place of an image.
+struct PageImage {
     fs::path path;
+    fs::path image;
     std::string media_type;
 };
 
+// Returns the image named by a `.ref` file, or nothing if it doesn’t exist.
+static std::optional<fs::path>
+read_page_reference(const fs::path &dir, const fs::path &ref_path) {
+    auto stream = std::ifstream(ref_path, std::ios::binary);
+    auto target = std::string();
+    std::getline(stream, target);
+    if (target.empty()) {
+        return std::nullopt;
+    }
+    if (fs::is_regular_file(dir / target)) {
+        return fs::path(target);
+    }
+
+    // Pages saved in the “Auto” image format are referred to without their
+    // extension.
+    for (auto extension : {".png", ".webp", ".jpg", ".jxl", ".avif"}) {
+        if (fs::is_regular_file(dir / (target + extension))) {
+            return fs::path(target + extension);
+        }
+    }
+    return std::nullopt;
+}
+
 // Returns paths relative to `dir`, in page order. Recursive because
 // `output_base_name` carries the source archive’s directory structure, so pages
 // can sit in subdirectories rather than flat in the `image_dir`.
-static std::vector<EpubImage> collect_epub_images(const fs::path &dir) {
-    auto image_paths = std::vector<EpubImage>{};
+static std::vector<PageImage> collect_page_images(const fs::path &dir) {
+    auto image_paths = std::vector<PageImage>{};
     for (const auto &entry : fs::recursive_directory_iterator(dir)) {
-        auto media_type = image_media_type(entry.path());
+        auto path = fs::relative(entry.path(), dir);
+        auto image = path;
+        if (entry.path().extension() == ".ref") {
+            auto target = read_page_reference(dir, entry.path());
+            if (!target) {
+                continue;
+            }
+            image = *target;
+        }
+
+        auto media_type = image_media_type(image);
         if (media_type.empty()) {
             continue;
         }
         image_paths.push_back(
-            {.path = fs::relative(entry.path(), dir),
+            {.path = std::move(path),
+             .image = std::move(image),
              .media_type = std::move(media_type)}
         );
     }
@@ -287,7 +328,7 @@ static std::vector<EpubImage> collect_epub_images(const fs::path &dir) {
     std::sort(
         image_paths.begin(),
         image_paths.end(),
-        [](const EpubImage &a, const EpubImage &b) {
+        [](const PageImage &a, const PageImage &b) {
             auto a_path = a.path.generic_string();
             auto b_path = b.path.generic_string();
             auto cmp = filename_collator().compare(
@@ -371,8 +412,8 @@ void create_epub(
         throw std::runtime_error(message);
     }
 
-    auto epub_images = collect_epub_images(image_dir);
-    if (epub_images.empty()) {
+    auto page_images = collect_page_images(image_dir);
+    if (page_images.empty()) {
         archive_write_free(archive);
         throw NoImagesError();
         return;
@@ -382,7 +423,7 @@ void create_epub(
     add_file_to_archive(archive, "mimetype", create_epub_mimetype());
     archive_write_zip_set_compression_deflate(archive);
 
-    auto first_image_path = fs::path(epub_images[0].path);
+    auto first_image_path = fs::path(page_images[0].path);
     auto first_page_path
         = "text/"
         + first_image_path.replace_extension(".xhtml").generic_string();
@@ -408,47 +449,72 @@ void create_epub(
         content_opf_writer, title, book_uuid, modified_time
     );
 
+    // Images shown on more than one page are stored and listed in the
+    // manifest once, with the size read from the first time they appear.
+    struct AddedImage {
+        int width;
+        int height;
+    };
+    auto added_images = std::map<fs::path, AddedImage>{};
+
     auto page_ids = std::vector<std::string>{};
-    page_ids.reserve(epub_images.size());
-    for (auto page_num = 1; const auto &epub_image : epub_images) {
-        auto image_path_rel = epub_image.path;
-        auto image_path_abs = image_dir / image_path_rel;
-        auto image
-            = vips::VImage::new_from_file(image_path_abs.string().c_str());
-        auto page_path = fs::path(image_path_rel)
+    page_ids.reserve(page_images.size());
+    for (auto page_num = 1; const auto &page_image : page_images) {
+        auto image_path_rel = page_image.image;
+        auto page_path = fs::path(page_image.path)
                              .replace_extension(".xhtml")
                              .generic_string();
 
-        // Add the image file. Store the bytes directly instead of compressing
-        // since images are already compressed.
-        archive_write_zip_set_compression_store(archive);
-        auto image_path_epub
-            = "OEBPS/images/" + image_path_rel.generic_string();
-        add_file_to_archive(
-            archive,
-            image_path_epub.c_str(),
-            image_path_abs,
-            fs::file_size(image_path_abs)
-        );
-        archive_write_zip_set_compression_deflate(archive);
+        auto added = added_images.find(image_path_rel);
+        if (added == added_images.end()) {
+            auto image_path_abs = image_dir / image_path_rel;
+            auto image
+                = vips::VImage::new_from_file(image_path_abs.string().c_str());
+
+            // Add the image file. Store the bytes directly instead of
+            // compressing since images are already compressed.
+            archive_write_zip_set_compression_store(archive);
+            auto image_path_epub
+                = "OEBPS/images/" + image_path_rel.generic_string();
+            add_file_to_archive(
+                archive,
+                image_path_epub.c_str(),
+                image_path_abs,
+                fs::file_size(image_path_abs)
+            );
+            archive_write_zip_set_compression_deflate(archive);
+
+            // Write an element for the image.
+            auto image_id = "img" + std::to_string(page_num);
+            auto image_href = "images/" + image_path_rel.generic_string();
+            write_manifest_item(
+                content_opf_writer, image_id, image_href, page_image.media_type
+            );
+            if (page_num == 1) {
+                content_opf_writer.writeAttribute("properties", "cover-image");
+            }
+
+            added = added_images
+                        .emplace(
+                            image_path_rel,
+                            AddedImage{
+                                .width = image.width(),
+                                .height = image.height()
+                            }
+                        )
+                        .first;
+        }
 
         // Add the page file.
         auto page_path_epub = "OEBPS/text/" + page_path;
         auto page_xhtml = create_epub_page_xhtml(
-            page_num, image_path_rel, image.width(), image.height()
+            page_num,
+            image_path_rel,
+            added->second.width,
+            added->second.height
         );
         add_file_to_archive(archive, page_path_epub.c_str(), page_xhtml);
 
-        // Write an element for the image.
-        auto image_id = "img" + std::to_string(page_num);
-        auto image_href = "images/" + image_path_rel.generic_string();
-        write_manifest_item(
-            content_opf_writer, image_id, image_href, epub_image.media_type
-        );
-        if (page_num == 1) {
-            content_opf_writer.writeAttribute("properties", "cover-image");
-        }
-
         // Write an element for the page.
         auto page_id = "pg" + std::to_string(page_num);
         auto page_href = "text/" + page_path;
@@ -493,35 +559,23 @@ void create_cbz(const fs::path &image_dir, const fs::path &output_path) {
         throw std::runtime_error(message);
     }
 
-    if (image_dir.empty()) {
+    // Write the pages in page order; readers that don’t sort entries
+    // themselves would otherwise show them in directory order.
+    auto page_images = collect_page_images(image_dir);
+    if (page_images.empty()) {
         archive_write_free(archive);
         throw NoImagesError();
         return;
     }
 
-    for (const auto &dir_entry : fs::recursive_directory_iterator(image_dir)) {
-        if (dir_entry.is_regular_file()) {
-            auto path = dir_entry.path();
-            auto relative_path = fs::relative(path, image_dir);
-
-            auto entry = archive_entry_new();
-            archive_entry_set_pathname(entry, relative_path.string().c_str());
-            archive_entry_set_size(entry, fs::file_size(path));
-            archive_entry_set_filetype(entry, AE_IFREG);
-            archive_entry_set_perm(entry, 0644);
-            archive_write_header(archive, entry);
-
-            auto file_stream = std::ifstream(path, std::ios::binary);
-            char buffer[8192];
-            while (file_stream.good()) {
-                file_stream.read(buffer, sizeof(buffer));
-                archive_write_data(
-                    archive, buffer, static_cast<size_t>(file_stream.gcount())
-                );
-            }
-
-            archive_entry_free(entry);
-        }
+    // CBZ has no way to refer to another entry, so pages that reuse an image
+    // get a copy of it under their own name.
+    for (const auto &page_image : page_images) {
+        auto path = image_dir / page_image.image;
+        auto name = fs::path(page_image.path)
+                        .replace_extension(page_image.image.extension())
+                        .generic_string();
+        add_file_to_archive(archive, name.c_str(), path, fs::file_size(path));
     }
 
     archive_write_close(archive);
@@ -73,6 +73,12 @@ void Window::connect_signals() {
         this,
         &Window::on_add_files_clicked
     );
+    connect(
+        this->sync_library_button,
+        &QPushButton::clicked,
+        this,
+        &Window::on_sync_library_clicked
+    );
     connect(
         this->remove_selected_button,
         &QPushButton::clicked,
@@ -111,12 +117,24 @@ void Window::connect_signals() {
         this,
         &Window::on_double_page_spread_changed
     );
+    connect(
+        this->options.crop_margins_check_box,
+        &QCheckBox::checkStateChanged,
+        this,
+        &Window::on_crop_margins_changed
+    );
     connect(
         this->options.convert_to_greyscale,
         &QCheckBox::checkStateChanged,
         this,
         &Window::on_preset_option_modified
     );
+    connect(
+        this->options.map_colour_eink_check_box,
+        &QCheckBox::checkStateChanged,
+        this,
+        &Window::on_preset_option_modified
+    );
     connect(
         this->options.bit_depth_combo_box,
         QOverload<int>::of(&QComboBox::currentIndexChanged),
@@ -245,6 +263,32 @@ void Window::on_add_files_clicked() {
     this->update_file_list_buttons();
 }
 
+void Window::on_sync_library_clicked() {
+    if (!this->task_queue.isEmpty() || !this->running_processes.isEmpty()) {
+        this->log_output->setVisible(true);
+        this->log_output->append(
+            "Wait for the conversion to finish before syncing a library."
+        );
+        return;
+    }
+
+    QString dir = choose_directory(
+        this,
+        tr("Choose a library folder"),
+        QStandardPaths::writableLocation(QStandardPaths::DocumentsLocation)
+    );
+    if (dir.isEmpty()) {
+        return;
+    }
+    if (!this->ensure_output_dir()) {
+        this->log_output->setVisible(true);
+        this->log_output->append("No output folder selected.");
+        return;
+    }
+
+    this->start_library_sync(fs::path(dir.toStdString()));
+}
+
 void Window::on_remove_selected_clicked() {
     qDeleteAll(this->file_list->selectedItems());
     this->update_file_list_buttons();
@@ -335,14 +379,16 @@ void Window::on_output_format_combo_box_changed(const QString &text) {
         return;
     }
 
-    // EPUB does not support the AVIF or JPEG XL image formats.
-    auto hidden = text == "EPUB";
+    // EPUB does not support the AVIF or JPEG XL image formats, so neither
+    // does writing both. The “Auto” format only chooses between the formats
+    // that the output format allows.
+    auto hidden = text != "CBZ";
     auto image_format = image_format_combo->currentText();
     if (hidden && (image_format == "AVIF" || image_format == "JPEG XL")) {
         image_format_combo->setCurrentText("PNG");
     }
-    view->setRowHidden(0, hidden); // AVIF
-    view->setRowHidden(2, hidden); // JPEG XL
+    view->setRowHidden(image_format_combo->findText("AVIF"), hidden);
+    view->setRowHidden(image_format_combo->findText("JPEG XL"), hidden);
 }
 
 #if defined(PDF_ENABLED)
@@ -369,6 +415,16 @@ void Window::on_pdf_pixel_density_combo_box_changed(const QString &text) {
 void Window::on_double_page_spread_changed(const QString &text) {
     bool should_show = (text == "Rotate page" || text == "Rotate and split");
     this->options.rotation_options_container->setVisible(should_show);
+
+    bool should_split
+        = (text == "Split into two pages" || text == "Rotate and split");
+    this->options.reading_direction_container->setVisible(should_split);
+}
+
+void Window::on_crop_margins_changed(int state) {
+    this->options.crop_margins_options_container->setVisible(
+        state == Qt::Checked
+    );
 }
 
 void Window::on_preset_option_modified() {
@@ -392,22 +448,15 @@ void Window::on_display_preset_changed() {
 
     this->is_programmatically_changing_values = true;
 
-    const auto &models = DISPLAY_PRESETS.at(brand).value();
-    auto it = std::find_if(
-        models.begin(), models.end(), [&model](const auto &pair) {
-            return pair.first == model;
-        }
-    );
-
-    if (it != models.end()) {
-        const DisplaySpec &display = it->second;
+    if (auto display = find_display_spec(brand, model)) {
         this->options.enable_image_scaling_check_box->setChecked(true);
-        this->options.width_spin_box->setValue(display.width);
-        this->options.height_spin_box->setValue(display.height);
+        this->options.width_spin_box->setValue(display->width);
+        this->options.height_spin_box->setValue(display->height);
         this->options.bit_depth_combo_box->setCurrentIndex(
-            display.bit_depth_index
+            display->bit_depth_index
         );
-        this->options.convert_to_greyscale->setChecked(!display.colour);
+        this->options.convert_to_greyscale->setChecked(!display->colour);
+        this->options.map_colour_eink_check_box->setChecked(display->colour);
     }
 
     this->is_programmatically_changing_values = false;
@@ -445,6 +494,14 @@ void Window::on_advanced_options_changed(int state) {
 
     this->options.workers_label->setVisible(is_checked);
     this->options.workers_spin_box->setVisible(is_checked);
+    this->options.optimize_when_idle_label->setVisible(is_checked);
+    this->options.optimize_when_idle_container->setVisible(is_checked);
+    this->options.cache_pages_label->setVisible(is_checked);
+    this->options.cache_pages_container->setVisible(is_checked);
+    this->options.source_cache_label->setVisible(is_checked);
+    this->options.source_cache_container->setVisible(is_checked);
+    this->options.reuse_pages_label->setVisible(is_checked);
+    this->options.reuse_pages_container->setVisible(is_checked);
 }
 
 void Window::on_enable_image_scaling_changed(int state) {
@@ -483,7 +540,12 @@ void Window::on_image_format_changed() {
     auto compression_type_visible = false;
     auto compression_effort_visible = true;
 
-    if (img_format == "AVIF") {
+    if (img_format == "Auto") {
+        // Each candidate format is encoded at its own default effort.
+        quality = this->auto_quality;
+        compression_effort_visible = false;
+    }
+    else if (img_format == "AVIF") {
         compression_effort = this->avif_compression_effort;
         quality = this->avif_quality;
         compression_type_visible = true;
@@ -550,6 +612,8 @@ void Window::on_image_format_changed() {
     this->options.image_compression_spin_box->setVisible(
         compression_effort_visible
     );
+    this->options.time_budget_label->setVisible(compression_effort_visible);
+    this->options.time_budget_container->setVisible(compression_effort_visible);
 
     this->on_image_compression_type_changed(false);
 }
@@ -580,15 +644,26 @@ void Window::on_image_compression_type_changed(bool is_explicit) {
         = this->options.image_compression_type_combo_box->currentText();
     auto image_quality_visible
         = img_format != "PNG"
-       && (img_format == "JPEG" || compression_type == "Lossy");
+       && (img_format == "Auto" || img_format == "JPEG"
+           || compression_type == "Lossy");
     auto jpeg_xl_quality_tooltip_visible
         = img_format == "JPEG XL" && compression_type == "Lossy";
+    auto target_quality_visible
+        = (img_format == "AVIF" || img_format == "JPEG XL"
+           || img_format == "WebP")
+       && compression_type == "Target quality";
 
     this->options.image_quality_label->setVisible(image_quality_visible);
     this->options.image_quality_spin_box->setVisible(image_quality_visible);
     this->options.image_quality_jpeg_xl_tooltip->setVisible(
         jpeg_xl_quality_tooltip_visible
     );
+    this->options.image_target_quality_label->setVisible(
+        target_quality_visible
+    );
+    this->options.image_target_quality_container->setVisible(
+        target_quality_visible
+    );
 
     if (is_explicit) {
         this->compression_type_changed = true;
@@ -597,7 +672,10 @@ void Window::on_image_compression_type_changed(bool is_explicit) {
 
 void Window::on_image_quality_changed(double value) {
     auto img_format = this->options.image_format_combo_box->currentText();
-    if (img_format == "AVIF") {
+    if (img_format == "Auto") {
+        this->auto_quality = static_cast<int>(value);
+    }
+    else if (img_format == "AVIF") {
         this->avif_quality = static_cast<int>(value);
     }
     else if (img_format == "JPEG") {
@@ -662,6 +740,10 @@ void Window::on_start_button_clicked() {
         return;
     }
 
+    this->start_conversion(input_file_paths);
+}
+
+void Window::start_conversion(const QStringList &input_file_paths) {
     // The only point where a folder is required, so it is the only point we
     // ask. Covers the first conversion, and a folder that became unusable
     // since it was chosen.
@@ -671,13 +753,9 @@ void Window::on_start_button_clicked() {
         return;
     }
 
-    // Create unique base temp directory for this run
-    auto now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                      std::chrono::system_clock::now().time_since_epoch()
-    )
-                      .count();
-    fs::path temp_base_path
-        = fs::temp_directory_path() / ("comicpress_" + std::to_string(now_ms));
+    // The same batch always gets the same base temp directory, so that a run
+    // that was interrupted can resume from its journal.
+    auto temp_base_path = this->batch_temp_dir(input_file_paths);
 
     try {
         fs::create_directories(temp_base_path);
@@ -699,6 +777,7 @@ void Window::on_start_button_clicked() {
     running_processes.clear();
     running_tasks.clear();
     archive_task_counts.clear();
+    this->archive_temp_dirs.clear();
     this->total_pages_per_archive.clear();
     this->pages_processed_per_archive.clear();
     this->active_file_widgets.clear();
@@ -714,6 +793,7 @@ void Window::on_start_button_clicked() {
     this->progress_bar->setValue(0);
     this->log_group->setVisible(true);
     this->progress_bar->setVisible(true);
+    this->load_run_journal();
 
     auto now = std::chrono::system_clock::now();
     auto now_time = std::chrono::system_clock::to_time_t(now);
@@ -725,8 +805,18 @@ void Window::on_start_button_clicked() {
         = fs::path(effective_output_dir().toStdString()) / oss.str();
 
     auto output_dir = output_base_dir;
+    auto resume_output = this->run_journal.output_dir.has_value()
+                      && fs::is_directory(*this->run_journal.output_dir);
+    if (this->library_sync) {
+        // A library sync updates its mirror in place.
+        output_dir = this->library_sync->mirror_dir;
+    }
+    else if (resume_output) {
+        // A resumed run finishes the books in the folder it started.
+        output_dir = *this->run_journal.output_dir;
+    }
     auto i = 1;
-    while (fs::exists(output_dir)) {
+    while (!this->library_sync && !resume_output && fs::exists(output_dir)) {
         if (i > 1000) {
             throw std::runtime_error("Failed to create output directory.");
         }
@@ -736,10 +826,22 @@ void Window::on_start_button_clicked() {
 
     fs::create_directories(output_dir);
     this->output_path = output_dir;
+    if (!resume_output) {
+        this->append_to_journal(
+            {"output", QString::fromStdString(output_dir.string())}
+        );
+    }
 
     QCoreApplication::processEvents();
 
-    QVector<PageTask> tasks;
+    // Every page of the run shares these, so each queued page only records
+    // its book and its index.
+    this->job_options
+        = std::make_shared<const JobOptions>(this->create_job_options());
+    this->run_books.clear();
+    // Books whose pages all finished before the run was interrupted, which
+    // only need packaging.
+    QStringList archives_to_finish;
     for (const QString &file_qstr : input_file_paths) {
         fs::path source_file(file_qstr.toStdString());
         std::string extension = source_file.extension().string();
@@ -747,11 +849,21 @@ void Window::on_start_button_clicked() {
             extension.begin(), extension.end(), extension.begin(), ::tolower
         );
 
+        if (this->is_archive_finished(file_qstr)) {
+            log_output->setVisible(true);
+            log_output->append(
+                "Already converted before the interruption: " + file_qstr
+            );
+            continue;
+        }
+        auto finished_pages = this->run_journal.finished_pages.value(file_qstr);
+
         try {
             if (extension == ".cbz" || extension == ".cbr") {
-                auto temp_archive_dir
-                    = fs::path(this->temp_base_dir) / source_file.stem();
-                fs::create_directories(temp_archive_dir);
+                auto temp_archive_dir = this->staging_dir_for(
+                    file_qstr, source_file.stem().string()
+                );
+                this->archive_temp_dirs[file_qstr] = temp_archive_dir;
 
                 auto archive = archive_read_new();
                 archive_read_support_filter_all(archive);
@@ -760,20 +872,29 @@ void Window::on_start_button_clicked() {
                     archive, source_file.string().c_str(), 10240
                 );
 
-                int page_count = 0;
+                auto book = RunBook{
+                    .source_file = source_file,
+                    .staging_dir = temp_archive_dir,
+                    .entries = {},
+                    .page_count = 0,
+                };
                 struct archive_entry *entry;
                 while (archive_read_next_header(archive, &entry)
                        == ARCHIVE_OK) {
                     if (archive_entry_filetype(entry) == AE_IFREG) {
-                        page_count += 1;
+                        book.entries.push_back(archive_entry_pathname(entry));
                     }
                 }
                 archive_read_close(archive);
                 archive_read_free(archive);
 
-                archive_task_counts[file_qstr] = page_count;
+                auto page_count = static_cast<int>(book.entries.size());
+                book.page_count = page_count;
+
+                auto remaining_pages = page_count - finished_pages.size();
+                archive_task_counts[file_qstr] = remaining_pages;
                 this->total_pages_per_archive[file_qstr] = page_count;
-                this->total_pages += page_count;
+                this->total_pages += remaining_pages;
                 this->pages_processed_per_archive[file_qstr] = 0;
                 if (page_count == 0) {
                     log_output->setVisible(true);
@@ -782,34 +903,12 @@ void Window::on_start_button_clicked() {
                     );
                     continue;
                 }
-
-                archive = archive_read_new();
-                archive_read_support_filter_all(archive);
-                archive_read_support_format_all(archive);
-                archive_read_open_filename(
-                    archive, source_file.string().c_str(), 10240
-                );
-
-                int i = 0;
-                while (archive_read_next_header(archive, &entry)
-                       == ARCHIVE_OK) {
-                    if (archive_entry_filetype(entry) != AE_IFREG) {
-                        continue;
-                    }
-
-                    auto task
-                        = this->create_task(source_file, temp_archive_dir, i);
-                    task.path_in_archive = archive_entry_pathname(entry);
-
-                    fs::path entry_path(task.path_in_archive);
-                    task.output_base_name
-                        = entry_path.replace_extension("").string();
-
-                    task_queue.enqueue(task);
-                    i += 1;
+                if (remaining_pages == 0) {
+                    archives_to_finish.append(file_qstr);
+                    continue;
                 }
-                archive_read_close(archive);
-                archive_read_free(archive);
+
+                this->enqueue_book(std::move(book), finished_pages);
             }
 #if defined(PDF_ENABLED)
             else if (extension == ".pdf") {
@@ -836,19 +935,28 @@ void Window::on_start_button_clicked() {
                     continue;
                 }
 
-                auto temp_archive_dir
-                    = fs::path(this->temp_base_dir) / source_file.stem();
-                fs::create_directories(temp_archive_dir);
-                archive_task_counts[file_qstr] = page_count;
+                auto temp_archive_dir = this->staging_dir_for(
+                    file_qstr, source_file.stem().string()
+                );
+                this->archive_temp_dirs[file_qstr] = temp_archive_dir;
+                auto remaining_pages = page_count - finished_pages.size();
+                archive_task_counts[file_qstr] = remaining_pages;
                 this->total_pages_per_archive[file_qstr] = page_count;
-                this->total_pages += page_count;
+                this->total_pages += remaining_pages;
                 this->pages_processed_per_archive[file_qstr] = 0;
-
-                for (int i = 0; i < page_count; i += 1) {
-                    auto task
-                        = this->create_task(source_file, temp_archive_dir, i);
-                    task_queue.enqueue(task);
+                if (remaining_pages == 0) {
+                    archives_to_finish.append(file_qstr);
                 }
+
+                this->enqueue_book(
+                    RunBook{
+                        .source_file = source_file,
+                        .staging_dir = temp_archive_dir,
+                        .entries = {},
+                        .page_count = page_count,
+                    },
+                    finished_pages
+                );
                 FPDF_CloseDocument(doc);
             }
 #endif
@@ -860,9 +968,18 @@ void Window::on_start_button_clicked() {
         }
     }
 
+    for (const auto &source : archives_to_finish) {
+        archive_task_counts.remove(source);
+        this->create_archive(source);
+    }
+
     if (task_queue.isEmpty()) {
         log_output->setVisible(true);
-        log_output->append("No pages found to process.");
+        log_output->append(
+            this->run_journal.resumed
+                ? "Nothing was left to convert from the interrupted run."
+                : "No pages found to process."
+        );
         this->options.settings_group->setEnabled(true);
         start_button->setEnabled(true);
         cancel_button->setEnabled(false);
@@ -896,6 +1013,7 @@ void Window::on_start_button_clicked() {
     start_time = ms;
     last_eta_time = ms;
     images_since_last_eta = 0;
+    this->reset_effort_budget();
     last_progress_value = 0;
     elapsed_label->setText("Elapsed: –");
     eta_label->setText("ETA: –");
@@ -913,6 +1031,7 @@ void Window::on_cancel_button_clicked() {
     is_processing_cancelled = true;
 
     task_queue.clear();
+    this->cancel_optimizations();
 
     for (QProcess *p : running_processes) {
         p->kill();
@@ -939,18 +1058,16 @@ void Window::on_cancel_button_clicked() {
     this->options.settings_group->setEnabled(true);
     start_button->setEnabled(true);
     cancel_button->setEnabled(false);
+    this->finish_library_sync();
 
-    // Clean up base temp dir on cancel
+    // The staged pages and the journal are kept, so that starting the same
+    // batch again resumes it.
     if (!this->temp_base_dir.empty()) {
-        try {
-            fs::remove_all(this->temp_base_dir);
-        }
-        catch (const std::exception &e) {
-            log_output->setVisible(true);
-            log_output->append(
-                QString("Error cleaning up temp directory: %1").arg(e.what())
-            );
-        }
+        log_output->setVisible(true);
+        log_output->append(
+            "Finished pages are kept. Start the same files with the same "
+            "settings to resume."
+        );
         this->temp_base_dir.clear();
     }
 
@@ -971,6 +1088,7 @@ void Window::on_worker_finished(int exitCode, QProcess::ExitStatus exitStatus) {
         return;
     }
     PageTask finished_task = running_tasks.take(process);
+    this->record_page_time(process, finished_task);
 
     if (exitStatus == QProcess::CrashExit || exitCode != 0) {
         log_output->setVisible(true);
@@ -979,6 +1097,14 @@ void Window::on_worker_finished(int exitCode, QProcess::ExitStatus exitStatus) {
                 .arg(exitCode)
         );
     }
+    else {
+        this->append_to_journal(
+            {"page",
+             QString::fromStdString(finished_task.source_file.string()),
+             QString::number(finished_task.page_number),
+             QString::fromStdString(finished_task.output_base_name)}
+        );
+    }
 
     handle_task_finished();
 
@@ -1029,10 +1155,16 @@ void Window::on_worker_finished(int exitCode, QProcess::ExitStatus exitStatus) {
     }
     else {
         if (pages_processed == total_pages) {
+            this->write_effort_report();
+            this->finish_library_sync();
             timer->stop();
             this->options.settings_group->setEnabled(true);
             start_button->setEnabled(true);
-            cancel_button->setEnabled(false);
+            // Optimizations can still be cancelled.
+            cancel_button->setEnabled(
+                !this->optimize_queue.isEmpty()
+                || !this->optimize_processes.isEmpty()
+            );
 
             // Clean up base temp dir on success
             if (!this->temp_base_dir.empty()) {
@@ -1052,6 +1184,7 @@ void Window::on_worker_finished(int exitCode, QProcess::ExitStatus exitStatus) {
         else {
             start_next_task();
         }
+        this->start_next_optimization();
     }
 
     process->deleteLater();
@@ -1062,8 +1195,13 @@ void Window::on_worker_output() {
     if (process) {
         // Read line by line to prevent partial messages
         while (process->canReadLine()) {
+            auto line = QString::fromUtf8(process->readLine().trimmed());
+            if (line.startsWith('@')) {
+                this->record_worker_status(process, line);
+                continue;
+            }
             log_output->setVisible(true);
-            log_output->append(process->readLine().trimmed());
+            log_output->append(line);
         }
     }
 }
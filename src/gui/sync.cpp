@@ -0,0 +1,359 @@
+#include "include/window.hpp"
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QSaveFile>
+#include <QSet>
+#include <QTextEdit>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+// The index is kept in the mirror’s top folder.
+const auto SYNC_INDEX_NAME = ".comicpress-sync.json";
+// Raise it when the index changes in a way that older entries can’t be read.
+const auto SYNC_INDEX_VERSION = 1;
+// While a sync runs, the index is saved at most this often, so that a crash
+// loses little work without rewriting a large index after every book.
+const auto SYNC_INDEX_SAVE_INTERVAL = std::chrono::seconds(30);
+
+static std::vector<fs::path>
+find_library_sources(const fs::path &library_dir, const fs::path &mirror_dir);
+static QString file_content_hash(const fs::path &path);
+static QString modification_time(const fs::path &path);
+static bool outputs_exist(const fs::path &mirror_dir, const QJsonObject &entry);
+static void remove_output(const fs::path &mirror_dir, const QString &output);
+
+void Window::start_library_sync(const fs::path &library_dir) {
+    auto sync = LibrarySync{
+        .library_dir = library_dir,
+        .mirror_dir = fs::path(this->effective_output_dir().toStdString())
+                    / library_dir.filename(),
+        .files = QJsonObject(),
+        .options_fingerprint = this->options_fingerprint(),
+        .saved_at = std::chrono::steady_clock::now(),
+    };
+
+    auto to_convert = QStringList();
+    auto unchanged = 0;
+    auto removed = 0;
+    try {
+        fs::create_directories(sync.mirror_dir);
+        auto index_file = QFile(
+            QString::fromStdString((sync.mirror_dir / SYNC_INDEX_NAME).string())
+        );
+        if (index_file.open(QIODevice::ReadOnly)) {
+            auto index = QJsonDocument::fromJson(index_file.readAll()).object();
+            if (index.value("version").toInt() == SYNC_INDEX_VERSION) {
+                sync.files = index.value("files").toObject();
+            }
+        }
+
+        auto seen = QSet<QString>();
+        auto output_names = QSet<QString>();
+        for (const auto &source :
+             find_library_sources(sync.library_dir, sync.mirror_dir)) {
+            auto key = QString::fromStdString(
+                fs::relative(source, sync.library_dir).generic_string()
+            );
+            seen.insert(key);
+
+            // Outputs are named after the source without its extension, so
+            // books such as `a.cbz` and `a.cbr` in one folder would overwrite
+            // each other’s. Only the first is converted. The others are left
+            // out of the index, without removing the outputs that they share.
+            auto output_name = QString::fromStdString(
+                fs::relative(source, sync.library_dir)
+                    .replace_extension()
+                    .generic_string()
+            );
+            if (output_names.contains(output_name)) {
+                sync.files.remove(key);
+                this->log_output->setVisible(true);
+                this->log_output->append(
+                    QString("Skipping %1: another book in its folder has the "
+                            "same name.")
+                        .arg(key)
+                );
+                continue;
+            }
+            output_names.insert(output_name);
+
+            // Sources are compared by size and modification time first. Only
+            // when those disagree is the content hashed, so that a source that
+            // was merely touched isn’t converted again.
+            auto entry = sync.files.value(key).toObject();
+            if (!entry.isEmpty()
+                && entry.value("options").toString()
+                       == sync.options_fingerprint
+                && outputs_exist(sync.mirror_dir, entry)) {
+                auto size = static_cast<qint64>(fs::file_size(source));
+                auto modified = modification_time(source);
+                if (entry.value("size").toInteger() == size) {
+                    if (entry.value("modified").toString() == modified) {
+                        unchanged += 1;
+                        continue;
+                    }
+                    if (entry.value("hash").toString()
+                        == file_content_hash(source)) {
+                        entry.insert("modified", modified);
+                        sync.files.insert(key, entry);
+                        unchanged += 1;
+                        continue;
+                    }
+                }
+            }
+            to_convert.append(QString::fromStdString(source.string()));
+        }
+
+        for (const auto &key : sync.files.keys()) {
+            if (seen.contains(key)) {
+                continue;
+            }
+            for (const auto &output :
+                 sync.files.value(key).toObject().value("outputs").toArray()) {
+                remove_output(sync.mirror_dir, output.toString());
+            }
+            sync.files.remove(key);
+            removed += 1;
+        }
+    }
+    catch (const std::exception &e) {
+        this->log_output->setVisible(true);
+        this->log_output->append(
+            QString("Error syncing library: %1").arg(e.what())
+        );
+        return;
+    }
+
+    this->library_sync = std::move(sync);
+    this->save_sync_index();
+
+    if (!to_convert.isEmpty()) {
+        this->start_conversion(to_convert);
+    }
+    auto summary = QString("Library sync: %1 to convert, %2 unchanged, "
+                           "%3 removed.")
+                       .arg(to_convert.size())
+                       .arg(unchanged)
+                       .arg(removed);
+    this->log_output->setVisible(true);
+    this->log_output->append(summary);
+
+    // Nothing was started, either because the library is up to date or
+    // because the conversion couldn’t start.
+    if (this->task_queue.isEmpty() && this->running_processes.isEmpty()) {
+        this->finish_library_sync();
+    }
+}
+
+// A hash of every setting that changes the output. Sources converted with other
+// settings are converted again.
+QString Window::options_fingerprint() {
+    auto job = this->create_job_options();
+
+    auto stream = std::ostringstream();
+    stream << this->options.output_format_combo_box->currentText().toStdString()
+           << '\n'
+           << job.image_format << '\n';
+    for (const auto &format : job.auto_image_formats) {
+        stream << format << ',';
+    }
+    stream << '\n';
+#if defined(PDF_ENABLED)
+    stream << job.pdf_pixel_density << ' ';
+#endif
+    stream << job.dither << ' ' << job.quality << ' ' << job.target_quality
+           << ' ' << job.page_width << ' ' << job.page_height << ' '
+           << job.bit_depth << ' ' << job.compression_effort << ' '
+           << job.double_page_spread_action << ' ' << job.rotation_direction
+           << ' ' << job.reading_direction << ' ' << job.page_resampler << ' '
+           << job.convert_pages_to_greyscale << job.map_colour_eink
+           << job.remove_spine << job.crop_margins << job.crop_margins_per_book
+           << job.slice_long_strips << job.deduplicate_pages
+           << job.stretch_page_contrast << job.linear_light_resampling
+           << job.scale_pages << job.quantize_pages << job.share_book_palette
+           << job.is_lossy << job.quality_type_is_distance << '\n';
+    for (const auto &preset : this->extra_display_presets) {
+        stream << preset.brand << ' ' << preset.model << '\n';
+    }
+
+    auto hash = QCryptographicHash::hash(
+        QByteArray::fromStdString(stream.str()), QCryptographicHash::Sha256
+    );
+    return QString::fromLatin1(hash.toHex());
+}
+
+fs::path Window::sync_relative_dir(const QString &source) const {
+    if (!this->library_sync) {
+        return fs::path();
+    }
+    auto source_dir = fs::path(source.toStdString()).parent_path();
+    auto relative_dir
+        = fs::relative(source_dir, this->library_sync->library_dir);
+    return relative_dir == "." ? fs::path() : relative_dir;
+}
+
+void Window::record_synced_source(
+    const QString &source, const std::vector<fs::path> &outputs
+) {
+    auto &sync = *this->library_sync;
+    auto source_path = fs::path(source.toStdString());
+    auto key = QString::fromStdString(
+        fs::relative(source_path, sync.library_dir).generic_string()
+    );
+
+    auto output_list = QJsonArray();
+    for (const auto &output : outputs) {
+        output_list.append(QString::fromStdString(
+            fs::relative(output, sync.mirror_dir).generic_string()
+        ));
+    }
+    // Outputs of the last conversion that this one didn’t write again, after
+    // the output format or the extra devices changed.
+    for (const auto &output :
+         sync.files.value(key).toObject().value("outputs").toArray()) {
+        if (!output_list.contains(output)) {
+            remove_output(sync.mirror_dir, output.toString());
+        }
+    }
+
+    try {
+        sync.files.insert(
+            key,
+            QJsonObject{
+                {"size", static_cast<qint64>(fs::file_size(source_path))},
+                {"modified", modification_time(source_path)},
+                {"hash", file_content_hash(source_path)},
+                {"options", sync.options_fingerprint},
+                {"outputs", output_list},
+            }
+        );
+    }
+    catch (const std::exception &e) {
+        // The source is converted again on the next sync.
+        this->log_output->setVisible(true);
+        this->log_output->append(
+            QString("Error recording %1 in the library index: %2")
+                .arg(source, e.what())
+        );
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - sync.saved_at >= SYNC_INDEX_SAVE_INTERVAL) {
+        this->save_sync_index();
+    }
+}
+
+void Window::save_sync_index() {
+    auto &sync = *this->library_sync;
+    sync.saved_at = std::chrono::steady_clock::now();
+
+    auto index = QJsonObject{
+        {"version", SYNC_INDEX_VERSION},
+        {"library", QString::fromStdString(sync.library_dir.string())},
+        {"files", sync.files},
+    };
+    // Written to a temporary file and renamed, so that a crash never leaves a
+    // partial index.
+    auto file = QSaveFile(
+        QString::fromStdString((sync.mirror_dir / SYNC_INDEX_NAME).string())
+    );
+    if (!file.open(QIODevice::WriteOnly)
+        || file.write(QJsonDocument(index).toJson(QJsonDocument::Compact)) < 0
+        || !file.commit()) {
+        this->log_output->setVisible(true);
+        this->log_output->append(
+            "Error saving the library index: " + file.errorString()
+        );
+    }
+}
+
+void Window::finish_library_sync() {
+    if (!this->library_sync) {
+        return;
+    }
+    this->save_sync_index();
+    this->library_sync.reset();
+}
+
+// The books in a library, in a stable order. A mirror inside the library is
+// skipped, so that its outputs aren’t taken for sources.
+std::vector<fs::path>
+find_library_sources(const fs::path &library_dir, const fs::path &mirror_dir) {
+    auto sources = std::vector<fs::path>();
+    auto options = fs::directory_options::skip_permission_denied;
+    auto it = fs::recursive_directory_iterator(library_dir, options);
+    for (const auto &entry : it) {
+        if (entry.is_directory() && entry.path() == mirror_dir) {
+            it.disable_recursion_pending();
+            continue;
+        }
+        if (!entry.is_regular_file()) {
+            continue;
+        }
+
+        auto extension = entry.path().extension().string();
+        std::transform(
+            extension.begin(), extension.end(), extension.begin(), ::tolower
+        );
+#if defined(PDF_ENABLED)
+        auto supported
+            = extension == ".cbz" || extension == ".cbr" || extension == ".pdf";
+#else
+        auto supported = extension == ".cbz" || extension == ".cbr";
+#endif
+        if (supported) {
+            sources.push_back(entry.path());
+        }
+    }
+    std::sort(sources.begin(), sources.end());
+    return sources;
+}
+
+QString file_content_hash(const fs::path &path) {
+    auto file = QFile(QString::fromStdString(path.string()));
+    if (!file.open(QIODevice::ReadOnly)) {
+        throw std::runtime_error("Could not read " + path.string());
+    }
+    auto hash = QCryptographicHash(QCryptographicHash::Sha256);
+    hash.addData(&file);
+    return QString::fromLatin1(hash.result().toHex());
+}
+
+// As a string, since JSON numbers can’t hold every time exactly.
+QString modification_time(const fs::path &path) {
+    auto time = fs::last_write_time(path).time_since_epoch().count();
+    return QString::number(static_cast<qint64>(time));
+}
+
+bool outputs_exist(const fs::path &mirror_dir, const QJsonObject &entry) {
+    auto outputs = entry.value("outputs").toArray();
+    auto ec = std::error_code();
+    return !outputs.isEmpty()
+        && std::all_of(outputs.begin(), outputs.end(), [&](const auto &output) {
+               return fs::exists(
+                   mirror_dir / output.toString().toStdString(), ec
+               );
+           });
+}
+
+// Removes an output, and the folders above it in the mirror that it leaves
+// empty.
+void remove_output(const fs::path &mirror_dir, const QString &output) {
+    auto path = mirror_dir / output.toStdString();
+    auto ec = std::error_code();
+    fs::remove(path, ec);
+    for (auto dir = path.parent_path();
+         dir != mirror_dir && dir.string().starts_with(mirror_dir.string());
+         dir = dir.parent_path()) {
+        if (!fs::remove(dir, ec)) {
+            break;
+        }
+    }
+}
@@ -1,4 +1,5 @@
 #include "include/window.hpp"
+#include "../include/protocol.hpp"
 #include "../include/task.hpp"
 #include "include/display_presets.hpp"
 #include "include/options.hpp"
@@ -9,6 +10,7 @@
 #include "qnamespace.h"
 #include <chrono>
 #include <fstream>
+#include <future>
 
 namespace fs = std::filesystem;
 
@@ -126,6 +128,7 @@ QGroupBox *Window::create_io_group() {
     this->file_list->setMaximumHeight(500);
 
     this->add_files_button = new QPushButton("Add input files");
+    this->sync_library_button = new QPushButton("Sync library folder");
     this->remove_selected_button = new QPushButton("Remove selected");
     this->clear_all_button = new QPushButton("Remove all");
 
@@ -133,6 +136,7 @@ QGroupBox *Window::create_io_group() {
     this->clear_all_button->setVisible(false);
 
     file_buttons_layout->addWidget(this->add_files_button);
+    file_buttons_layout->addWidget(this->sync_library_button);
     file_buttons_layout->addWidget(this->remove_selected_button);
     file_buttons_layout->addWidget(this->clear_all_button);
     file_buttons_layout->addStretch();
@@ -184,10 +188,14 @@ QGroupBox *Window::create_settings_group() {
 #endif
     this->options.settings_layout->addItem(new QSpacerItem(0, 25));
     add_convert_to_greyscale_widget(style, &this->options);
+    add_map_colour_eink_widget(style, &this->options);
     add_contrast_widget(style, &this->options);
     this->options.settings_layout->addItem(new QSpacerItem(0, 25));
     add_double_page_spread_widget(style, &this->options);
     add_remove_spine_widget(style, &this->options);
+    add_crop_margins_widget(style, &this->options);
+    add_slice_long_strips_widget(style, &this->options);
+    add_deduplicate_pages_widget(style, &this->options);
 
     this->options.settings_layout->addItem(new QSpacerItem(0, 25));
     this->options.advanced_options_check_box = new QCheckBox();
@@ -211,6 +219,10 @@ QGroupBox *Window::create_settings_group() {
     this->options.settings_layout->addItem(new QSpacerItem(0, 25));
     add_image_format_widgets(style, &this->options);
     add_parallel_workers_widget(style, &this->options);
+    add_optimize_when_idle_widget(style, &this->options);
+    add_cache_pages_widget(style, &this->options);
+    add_source_cache_widget(style, &this->options);
+    add_reuse_pages_widget(style, &this->options);
 
     this->on_advanced_options_changed(
         this->options.advanced_options_check_box->checkState()
@@ -295,7 +307,7 @@ void Window::add_display_presets_widget() {
 
     auto output_format_label = new QLabel("Output format");
     this->options.output_format_combo_box
-        = create_combo_box({"EPUB", "CBZ"}, "EPUB");
+        = create_combo_box({"EPUB", "CBZ", "EPUB and CBZ"}, "EPUB");
     auto output_format_container = create_control_with_info(
         this->style(),
         this->options.output_format_combo_box,
@@ -305,11 +317,114 @@ void Window::add_display_presets_widget() {
     this->options.settings_layout->addRow(
         label, this->options.display_preset_button
     );
+    this->add_extra_devices_widget();
     this->options.settings_layout->addRow(
         output_format_label, output_format_container
     );
 }
 
+void Window::add_extra_devices_widget() {
+    this->options.extra_devices_button = new QPushButton();
+    auto menu = new QMenu(this);
+
+    for (const auto &[brand, models] : DISPLAY_PRESETS) {
+        if (!models.has_value()) {
+            continue;
+        }
+
+        auto brand_menu = menu->addMenu(QString::fromStdString(brand));
+        if (!brand_menu) {
+            continue;
+        }
+
+        for (const auto &[model_name, _] : *models) {
+            auto action = brand_menu->addAction(
+                QString::fromStdString(model_name)
+            );
+            if (!action) {
+                continue;
+            }
+            action->setCheckable(true);
+
+            connect(
+                action,
+                &QAction::toggled,
+                this,
+                [this, brand, model_name](bool checked) {
+                    auto &presets = this->extra_display_presets;
+                    auto is_this_preset = [&](const DisplayPreset &preset) {
+                        return preset.brand == brand
+                            && preset.model == model_name;
+                    };
+                    std::erase_if(presets, is_this_preset);
+                    if (checked) {
+                        presets.push_back(
+                            DisplayPreset{.brand = brand, .model = model_name}
+                        );
+                    }
+                    this->update_extra_devices_button();
+                }
+            );
+        }
+    }
+
+    this->options.extra_devices_button->setMenu(menu);
+    this->update_extra_devices_button();
+
+    auto label = new QLabel("Also convert for");
+    auto container = create_control_with_info(
+        this->style(), this->options.extra_devices_button, EXTRA_DEVICES_TOOLTIP
+    );
+    this->options.settings_layout->addRow(label, container);
+}
+
+void Window::update_extra_devices_button() {
+    const auto &presets = this->extra_display_presets;
+    auto text = QString("None");
+    if (presets.size() == 1) {
+        text = QString::fromStdString(
+            presets[0].brand + " " + presets[0].model
+        );
+    }
+    else if (presets.size() > 1) {
+        text = QString("%1 devices").arg(presets.size());
+    }
+    this->options.extra_devices_button->setText(text);
+}
+
+std::vector<ExtraDisplayTarget>
+Window::extra_display_targets(const fs::path &staging_dir) const {
+    auto targets = std::vector<ExtraDisplayTarget>();
+    for (size_t i = 0; i < this->extra_display_presets.size(); i += 1) {
+        const auto &preset = this->extra_display_presets[i];
+        auto display = find_display_spec(preset.brand, preset.model);
+        if (!display) {
+            continue;
+        }
+
+        // Books are staged in `<run>/<stem>`, so each device stages its copy
+        // in `<run>/target<n>/<stem>`. Page tasks find their book’s state from
+        // the staging directory, so every device keeps its own.
+        auto target_dir = staging_dir.parent_path()
+                        / ("target" + std::to_string(i + 1))
+                        / staging_dir.filename();
+        targets.push_back(ExtraDisplayTarget{
+            .preset = preset,
+            .target = DisplayTarget{
+                .output_dir = target_dir,
+                .page_width = static_cast<int>(display->width),
+                .page_height = static_cast<int>(display->height),
+                .bit_depth = static_cast<int>(
+                    std::pow(2, static_cast<int>(display->bit_depth_index))
+                ),
+                .convert_pages_to_greyscale = !display->colour,
+                .map_colour_eink = display->colour,
+            },
+        });
+    }
+    return targets;
+}
+
 void Window::start_next_task() {
     if (task_queue.isEmpty()
         || running_processes.size() >= max_concurrent_workers
@@ -317,7 +432,8 @@ void Window::start_next_task() {
         return;
     }
 
-    PageTask task = task_queue.dequeue();
+    PageTask task = this->create_task(task_queue.dequeue());
+    task.compression_effort = this->choose_compression_effort(task);
     QString source_qstr = QString::fromStdString(task.source_file.string());
 
     if (!this->active_progress_bars.contains(source_qstr)) {
@@ -371,6 +487,11 @@ void Window::start_next_task() {
     QProcess *process = new QProcess(this);
     running_processes.append(process);
     running_tasks.insert(process, task);
+    auto start_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()
+    )
+                        .count();
+    this->task_start_times.insert(process, start_ms);
 
     connect(
         process,
@@ -385,46 +506,14 @@ void Window::start_next_task() {
         &Window::on_worker_finished
     );
 
-    QString program = QCoreApplication::applicationFilePath();
-    QStringList arguments;
-    arguments << "-source_file"
-              << QString::fromStdString(task.source_file.string())
-              << "-output_dir"
-              << QString::fromStdString(task.output_dir.string())
-              << "-output_base_name"
-              << QString::fromStdString(task.output_base_name) << "-page_number"
-              << QString::number(task.page_number) << "-path_in_archive"
-              << QString::fromStdString(
-                     task.path_in_archive
-                 ) // Empty string if not set
-#if defined(PDF_ENABLED)
-              << "-pdf_pixel_density" << QString::number(task.pdf_pixel_density)
-#endif
-              << "-convert_pages_to_greyscale"
-              << (task.convert_pages_to_greyscale ? "1" : "0")
-              << "-double_page_spread_actions"
-              << QString::number(task.double_page_spread_action)
-              << "-rotation_direction"
-              << QString::number(task.rotation_direction)
-              << "-linear_light_resampling"
-              << QString::number(task.linear_light_resampling)
-              << "-remove_spine" << QString::number(task.remove_spine)
-              << "-stretch_page_contrast"
-              << (task.stretch_page_contrast ? "1" : "0") << "-scale_pages"
-              << (task.scale_pages ? "1" : "0") << "-page_width"
-              << QString::number(task.page_width) << "-page_height"
-              << QString::number(task.page_height) << "-page_resampler"
-              << QString::number(static_cast<int>(task.page_resampler))
-              << "-quantize_pages" << (task.quantize_pages ? "1" : "0")
-              << "-bit_depth" << QString::number(task.bit_depth) << "-dither"
-              << QString::number(task.dither) << "-image_format"
-              << QString::fromStdString(task.image_format) << "-is_lossy"
-              << (task.is_lossy ? "1" : "0") << "-quality_type_is_distance"
-              << (task.quality_type_is_distance ? "1" : "0") << "-quality"
-              << QString::number(task.quality) << "-compression_effort"
-              << QString::number(task.compression_effort);
-
-    process->start(program, arguments);
+    // The task goes over standard input, which is closed after it so that
+    // the worker exits once the page is done.
+    process->start(
+        QCoreApplication::applicationFilePath(),
+        {"-task_protocol", QString::number(TASK_PROTOCOL_VERSION)}
+    );
+    process->write(QByteArray::fromStdString(encode_task(task)));
+    process->closeWriteChannel();
 }
 
 void Window::handle_log_message(const QString &message) {
@@ -438,91 +527,166 @@ void Window::handle_task_finished() {
     this->progress_bar->setValue(pages_processed);
 }
 
-PageTask
-Window::create_task(fs::path source_file, fs::path output_dir, int page_num) {
-    PageTask task;
-    auto source_qstr = QString::fromStdString(source_file.string());
-
-    task.source_file = source_file;
-    task.output_dir = output_dir;
-    task.page_number = page_num;
-
-    auto total_pages = this->total_pages_per_archive.value(source_qstr, 0);
-    auto padding_width
-        = total_pages > 0
-            ? static_cast<int>(std::floor(std::log10(total_pages))) + 1
-            : 1;
-    task.output_base_name
-        = QString("%1")
-              .arg(page_num + 1, padding_width, 10, QChar('0'))
-              .toStdString();
+JobOptions Window::create_job_options() {
+    JobOptions job;
 
 #if defined(PDF_ENABLED)
-    task.pdf_pixel_density = this->options.pdf_pixel_density_spin_box->value();
+    job.pdf_pixel_density = this->options.pdf_pixel_density_spin_box->value();
 #endif
-    task.convert_pages_to_greyscale
+    job.convert_pages_to_greyscale
         = this->options.convert_to_greyscale->isChecked();
-    task.double_page_spread_action
+    job.map_colour_eink = this->options.map_colour_eink_check_box->isChecked();
+    job.double_page_spread_action
         = (DoublePageSpreadActions)this->options.double_page_spread_combo_box
               ->currentIndex();
     if (this->options.rotation_direction_combo_box->currentText()
         == "Clockwise") {
-        task.rotation_direction = CLOCKWISE;
+        job.rotation_direction = CLOCKWISE;
     }
     else {
-        task.rotation_direction = COUNTERCLOCKWISE;
+        job.rotation_direction = COUNTERCLOCKWISE;
+    }
+    if (this->options.reading_direction_combo_box->currentText()
+        == "Right to left") {
+        job.reading_direction = RIGHT_TO_LEFT;
     }
-    task.remove_spine = this->options.remove_spine_check_box->isChecked();
-    task.linear_light_resampling
+    else {
+        job.reading_direction = LEFT_TO_RIGHT;
+    }
+    job.remove_spine = this->options.remove_spine_check_box->isChecked();
+    job.crop_margins = this->options.crop_margins_check_box->isChecked();
+    job.crop_margins_per_book
+        = this->options.crop_margins_per_book_check_box->isChecked();
+    job.slice_long_strips
+        = this->options.slice_long_strips_check_box->isChecked();
+    job.deduplicate_pages
+        = this->options.deduplicate_pages_check_box->isChecked();
+    job.linear_light_resampling
         = this->options.linear_light_resampling_check_box->isChecked();
-    task.stretch_page_contrast = this->options.contrast_check_box->isChecked();
-    task.scale_pages
-        = this->options.enable_image_scaling_check_box->isChecked();
-    task.page_width = this->options.width_spin_box->value();
-    task.page_height = this->options.height_spin_box->value();
+    job.stretch_page_contrast = this->options.contrast_check_box->isChecked();
+    job.scale_pages = this->options.enable_image_scaling_check_box->isChecked();
+    job.page_width = this->options.width_spin_box->value();
+    job.page_height = this->options.height_spin_box->value();
     auto resampler = this->options.resampler_combo_box->currentText();
     if (resampler == "Bicubic interpolation") {
-        task.page_resampler = VIPS_KERNEL_CUBIC;
+        job.page_resampler = VIPS_KERNEL_CUBIC;
     }
     else if (resampler == "Bilinear interpolation") {
-        task.page_resampler = VIPS_KERNEL_LINEAR;
+        job.page_resampler = VIPS_KERNEL_LINEAR;
     }
     else if (resampler == "Lanczos 2") {
-        task.page_resampler = VIPS_KERNEL_LANCZOS2;
+        job.page_resampler = VIPS_KERNEL_LANCZOS2;
     }
     else if (resampler == "Lanczos 3") {
-        task.page_resampler = VIPS_KERNEL_LANCZOS3;
+        job.page_resampler = VIPS_KERNEL_LANCZOS3;
     }
     else if (resampler == "Magic Kernel Sharp 2013") {
-        task.page_resampler = VIPS_KERNEL_MKS2013;
+        job.page_resampler = VIPS_KERNEL_MKS2013;
     }
     else if (resampler == "Magic Kernel Sharp 2021") {
-        task.page_resampler = VIPS_KERNEL_MKS2021;
+        job.page_resampler = VIPS_KERNEL_MKS2021;
     }
     else if (resampler == "Mitchell") {
-        task.page_resampler = VIPS_KERNEL_MITCHELL;
+        job.page_resampler = VIPS_KERNEL_MITCHELL;
     }
     else {
-        task.page_resampler = VIPS_KERNEL_NEAREST;
+        job.page_resampler = VIPS_KERNEL_NEAREST;
     }
-    task.quantize_pages
+    job.quantize_pages
         = this->options.enable_image_quantization_check_box->isChecked();
-    task.bit_depth
+    job.bit_depth
         = std::pow(2, this->options.bit_depth_combo_box->currentIndex());
-    task.dither = this->options.dithering_spin_box->value();
-    task.image_format
+    job.dither = this->options.dithering_spin_box->value();
+    job.share_book_palette
+        = this->options.share_book_palette_check_box->isChecked();
+    job.image_format
         = this->options.image_format_combo_box->currentText().toStdString();
-    task.is_lossy
-        = this->options.image_compression_type_combo_box->currentText()
-       == "Lossy";
-    task.quality_type_is_distance
+    // Photographic pages prefer the first of these.
+    if (this->options.output_format_combo_box->currentText() == "CBZ") {
+        job.auto_image_formats = {"JPEG XL", "WebP", "PNG"};
+    }
+    else {
+        job.auto_image_formats = {"WebP", "PNG"};
+    }
+    auto compression_type
+        = this->options.image_compression_type_combo_box->currentText();
+    job.is_lossy
+        = compression_type == "Lossy" || compression_type == "Target quality";
+    // Formats without a compression type don’t show the target either.
+    auto has_compression_type = job.image_format == "AVIF"
+                             || job.image_format == "JPEG XL"
+                             || job.image_format == "WebP";
+    job.target_quality
+        = has_compression_type && compression_type == "Target quality"
+            ? this->options.image_target_quality_spin_box->value()
+            : 0.0;
+    job.quality_type_is_distance
         = this->options.image_quality_label_jpeg_xl->currentText()
        == "Distance";
-    task.quality = this->options.image_quality_spin_box->value();
-    task.compression_effort = this->options.image_compression_spin_box->value();
+    job.quality = this->options.image_quality_spin_box->value();
+    job.compression_effort = this->options.image_compression_spin_box->value();
+    auto cache_location = fs::path(
+        QStandardPaths::writableLocation(QStandardPaths::CacheLocation)
+            .toStdString()
+    );
+    if (this->options.cache_pages_check_box->isChecked()) {
+        job.cache_dir = cache_location / "pages";
+    }
+    if (this->options.reuse_pages_check_box->isChecked()) {
+        job.output_cache_dir = cache_location / "output";
+    }
+    auto source_cache_gb = this->options.source_cache_spin_box->value();
+    if (source_cache_gb > 0) {
+        job.source_cache_dir = cache_location / "sources";
+        job.source_cache_limit_mb = source_cache_gb * 1024;
+    }
+    return job;
+}
+
+PageTask Window::create_task(const PageRecord &record) const {
+    const auto &book = this->run_books[record.file_id];
+    PageTask task;
+    static_cast<JobOptions &>(task) = *this->job_options;
+
+    task.source_file = book.source_file;
+    task.output_dir = book.staging_dir;
+    task.page_number = static_cast<int>(record.page_index);
+    for (const auto &extra : this->extra_display_targets(book.staging_dir)) {
+        task.extra_targets.push_back(extra.target);
+    }
+
+    if (!book.entries.empty()) {
+        task.path_in_archive = book.entries[record.page_index];
+        task.output_base_name
+            = fs::path(task.path_in_archive).replace_extension("").string();
+        return task;
+    }
+
+    // PDF pages are named after their page numbers, padded to the same width.
+    auto padding_width
+        = book.page_count > 0
+            ? static_cast<int>(std::floor(std::log10(book.page_count))) + 1
+            : 1;
+    task.output_base_name
+        = QString("%1")
+              .arg(task.page_number + 1, padding_width, 10, QChar('0'))
+              .toStdString();
     return task;
 }
 
+void Window::enqueue_book(RunBook book, const QSet<int> &finished_pages) {
+    auto file_id = static_cast<uint32_t>(this->run_books.size());
+    for (auto i = 0; i < book.page_count; i += 1) {
+        if (!finished_pages.contains(i)) {
+            this->task_queue.enqueue(PageRecord{
+                .file_id = file_id,
+                .page_index = static_cast<uint32_t>(i),
+            });
+        }
+    }
+    this->run_books.push_back(std::move(book));
+}
+
 void Window::update_file_list_buttons() {
     auto count = this->file_list->count();
     auto has_items = count > 0;
@@ -570,43 +734,126 @@ void Window::set_display_preset(std::string brand, std::string model) {
     this->on_display_preset_changed();
 }
 
+// Books are staged in `<run>/<stem>`. Books with the same stem, from different
+// folders, get a number after it so that their pages and state stay apart.
+fs::path Window::create_unique_temp_dir(const std::string &stem) {
+    auto temp_dir = fs::path(this->temp_base_dir) / stem;
+    auto i = 2;
+    while (fs::exists(temp_dir)) {
+        temp_dir = fs::path(this->temp_base_dir)
+                 / (stem + "_" + std::to_string(i));
+        i += 1;
+    }
+    fs::create_directories(temp_dir);
+    return temp_dir;
+}
+
 void Window::create_archive(const QString &source_archive_path) {
+    auto temp_dir = this->archive_temp_dirs.take(source_archive_path);
+    // A library sync mirrors the library’s folders.
+    auto relative_dir = this->sync_relative_dir(source_archive_path);
+    auto ec = std::error_code();
+    fs::create_directories(this->output_path / relative_dir, ec);
+    auto archive_paths = this->write_output_archive(
+        source_archive_path, temp_dir, this->output_path / relative_dir
+    );
+    auto converted = !archive_paths.empty();
+
+    // Each extra device’s files go into a folder named after it.
+    for (const auto &[preset, target] : this->extra_display_targets(temp_dir)) {
+        auto output_dir = this->output_path
+                        / (preset.brand + " " + preset.model) / relative_dir;
+        try {
+            fs::create_directories(output_dir);
+        }
+        catch (const std::exception &e) {
+            log_output->append(
+                QString("Error: %1").arg(QString::fromUtf8(e.what()))
+            );
+            log_output->setVisible(true);
+            converted = false;
+            continue;
+        }
+        auto target_paths = this->write_output_archive(
+            source_archive_path, target.output_dir, output_dir
+        );
+        converted = converted && !target_paths.empty();
+        archive_paths.insert(
+            archive_paths.end(), target_paths.begin(), target_paths.end()
+        );
+    }
+
+    if (converted) {
+        auto fields = QStringList{"archive", source_archive_path};
+        for (const auto &path : archive_paths) {
+            fields.append(QString::fromStdString(path.string()));
+        }
+        this->append_to_journal(fields);
+    }
+    if (this->library_sync && converted) {
+        this->record_synced_source(source_archive_path, archive_paths);
+    }
+}
+
+std::vector<fs::path> Window::write_output_archive(
+    const QString &source_archive_path,
+    const fs::path &temp_dir,
+    const fs::path &output_dir
+) {
     auto source_path = fs::path(source_archive_path.toStdString());
     auto title = source_path.stem();
 
-    auto temp_dir = fs::path(this->temp_base_dir) / title;
-    auto output_filename = source_path.filename();
+    auto output_format = this->options.output_format_combo_box->currentText();
+    auto base_path = output_dir / source_path.filename();
+    auto archive_paths = std::vector<fs::path>();
+    if (output_format != "CBZ") {
+        archive_paths.push_back(fs::path(base_path).replace_extension(".epub"));
+    }
+    if (output_format != "EPUB") {
+        archive_paths.push_back(fs::path(base_path).replace_extension(".cbz"));
+    }
 
     QCoreApplication::processEvents();
 
-    try {
-        if (this->options.output_format_combo_box->currentText() == "EPUB") {
-            output_filename = output_filename.replace_extension(".epub");
-            auto final_output_path = this->output_path / output_filename;
-            create_epub(
-                temp_dir, std::move(final_output_path), title.generic_string()
-            );
+    // Packaging only reads the staged pages, so when both formats are written
+    // from them, they are written at once.
+    auto futures = std::vector<std::future<void>>();
+    for (const auto &archive_path : archive_paths) {
+        futures.push_back(std::async(std::launch::async, [&, archive_path] {
+            if (archive_path.extension() == ".epub") {
+                create_epub(temp_dir, archive_path, title.generic_string());
+            }
+            else {
+                create_cbz(temp_dir, archive_path);
+            }
+        }));
+    }
+
+    auto failed = false;
+    for (auto &future : futures) {
+        try {
+            future.get();
+        }
+        catch (const NoImagesError &) {
+            // Both formats fail for the same reason, so say it once.
+            if (!failed) {
+                log_output->append(
+                    QString("Error: source '%1' does not contain any images.")
+                        .arg(source_archive_path)
+                );
+            }
+            failed = true;
         }
-        else {
-            output_filename = output_filename.replace_extension(".cbz");
-            auto final_output_path = this->output_path / output_filename;
-            create_cbz(temp_dir, std::move(final_output_path));
+        catch (const std::exception &e) {
+            log_output->append(
+                QString("Error: %1").arg(QString::fromUtf8(e.what()))
+            );
+            failed = true;
         }
     }
-    catch (const NoImagesError &) {
-        log_output->append(
-            QString("Error: source '%1' does not contain any images.")
-                .arg(source_archive_path)
-        );
-        log_output->setVisible(true);
-        return;
-    }
-    catch (const std::exception &e) {
-        log_output->append(
-            QString("Error: %1").arg(QString::fromUtf8(e.what()))
-        );
+    if (failed) {
         log_output->setVisible(true);
-        return;
+        return {};
     }
 
     try {
@@ -619,7 +866,15 @@ void Window::create_archive(const QString &source_archive_path) {
         );
         log_output->setVisible(true);
     }
+
+    if (this->options.optimize_when_idle_check_box->isChecked()) {
+        for (const auto &archive_path : archive_paths) {
+            this->optimize_queue.enqueue(archive_path);
+        }
+    }
+    return archive_paths;
 }
 
 Window::~Window() {
+    this->cancel_optimizations();
 }
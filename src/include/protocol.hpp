@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <optional>
+#include <string>
+
+#include "task.hpp"
+
+// Page tasks go from the GUI to its workers over the workers’ standard input,
+// as frames of a magic number, this version, the payload’s size and the
+// payload. Both ends are the same executable, so values are in the host’s byte
+// order. Raise it whenever the encoding or the fields below change.
+const uint16_t TASK_PROTOCOL_VERSION = 2;
+
+// The fields of a page task and of its extra devices, in the order that
+// they’re encoded. Each is listed once here, so that both ends agree.
+#define DISPLAY_TARGET_FIELDS(FIELD)                                           \
+    FIELD(output_dir)                                                          \
+    FIELD(page_width)                                                          \
+    FIELD(page_height)                                                         \
+    FIELD(bit_depth)                                                           \
+    FIELD(convert_pages_to_greyscale)                                          \
+    FIELD(map_colour_eink)
+
+#define PAGE_TASK_FIELDS(FIELD)                                                \
+    FIELD(source_file)                                                         \
+    FIELD(output_dir)                                                          \
+    FIELD(output_base_name)                                                    \
+    FIELD(path_in_archive)                                                     \
+    FIELD(page_number)                                                         \
+    FIELD(extra_targets)                                                       \
+    FIELD(pdf_pixel_density)                                                   \
+    FIELD(image_format)                                                        \
+    FIELD(auto_image_formats)                                                  \
+    FIELD(cache_dir)                                                           \
+    FIELD(source_cache_dir)                                                    \
+    FIELD(output_cache_dir)                                                    \
+    FIELD(dither)                                                              \
+    FIELD(quality)                                                             \
+    FIELD(target_quality)                                                      \
+    FIELD(page_width)                                                          \
+    FIELD(page_height)                                                         \
+    FIELD(bit_depth)                                                           \
+    FIELD(compression_effort)                                                  \
+    FIELD(source_cache_limit_mb)                                               \
+    FIELD(double_page_spread_action)                                           \
+    FIELD(rotation_direction)                                                  \
+    FIELD(reading_direction)                                                   \
+    FIELD(page_resampler)                                                      \
+    FIELD(convert_pages_to_greyscale)                                          \
+    FIELD(map_colour_eink)                                                     \
+    FIELD(remove_spine)                                                        \
+    FIELD(crop_margins)                                                        \
+    FIELD(crop_margins_per_book)                                               \
+    FIELD(slice_long_strips)                                                   \
+    FIELD(deduplicate_pages)                                                   \
+    FIELD(stretch_page_contrast)                                               \
+    FIELD(linear_light_resampling)                                             \
+    FIELD(scale_pages)                                                         \
+    FIELD(quantize_pages)                                                      \
+    FIELD(share_book_palette)                                                  \
+    FIELD(is_lossy)                                                            \
+    FIELD(quality_type_is_distance)
+
+// Encodes a task as a single frame.
+std::string encode_task(const PageTask &task);
+
+// Reads the next task from a stream of frames. Returns nothing when the stream
+// ends between frames, and throws when a frame is cut short, comes from another
+// version or doesn’t hold a task, including when a setting is out of range.
+std::optional<PageTask> read_task(std::istream &in);
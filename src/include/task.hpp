@@ -1,38 +1,92 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 #include <string>
+#include <vector>
+#include <vips/vips8>
 
 namespace fs = std::filesystem;
 
 enum DoublePageSpreadActions { ROTATE, SPLIT, BOTH, NONE };
 enum RotationDirection { CLOCKWISE, COUNTERCLOCKWISE };
+enum ReadingDirection { LEFT_TO_RIGHT, RIGHT_TO_LEFT };
 
-struct PageTask {
-    fs::path source_file;
+// Another device that a page is converted for, in the same pass. Only the
+// display settings differ from the page’s own task. Pages for it are staged in
+// `output_dir`.
+struct DisplayTarget {
     fs::path output_dir;
-    std::string output_base_name;
-    std::string path_in_archive;
+    int page_width;
+    int page_height;
+    int bit_depth;
+    bool convert_pages_to_greyscale;
+    bool map_colour_eink;
+};
+
+// The settings that every page of a run shares. The GUI keeps one copy for the
+// whole run and only fills in a page’s own fields when a worker starts on it.
+struct JobOptions {
     std::string image_format;
+    // The formats that the “Auto” image format chooses between, in order of
+    // preference for photographic pages.
+    std::vector<std::string> auto_image_formats;
+    // Where processed pages are cached before encoding, or empty for no cache.
+    fs::path cache_dir;
+    // Where decoded source pages are cached, or empty for no cache.
+    fs::path source_cache_dir;
+    // Where finished pages are cached, or empty for no cache.
+    fs::path output_cache_dir;
     double dither;
     double quality;
-    int page_number = -1;
-#if defined(PDF_ENABLED)
-    int pdf_pixel_density;
-#endif
+    // The SSIM that lossy pages are encoded to reach, or 0 to use `quality`.
+    double target_quality;
+    // Only used with PDF support, but always there, so that tasks are encoded
+    // the same way by every build.
+    int pdf_pixel_density = 0;
     int page_width;
     int page_height;
     int bit_depth;
     int compression_effort;
+    // The size in MiB that the source page cache is trimmed to.
+    int source_cache_limit_mb = 0;
     DoublePageSpreadActions double_page_spread_action;
     RotationDirection rotation_direction;
+    ReadingDirection reading_direction;
     VipsKernel page_resampler;
     bool convert_pages_to_greyscale;
+    bool map_colour_eink;
     bool remove_spine;
+    bool crop_margins;
+    bool crop_margins_per_book;
+    bool slice_long_strips;
+    bool deduplicate_pages;
     bool stretch_page_contrast;
     bool linear_light_resampling;
     bool scale_pages;
     bool quantize_pages;
+    bool share_book_palette;
     bool is_lossy;
     bool quality_type_is_distance;
 };
+
+// A page waiting for a worker. The rest of its task is shared with its book or
+// its run, so that queueing a whole library takes little memory.
+struct PageRecord {
+    // The page’s book, as an index into the run’s books.
+    uint32_t file_id;
+    // The page’s index in its book. An archive’s entries are listed in page
+    // order, so this also identifies the page’s entry.
+    uint32_t page_index;
+};
+
+// Everything that a worker needs to convert one page.
+struct PageTask : JobOptions {
+    fs::path source_file;
+    fs::path output_dir;
+    std::string output_base_name;
+    std::string path_in_archive;
+    // Devices that the page is also converted for, from the same decoded page.
+    std::vector<DisplayTarget> extra_targets;
+    int page_number = -1;
+};
@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <future>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "../include/task.hpp"
+#include "include/auto_format.hpp"
+#include "include/processing.hpp"
+
+// Pages are classified from a copy at most this many pixels on its longest
+// side.
+const auto CLASSIFY_SIZE = 512.0;
+// Tones this close to black or white count as flat ink or paper.
+const auto FLAT_TONE_MARGIN = 32;
+// Line art is almost all flat ink and paper. Photographs have little of either.
+const auto LINE_ART_MIN_FLAT = 0.85;
+const auto PHOTOGRAPHIC_MAX_FLAT = 0.5;
+// A page is in colour when its average chroma (in LCh) is at least this.
+const auto COLOUR_MIN_CHROMA = 8.0;
+// Compression effort of each candidate format. These are the defaults of the
+// image format options.
+const auto AUTO_JPEG_XL_EFFORT = 7;
+const auto AUTO_PNG_EFFORT = 6;
+const auto AUTO_WEBP_EFFORT = 4;
+const auto AUTO_AVIF_EFFORT = 4;
+
+static PageTask auto_candidate_task(const PageTask &task, std::string format);
+
+PageKind classify_page(const vips::VImage &img) {
+    auto longest_side = std::max(img.width(), img.height());
+    auto small = longest_side > CLASSIFY_SIZE
+                   ? img.resize(CLASSIFY_SIZE / longest_side)
+                   : img;
+
+    auto grey = small.colourspace(VIPS_INTERPRETATION_B_W)[0].cast(
+        VIPS_FORMAT_UCHAR
+    );
+    auto histogram = image_to_doubles(grey.hist_find());
+    auto total = 0.0;
+    auto flat = 0.0;
+    for (size_t value = 0; value < histogram.size(); value += 1) {
+        total += histogram[value];
+        if (value < FLAT_TONE_MARGIN || value >= 256 - FLAT_TONE_MARGIN) {
+            flat += histogram[value];
+        }
+    }
+    auto flat_fraction = total > 0 ? flat / total : 1.0;
+
+    auto colour = small.bands() >= 3
+               && small.colourspace(VIPS_INTERPRETATION_LCH)[1].avg()
+                      >= COLOUR_MIN_CHROMA;
+
+    if (flat_fraction >= LINE_ART_MIN_FLAT) {
+        return PageKind::LINE_ART;
+    }
+    if (colour && flat_fraction < PHOTOGRAPHIC_MAX_FLAT) {
+        return PageKind::PHOTOGRAPHIC;
+    }
+    return PageKind::AMBIGUOUS;
+}
+
+std::string save_page_auto(
+    const vips::VImage &img,
+    bool stretch_page_contrast,
+    const PageTask &task,
+    const std::string &base_path,
+    Logger log
+) {
+    const auto &formats = task.auto_image_formats;
+    auto name = fs::path(base_path).filename().string();
+    auto has_format = [&](const std::string &format) {
+        return std::find(formats.begin(), formats.end(), format)
+            != formats.end();
+    };
+
+    // Pages that are clearly line art or photographs don’t need trial encodes.
+    auto chosen = std::string();
+    auto kind = classify_page(img);
+    if (kind == PageKind::LINE_ART && has_format("PNG")) {
+        chosen = "PNG";
+    }
+    else if (kind == PageKind::PHOTOGRAPHIC) {
+        for (const auto &format : formats) {
+            if (format != "PNG") {
+                chosen = format;
+                break;
+            }
+        }
+    }
+    if (chosen.empty() && formats.size() <= 1) {
+        chosen = formats.empty() ? "PNG" : formats[0];
+    }
+    if (!chosen.empty()) {
+        encode_page(
+            img,
+            stretch_page_contrast,
+            auto_candidate_task(task, chosen),
+            base_path,
+            log
+        );
+        auto kind_name = kind == PageKind::LINE_ART      ? "line art"
+                       : kind == PageKind::PHOTOGRAPHIC ? "photographic"
+                                                        : "mixed";
+        log("@info " + name + ": auto format: " + kind_name + ", saved as "
+            + chosen + " without trial encodes");
+        return base_path + output_extension(auto_candidate_task(task, chosen));
+    }
+
+    // The candidates are saved next to the page under a temporary name. Their
+    // extensions differ, so they don’t overwrite each other.
+    auto candidate_base = base_path + ".candidate";
+    auto candidate_tasks = std::vector<PageTask>();
+    auto futures = std::vector<std::future<void>>();
+    for (const auto &format : formats) {
+        candidate_tasks.push_back(auto_candidate_task(task, format));
+    }
+    // The candidates are encoded at once, so they take turns to log.
+    auto log_mutex = std::mutex();
+    auto locked_log = [&](const std::string &message) {
+        auto lock = std::lock_guard(log_mutex);
+        log(message);
+    };
+    for (const auto &candidate_task : candidate_tasks) {
+        futures.push_back(std::async(std::launch::async, [&] {
+            encode_page(
+                img,
+                stretch_page_contrast,
+                candidate_task,
+                candidate_base,
+                locked_log
+            );
+        }));
+    }
+
+    // Wait for every encode before rethrowing, so that no thread is left
+    // writing a candidate that is about to be removed.
+    auto error = std::exception_ptr();
+    for (auto &future : futures) {
+        try {
+            future.get();
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+    }
+
+    auto sizes = std::vector<uintmax_t>();
+    for (const auto &candidate_task : candidate_tasks) {
+        auto path = candidate_base + output_extension(candidate_task);
+        auto ec = std::error_code();
+        auto size = fs::file_size(path, ec);
+        sizes.push_back(ec ? UINTMAX_MAX : size);
+    }
+    auto best = static_cast<size_t>(
+        std::min_element(sizes.begin(), sizes.end()) - sizes.begin()
+    );
+    if (error && sizes[best] == UINTMAX_MAX) {
+        std::rethrow_exception(error);
+    }
+
+    auto runner_up = UINTMAX_MAX;
+    auto runner_up_format = std::string();
+    for (size_t i = 0; i < candidate_tasks.size(); i += 1) {
+        auto path = candidate_base + output_extension(candidate_tasks[i]);
+        if (i == best) {
+            fs::rename(path, base_path + output_extension(candidate_tasks[i]));
+            continue;
+        }
+        if (sizes[i] < runner_up) {
+            runner_up = sizes[i];
+            runner_up_format = candidate_tasks[i].image_format;
+        }
+        auto ec = std::error_code();
+        fs::remove(path, ec);
+    }
+
+    auto report = name + ": auto format: saved as "
+                + candidate_tasks[best].image_format + " ("
+                + std::to_string(sizes[best]) + " bytes";
+    if (runner_up != UINTMAX_MAX) {
+        report += ", " + std::to_string(runner_up - sizes[best])
+                + " bytes smaller than " + runner_up_format;
+    }
+    log("@info " + report + ")");
+    return base_path + output_extension(candidate_tasks[best]);
+}
+
+PageTask auto_candidate_task(const PageTask &task, std::string format) {
+    auto candidate = task;
+    candidate.image_format = std::move(format);
+    candidate.quality_type_is_distance = false;
+
+    if (candidate.image_format == "PNG") {
+        candidate.is_lossy = false;
+        candidate.compression_effort = AUTO_PNG_EFFORT;
+        // PNG candidates are only quantized when the pages are, so that an
+        // unquantized page’s lossless candidate isn’t compared against a lossy
+        // one.
+        return candidate;
+    }
+
+    candidate.is_lossy = true;
+    if (candidate.image_format == "AVIF") {
+        candidate.compression_effort = AUTO_AVIF_EFFORT;
+    }
+    else if (candidate.image_format == "JPEG XL") {
+        candidate.compression_effort = AUTO_JPEG_XL_EFFORT;
+    }
+    else if (candidate.image_format == "WebP") {
+        candidate.compression_effort = AUTO_WEBP_EFFORT;
+    }
+    return candidate;
+}
@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "../include/task.hpp"
+#include "include/bilevel.hpp"
+#include "include/png.hpp"
+
+static void pack_thresholded_row(const uint8_t *row, int width, uint8_t *out);
+static void pack_dithered_row(
+    const uint8_t *row,
+    int width,
+    double amount,
+    std::vector<float> &error,
+    std::vector<float> &next_error,
+    uint8_t *out
+);
+
+bool is_bilevel_output(const PageTask &task) {
+    return task.image_format == "PNG" && task.quantize_pages
+        && task.bit_depth == 1;
+}
+
+void save_bilevel_png(
+    vips::VImage img, const PageTask &task, const std::string &path
+) {
+    if (img.has_alpha()) {
+        img = img.flatten(vips::VImage::option()->set("background", 255.0));
+    }
+    img = img.colourspace(VIPS_INTERPRETATION_B_W)[0].cast(VIPS_FORMAT_UCHAR);
+
+    auto width = img.width();
+    auto height = img.height();
+    size_t size = 0;
+    auto pixels = static_cast<uint8_t *>(img.write_to_memory(&size));
+
+    // Every PNG row starts with a filter type byte. Filtering doesn’t help
+    // 1-bit images, so it’s always 0 (none).
+    auto stride = static_cast<size_t>(width + 7) / 8 + 1;
+    auto rows = std::vector<uint8_t>(stride * height, 0);
+
+    auto error = std::vector<float>(width + 2, 0.0f);
+    auto next_error = std::vector<float>(width + 2, 0.0f);
+    for (auto y = 0; y < height; y += 1) {
+        auto row = pixels + static_cast<size_t>(y) * width;
+        auto out = rows.data() + y * stride + 1;
+        if (task.dither > 0) {
+            pack_dithered_row(row, width, task.dither, error, next_error, out);
+        }
+        else {
+            pack_thresholded_row(row, width, out);
+        }
+    }
+    g_free(pixels);
+
+    write_grey_png(
+        path, width, height, 1, {}, std::move(rows), task.compression_effort
+    );
+}
+
+// Reverses the bits of every byte: SSE2 gives the first pixel in the lowest
+// bit, but PNG wants it in the highest.
+const auto REVERSED_BITS = [] {
+    auto table = std::array<uint8_t, 256>();
+    for (auto i = 0; i < 256; i += 1) {
+        auto reversed = 0;
+        for (auto bit = 0; bit < 8; bit += 1) {
+            if (i & (1 << bit)) {
+                reversed |= 0x80 >> bit;
+            }
+        }
+        table[i] = static_cast<uint8_t>(reversed);
+    }
+    return table;
+}();
+
+// A pixel is white when its value is at least 128, which is exactly when its
+// top bit is set, so no comparison is needed: `movemask` collects the top bit
+// of 16 pixels at once.
+void pack_thresholded_row(const uint8_t *row, int width, uint8_t *out) {
+    auto x = 0;
+#if defined(__SSE2__)
+    for (; x + 16 <= width; x += 16) {
+        auto chunk
+            = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x));
+        auto mask = _mm_movemask_epi8(chunk);
+        out[x / 8] = REVERSED_BITS[mask & 0xFF];
+        out[x / 8 + 1] = REVERSED_BITS[(mask >> 8) & 0xFF];
+    }
+#endif
+    for (; x < width; x += 1) {
+        if (row[x] & 0x80) {
+            out[x / 8] |= static_cast<uint8_t>(0x80 >> (x % 8));
+        }
+    }
+}
+
+// Floyd–Steinberg error diffusion, scaled by `amount` as with the palette
+// dithering used for other bit depths. The error arrays have a slot of padding
+// on each side so that the edges need no special cases.
+void pack_dithered_row(
+    const uint8_t *row,
+    int width,
+    double amount,
+    std::vector<float> &error,
+    std::vector<float> &next_error,
+    uint8_t *out
+) {
+    auto strength = static_cast<float>(amount);
+    std::fill(next_error.begin(), next_error.end(), 0.0f);
+    for (auto x = 0; x < width; x += 1) {
+        auto value = row[x] + error[x + 1];
+        auto white = value >= 128.0f;
+        if (white) {
+            out[x / 8] |= static_cast<uint8_t>(0x80 >> (x % 8));
+        }
+        auto diffused = (value - (white ? 255.0f : 0.0f)) * strength;
+        error[x + 2] += diffused * 7.0f / 16.0f;
+        next_error[x] += diffused * 3.0f / 16.0f;
+        next_error[x + 1] += diffused * 5.0f / 16.0f;
+        next_error[x + 2] += diffused * 1.0f / 16.0f;
+    }
+    std::swap(error, next_error);
+}
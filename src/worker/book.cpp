@@ -0,0 +1,478 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+#include "../include/task.hpp"
+#include "include/book.hpp"
+#include "include/palette.hpp"
+#include "include/processing.hpp"
+
+namespace fs = std::filesystem;
+
+// Previews only need to be good enough to find where content starts and ends.
+const auto BOOK_PREVIEW_SIZE = 400;
+#if defined(PDF_ENABLED)
+const auto BOOK_PREVIEW_PPI = 36.0;
+#endif
+// Each side of the book’s crop is the margin that this fraction of its pages
+// have less of, so that a few pages with content up to the edge don’t stop the
+// rest from being cropped.
+const auto BOOK_MARGIN_PERCENTILE = 0.1;
+// Finding the book’s margins decodes a preview of every page, and the other
+// workers of the book wait for it. After this long, they crop their pages on
+// their own instead.
+const auto BOOK_MARGINS_MAX_WAIT = std::chrono::seconds(30);
+// How often a worker waiting for a lock checks whether it’s free.
+const auto LOCK_POLL_INTERVAL = std::chrono::milliseconds(50);
+
+static std::optional<std::string> load_or_compute_value(
+    const fs::path &dir,
+    const std::string &name,
+    const std::function<std::string()> &compute,
+    std::optional<std::chrono::milliseconds> max_wait = std::nullopt
+);
+static double low_percentile(std::vector<double> values);
+static std::optional<std::string> read_book_file(const fs::path &path);
+static std::vector<char> read_entry_data(struct archive *archive);
+
+#ifdef __linux__
+// Holds an exclusive `flock` on a file for as long as it’s alive. With
+// `max_wait`, it gives up once that has passed without getting the lock, and
+// `owns_lock` is false.
+class FileLock {
+    int fd;
+    bool locked = false;
+
+  public:
+    explicit FileLock(
+        const fs::path &path,
+        std::optional<std::chrono::milliseconds> max_wait = std::nullopt
+    ) {
+        fd = open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error(
+                "Could not open lock file " + path.string()
+            );
+        }
+        if (!max_wait) {
+            if (flock(fd, LOCK_EX) != 0) {
+                close(fd);
+                throw std::runtime_error(
+                    "Could not lock file " + path.string()
+                );
+            }
+            locked = true;
+            return;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + *max_wait;
+        while (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            if (errno != EWOULDBLOCK) {
+                close(fd);
+                throw std::runtime_error(
+                    "Could not lock file " + path.string()
+                );
+            }
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return;
+            }
+            std::this_thread::sleep_for(LOCK_POLL_INTERVAL);
+        }
+        locked = true;
+    }
+
+    ~FileLock() {
+        if (locked) {
+            flock(fd, LOCK_UN);
+        }
+        close(fd);
+    }
+
+    bool owns_lock() const {
+        return locked;
+    }
+
+    FileLock(const FileLock &) = delete;
+    FileLock &operator=(const FileLock &) = delete;
+};
+#endif
+
+fs::path book_state_dir(const PageTask &task) {
+    // Each book stages its pages in `<run>/<stem>`, so the run directory is
+    // the parent of `task.output_dir`. The state lives next to the staging
+    // directory rather than inside it so that it never ends up in the output.
+    return run_state_dir(task) / task.output_dir.filename();
+}
+
+fs::path run_state_dir(const PageTask &task) {
+    return task.output_dir.parent_path() / ".state";
+}
+
+std::string load_or_compute_book_value(
+    const PageTask &task,
+    const std::string &name,
+    const std::function<std::string()> &compute
+) {
+    return *load_or_compute_value(book_state_dir(task), name, compute);
+}
+
+std::string load_or_compute_run_value(
+    const PageTask &task,
+    const std::string &name,
+    const std::function<std::string()> &compute
+) {
+    return *load_or_compute_value(run_state_dir(task), name, compute);
+}
+
+std::optional<std::string> load_or_compute_value(
+    const fs::path &dir,
+    const std::string &name,
+    const std::function<std::string()> &compute,
+    [[maybe_unused]] std::optional<std::chrono::milliseconds> max_wait
+) {
+    auto path = dir / name;
+    if (auto value = read_book_file(path)) {
+        return *value;
+    }
+
+    fs::create_directories(dir);
+#ifdef __linux__
+    auto lock = FileLock(dir / (name + ".lock"), max_wait);
+    if (!lock.owns_lock()) {
+        return std::nullopt;
+    }
+    // Another worker may have finished while we were waiting for the lock.
+    if (auto value = read_book_file(path)) {
+        return *value;
+    }
+#endif
+
+    auto value = compute();
+
+    // Write to a temporary file and rename it so that readers never see a
+    // partially written value.
+    auto temp_path
+        = dir / (name + ".tmp" + std::to_string(std::random_device()()));
+    {
+        auto stream = std::ofstream(temp_path, std::ios::binary);
+        stream << value;
+        if (!stream) {
+            throw std::runtime_error(
+                "Could not write book state " + temp_path.string()
+            );
+        }
+    }
+    fs::rename(temp_path, path);
+
+    return value;
+}
+
+std::optional<std::string>
+find_registered_page(const PageTask &task, const std::string &identity) {
+    // One page per line: its output, a tab, then its identity.
+    auto path = book_state_dir(task) / "pages";
+    auto stream = std::ifstream(path);
+    auto line = std::string();
+    while (std::getline(stream, line)) {
+        auto tab = line.find('\t');
+        if (tab != std::string::npos && line.substr(tab + 1) == identity) {
+            return line.substr(0, tab);
+        }
+    }
+    return std::nullopt;
+}
+
+void register_page(
+    const PageTask &task,
+    const std::string &identity,
+    const std::string &output
+) {
+    auto dir = book_state_dir(task);
+    fs::create_directories(dir);
+#ifdef __linux__
+    // Lines are appended under a lock so that two workers’ lines never
+    // interleave. Two workers with the same page may both register it, and
+    // either output will do.
+    auto lock = FileLock(dir / "pages.lock");
+#endif
+
+    auto path = dir / "pages";
+    auto out = std::ofstream(path, std::ios::app);
+    out << output << '\t' << identity << '\n';
+    if (!out) {
+        throw std::runtime_error("Could not write book state " + path.string());
+    }
+}
+
+void for_each_book_preview(
+    const PageTask &task,
+    const std::function<void(const vips::VImage &)> &callback
+) {
+    if (task.path_in_archive.empty()) {
+#if defined(PDF_ENABLED)
+        FPDF_DOCUMENT doc
+            = FPDF_LoadDocument(task.source_file.string().c_str(), nullptr);
+        if (!doc) {
+            throw std::runtime_error(
+                "PDFium: Cannot open document. Error code: "
+                + std::to_string(FPDF_GetLastError())
+            );
+        }
+
+        try {
+            auto page_count = FPDF_GetPageCount(doc);
+            for (auto i = 0; i < page_count; i += 1) {
+                FPDF_PAGE page = FPDF_LoadPage(doc, i);
+                if (!page) {
+                    continue;
+                }
+                try {
+                    auto preview
+                        = render_pdf_page_preview(page, i, BOOK_PREVIEW_PPI);
+                    callback(preview);
+                }
+                catch (...) {
+                    FPDF_ClosePage(page);
+                    throw;
+                }
+                FPDF_ClosePage(page);
+            }
+        }
+        catch (...) {
+            FPDF_CloseDocument(doc);
+            throw;
+        }
+        FPDF_CloseDocument(doc);
+#endif
+        return;
+    }
+
+    auto archive = archive_read_new();
+    archive_read_support_filter_all(archive);
+    archive_read_support_format_all(archive);
+
+    if (archive_read_open_filename(
+            archive, task.source_file.string().c_str(), 10240
+        )
+        != ARCHIVE_OK) {
+        std::string err = archive_error_string(archive);
+        archive_read_free(archive);
+        throw std::runtime_error("LibArchive: Could not open file: " + err);
+    }
+
+    try {
+        struct archive_entry *entry;
+        while (archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
+            if (archive_entry_filetype(entry) != AE_IFREG) {
+                continue;
+            }
+
+            auto data = read_entry_data(archive);
+            if (data.empty()) {
+                continue;
+            }
+
+            // Thumbnailing lets the loader shrink while decoding (JPEG can
+            // skip most of the work), which is far cheaper than a full decode.
+            auto blob = vips_blob_copy(data.data(), data.size());
+            try {
+                auto options = vips::VImage::option()
+                                   ->set("height", BOOK_PREVIEW_SIZE)
+                                   ->set("size", VIPS_SIZE_DOWN);
+                auto preview = vips::VImage::thumbnail_buffer(
+                    blob, BOOK_PREVIEW_SIZE, options
+                );
+                preview = preview.copy_memory();
+                vips_area_unref(VIPS_AREA(blob));
+                callback(preview);
+            }
+            catch (const vips::VError &) {
+                // Not an image (e.g., `ComicInfo.xml`).
+                vips_area_unref(VIPS_AREA(blob));
+            }
+        }
+    }
+    catch (...) {
+        archive_read_close(archive);
+        archive_read_free(archive);
+        throw;
+    }
+
+    archive_read_close(archive);
+    archive_read_free(archive);
+}
+
+std::optional<ContentBox>
+book_content_box(const PageTask &task, const vips::VImage &proxy) {
+    // The book’s margins are stored as fractions of the page size so that they
+    // apply to pages of slightly different dimensions. Pages with content
+    // right up to every edge, such as most covers, say nothing about the
+    // book’s margins, so they’re left out.
+    auto value = load_or_compute_value(
+        book_state_dir(task),
+        "margins",
+        [&] {
+            auto lefts = std::vector<double>();
+            auto tops = std::vector<double>();
+            auto rights = std::vector<double>();
+            auto bottoms = std::vector<double>();
+
+            for_each_book_preview(task, [&](const vips::VImage &preview) {
+                double preview_width = preview.width();
+                double preview_height = preview.height();
+                if (preview_width > preview_height) {
+                    return;
+                }
+
+                auto box = find_content_box(preview);
+                if (!box) {
+                    return;
+                }
+                auto right = preview_width - box->left - box->width;
+                auto bottom = preview_height - box->top - box->height;
+                if (box->left == 0 && box->top == 0 && right == 0
+                    && bottom == 0) {
+                    return;
+                }
+
+                lefts.push_back(box->left / preview_width);
+                tops.push_back(box->top / preview_height);
+                rights.push_back(right / preview_width);
+                bottoms.push_back(bottom / preview_height);
+            });
+
+            if (lefts.empty()) {
+                return std::string();
+            }
+
+            auto stream = std::ostringstream();
+            stream << low_percentile(lefts) << ' ' << low_percentile(tops)
+                   << ' ' << low_percentile(rights) << ' '
+                   << low_percentile(bottoms);
+            return stream.str();
+        },
+        BOOK_MARGINS_MAX_WAIT
+    );
+
+    // Another worker is still finding the book’s margins.
+    if (!value) {
+        return find_content_box(proxy);
+    }
+    if (value->empty()) {
+        return std::nullopt;
+    }
+
+    double left, top, right, bottom;
+    auto stream = std::istringstream(*value);
+    if (!(stream >> left >> top >> right >> bottom)) {
+        throw std::runtime_error("Invalid book margins: " + *value);
+    }
+
+    auto width = proxy.width();
+    auto height = proxy.height();
+    auto left_px = static_cast<int>(left * width);
+    auto top_px = static_cast<int>(top * height);
+    auto right_px = static_cast<int>(right * width);
+    auto bottom_px = static_cast<int>(bottom * height);
+
+    return ContentBox{
+        .left = left_px,
+        .top = top_px,
+        .width = std::max(width - left_px - right_px, 1),
+        .height = std::max(height - top_px - bottom_px, 1),
+    };
+}
+
+std::vector<uint8_t> book_grey_palette(const PageTask &task) {
+    // Each bit depth has its own palette, in case pages of the same book are
+    // ever processed with different settings.
+    auto name = "palette_" + std::to_string(task.bit_depth);
+    auto value = load_or_compute_book_value(task, name, [&] {
+        auto histogram = std::vector<double>(256, 0.0);
+        for_each_book_preview(task, [&](const vips::VImage &preview) {
+            auto grey = preview.colourspace(VIPS_INTERPRETATION_B_W)[0].cast(
+                VIPS_FORMAT_UCHAR
+            );
+            // Pages are stretched before they’re mapped to the palette, so
+            // their tones are counted as they’ll be once stretched.
+            if (task.stretch_page_contrast) {
+                grey = stretch_image_contrast(grey);
+            }
+            auto counts = image_to_doubles(grey.hist_find());
+            for (size_t i = 0; i < counts.size() && i < 256; i += 1) {
+                histogram[i] += counts[i];
+            }
+        });
+
+        auto stream = std::ostringstream();
+        for (auto level : optimal_grey_levels(histogram, 1 << task.bit_depth)) {
+            stream << static_cast<int>(level) << ' ';
+        }
+        return stream.str();
+    });
+
+    auto levels = std::vector<uint8_t>();
+    auto stream = std::istringstream(value);
+    int level;
+    while (stream >> level) {
+        levels.push_back(static_cast<uint8_t>(level));
+    }
+    if (levels.empty()) {
+        throw std::runtime_error("Invalid book palette: " + value);
+    }
+    return levels;
+}
+
+std::optional<std::string> read_book_file(const fs::path &path) {
+    auto stream = std::ifstream(path, std::ios::binary);
+    if (!stream) {
+        return std::nullopt;
+    }
+    auto buffer = std::ostringstream();
+    buffer << stream.rdbuf();
+    return buffer.str();
+}
+
+std::vector<char> read_entry_data(struct archive *archive) {
+    auto data = std::vector<char>();
+    char chunk[65536];
+    la_ssize_t bytes_read;
+    while ((bytes_read = archive_read_data(archive, chunk, sizeof(chunk)))
+           > 0) {
+        data.insert(data.end(), chunk, chunk + bytes_read);
+    }
+    if (bytes_read < 0) {
+        throw std::runtime_error(
+            std::string("LibArchive: Read error: ")
+            + archive_error_string(archive)
+        );
+    }
+    return data;
+}
+
+// The value that `BOOK_MARGIN_PERCENTILE` of `values` are below.
+double low_percentile(std::vector<double> values) {
+    auto index = static_cast<size_t>(
+        BOOK_MARGIN_PERCENTILE * static_cast<double>(values.size() - 1)
+    );
+    std::nth_element(
+        values.begin(),
+        values.begin() + static_cast<std::ptrdiff_t>(index),
+        values.end()
+    );
+    return values[index];
+}
@@ -0,0 +1,447 @@
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "../include/task.hpp"
+#include "include/bilevel.hpp"
+#include "include/book.hpp"
+#include "include/cache.hpp"
+#include "include/duplicates.hpp"
+#include "include/processing.hpp"
+
+namespace fs = std::filesystem;
+
+// Part of every key, so that entries from older versions of the processing
+// are never used. Raise it when a change to processing changes its output.
+const auto CACHE_FORMAT_VERSION = 3;
+// The source file is hashed in blocks of this many bytes.
+const auto SOURCE_HASH_BLOCK_SIZE = 1 << 20;
+
+static fs::path cache_entry_dir(const PageTask &task);
+static std::string cache_key(const PageTask &task);
+static std::string sha256_hex(std::string_view text);
+static fs::path part_path(const fs::path &entry_dir, const std::string &suffix);
+static fs::path temporary_path(const fs::path &path);
+static fs::path source_cache_path(const PageTask &task);
+static std::string source_file_hash(const PageTask &task);
+static void trim_source_cache(const PageTask &task);
+static bool depends_on_book(const PageTask &task);
+
+bool encode_cached_page(const PageTask &task, Logger log) {
+    if (task.cache_dir.empty()) {
+        return false;
+    }
+    auto entry_dir = cache_entry_dir(task);
+    auto manifest = std::ifstream(entry_dir / "parts");
+    if (!manifest) {
+        return false;
+    }
+
+    auto stretch_page_contrast = false;
+    auto identity = std::string();
+    auto suffixes = std::vector<std::string>();
+    for (auto line = std::string(); std::getline(manifest, line);) {
+        if (line.starts_with("stretch ")) {
+            stretch_page_contrast = line.substr(8) == "1";
+        }
+        else if (line.starts_with("identity ")) {
+            identity = line.substr(9);
+        }
+        else if (line.starts_with("part ")) {
+            suffixes.push_back(line.substr(5));
+        }
+    }
+    auto ec = std::error_code();
+    if (suffixes.empty()) {
+        return false;
+    }
+    for (const auto &suffix : suffixes) {
+        if (!fs::exists(part_path(entry_dir, suffix), ec)) {
+            return false;
+        }
+    }
+
+    auto base_path = task.output_dir / task.output_base_name;
+    fs::create_directories(base_path.parent_path());
+
+    // Whether the page duplicates another depends on the rest of the run, so
+    // it’s decided again from its identity, as `process_vimage` does.
+    auto output = fs::path(task.output_base_name + output_extension(task))
+                      .generic_string();
+    auto deduplicate = !identity.empty();
+    if (deduplicate) {
+        if (auto reuse = find_page_to_reuse(task, identity)) {
+            write_page_reference(task, *reuse);
+            return true;
+        }
+    }
+
+    for (const auto &suffix : suffixes) {
+        auto img = vips::VImage::new_from_file(
+            part_path(entry_dir, suffix).string().c_str()
+        );
+        encode_and_report(
+            img, stretch_page_contrast, task, base_path.string() + suffix, log
+        );
+    }
+    if (deduplicate) {
+        register_page_output(task, identity, output);
+    }
+    return true;
+}
+
+void cache_page_part(
+    const PageTask &task, const std::string &suffix, const vips::VImage &img
+) {
+    if (task.cache_dir.empty()) {
+        return;
+    }
+    auto entry_dir = cache_entry_dir(task);
+    fs::create_directories(entry_dir);
+
+    // Saved under a temporary name and renamed, so that a reader never sees a
+    // part that is still being written.
+    auto path = part_path(entry_dir, suffix);
+    auto temp_path = temporary_path(path);
+    img.vipssave(temp_path.string().c_str());
+    fs::rename(temp_path, path);
+}
+
+void cache_page(
+    const PageTask &task,
+    const std::string &identity,
+    bool stretch_page_contrast,
+    const std::vector<std::string> &suffixes
+) {
+    if (task.cache_dir.empty()) {
+        return;
+    }
+    auto entry_dir = cache_entry_dir(task);
+    fs::create_directories(entry_dir);
+
+    // The manifest comes last. An entry without one is incomplete.
+    auto manifest_path = entry_dir / "parts";
+    auto temp_manifest_path = temporary_path(manifest_path);
+    {
+        auto manifest = std::ofstream(temp_manifest_path);
+        manifest << "stretch " << (stretch_page_contrast ? 1 : 0) << '\n';
+        if (!identity.empty()) {
+            manifest << "identity " << identity << '\n';
+        }
+        for (const auto &suffix : suffixes) {
+            manifest << "part " << suffix << '\n';
+        }
+        if (!manifest) {
+            throw std::runtime_error(
+                "Could not write " + temp_manifest_path.string()
+            );
+        }
+    }
+    fs::rename(temp_manifest_path, manifest_path);
+}
+
+std::optional<vips::VImage> load_cached_source_page(const PageTask &task) {
+    if (task.source_cache_dir.empty()) {
+        return std::nullopt;
+    }
+    auto path = source_cache_path(task);
+
+    // Another worker can trim the entry at any moment, so it’s opened rather
+    // than checked for first. Once open, it stays readable even if it’s then
+    // removed.
+    auto img = vips::VImage();
+    try {
+        img = vips::VImage::new_from_file(path.string().c_str());
+    }
+    catch (const vips::VError &) {
+        return std::nullopt;
+    }
+
+    // The modification time records when the entry was last used, for
+    // `trim_source_cache`.
+    auto ec = std::error_code();
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+    return img;
+}
+
+void cache_source_page(const PageTask &task, const vips::VImage &img) {
+    if (task.source_cache_dir.empty()) {
+        return;
+    }
+    fs::create_directories(task.source_cache_dir);
+
+    // Trimming lists the whole cache, so it’s done once per run, by the first
+    // worker to add to it, rather than after every page.
+    load_or_compute_run_value(task, "source_cache_trimmed", [&] {
+        trim_source_cache(task);
+        return std::string();
+    });
+
+    auto path = source_cache_path(task);
+    auto temp_path = temporary_path(path);
+    img.vipssave(temp_path.string().c_str());
+    fs::rename(temp_path, path);
+}
+
+std::string
+output_cache_key(const PageTask &task, const std::vector<char> &page_data) {
+    if (task.output_cache_dir.empty()) {
+        return "";
+    }
+
+    auto stream = std::ostringstream();
+    stream << COMICPRESS_VERSION << ' ' << CACHE_FORMAT_VERSION << '\n';
+    if (page_data.empty() || depends_on_book(task)) {
+        stream << source_file_hash(task) << ' ' << task.page_number << '\n';
+    }
+    if (!page_data.empty()) {
+        auto bytes = std::string_view(page_data.data(), page_data.size());
+        stream << sha256_hex(bytes) << '\n';
+    }
+
+    stream << task.image_format << ' ';
+    for (const auto &format : task.auto_image_formats) {
+        stream << format << ',';
+    }
+#if defined(PDF_ENABLED)
+    stream << ' ' << task.pdf_pixel_density;
+#endif
+    stream << ' ' << task.dither << ' ' << task.quality << ' '
+           << task.target_quality << ' ' << task.page_width << ' '
+           << task.page_height << ' ' << task.bit_depth << ' '
+           << task.compression_effort << ' ' << task.double_page_spread_action
+           << ' ' << task.rotation_direction << ' ' << task.reading_direction
+           << ' ' << task.page_resampler << ' '
+           << task.convert_pages_to_greyscale << task.map_colour_eink
+           << task.remove_spine << task.crop_margins
+           << task.crop_margins_per_book << task.slice_long_strips
+           << task.deduplicate_pages << task.stretch_page_contrast
+           << task.linear_light_resampling << task.scale_pages
+           << task.quantize_pages << task.share_book_palette << task.is_lossy
+           << task.quality_type_is_distance;
+    return sha256_hex(stream.str());
+}
+
+bool restore_cached_output(const PageTask &task, const std::string &key) {
+    if (key.empty()) {
+        return false;
+    }
+    auto entry_dir = task.output_cache_dir / key;
+    auto ec = std::error_code();
+    if (!fs::is_directory(entry_dir, ec)) {
+        return false;
+    }
+
+    auto base_path = task.output_dir / task.output_base_name;
+    fs::create_directories(base_path.parent_path());
+    for (const auto &item : fs::directory_iterator(entry_dir)) {
+        // Entries store each file as “page” followed by its suffix and
+        // extension.
+        auto name = item.path().filename().string().substr(4);
+        fs::copy_file(
+            item.path(),
+            base_path.string() + name,
+            fs::copy_options::overwrite_existing
+        );
+    }
+    return true;
+}
+
+void cache_output(
+    const PageTask &task,
+    const std::string &key,
+    const std::vector<fs::path> &outputs
+) {
+    if (key.empty() || outputs.empty()) {
+        return;
+    }
+    auto base_path = task.output_dir / task.output_base_name;
+    auto base = base_path.filename().string();
+
+    // Every file is named after the page, so only what follows its base name
+    // is stored.
+    for (const auto &output : outputs) {
+        if (output.parent_path() != base_path.parent_path()
+            || !output.filename().string().starts_with(base)) {
+            return;
+        }
+    }
+
+    // The entry is filled under a temporary name and renamed, so that it only
+    // ever appears complete. When another worker stored the same page first,
+    // the rename fails and this copy is dropped.
+    auto entry_dir = task.output_cache_dir / key;
+    auto temp_dir = temporary_path(entry_dir);
+    fs::create_directories(temp_dir);
+    for (const auto &output : outputs) {
+        auto name = "page" + output.filename().string().substr(base.size());
+        fs::copy_file(output, temp_dir / name);
+    }
+    auto ec = std::error_code();
+    fs::rename(temp_dir, entry_dir, ec);
+    if (ec) {
+        fs::remove_all(temp_dir, ec);
+    }
+}
+
+fs::path cache_entry_dir(const PageTask &task) {
+    return task.cache_dir / sha256_hex(cache_key(task));
+}
+
+// Everything that a page depends on up to encoding, and nothing after. The
+// source file is identified by its path, size and modification time.
+std::string cache_key(const PageTask &task) {
+    auto ec = std::error_code();
+    auto size = fs::file_size(task.source_file, ec);
+    auto modified = fs::last_write_time(task.source_file, ec);
+
+    auto stream = std::ostringstream();
+    stream << CACHE_FORMAT_VERSION << '\n'
+           << fs::absolute(task.source_file, ec).string() << '\n'
+           << size << ' ' << modified.time_since_epoch().count() << '\n'
+           << task.path_in_archive << '\n'
+           << task.page_number << ' ' << task.output_base_name << '\n';
+#if defined(PDF_ENABLED)
+    stream << task.pdf_pixel_density << ' ';
+#endif
+    stream << task.convert_pages_to_greyscale << task.map_colour_eink
+           << task.remove_spine << task.crop_margins
+           << task.crop_margins_per_book << task.deduplicate_pages
+           << task.stretch_page_contrast << task.linear_light_resampling
+           << task.scale_pages << is_bilevel_output(task) << ' '
+           << task.double_page_spread_action << ' ' << task.rotation_direction
+           << ' ' << task.reading_direction << ' ' << task.page_width << ' '
+           << task.page_height << ' ' << task.page_resampler;
+    return stream.str();
+}
+
+// Everything that decoding a page depends on. PDF pages are rendered in
+// greyscale depending on the options, so those are part of their key.
+fs::path source_cache_path(const PageTask &task) {
+    auto stream = std::ostringstream();
+    stream << CACHE_FORMAT_VERSION << '\n'
+           << source_file_hash(task) << '\n'
+           << task.path_in_archive << '\n'
+           << task.page_number;
+#if defined(PDF_ENABLED)
+    if (task.path_in_archive.empty()) {
+        stream << ' ' << task.pdf_pixel_density << ' '
+               << task.convert_pages_to_greyscale << is_bilevel_output(task);
+    }
+#endif
+    auto name = sha256_hex(stream.str()) + ".v";
+    return task.source_cache_dir / name;
+}
+
+// The source file is hashed once per book, by whichever worker gets there
+// first.
+std::string source_file_hash(const PageTask &task) {
+    return load_or_compute_book_value(task, "source_hash", [&] {
+        auto file = std::ifstream(task.source_file, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error(
+                "Could not read " + task.source_file.string()
+            );
+        }
+        auto checksum = g_checksum_new(G_CHECKSUM_SHA256);
+        auto buffer = std::vector<char>(SOURCE_HASH_BLOCK_SIZE);
+        while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+            g_checksum_update(
+                checksum,
+                reinterpret_cast<const guchar *>(buffer.data()),
+                file.gcount()
+            );
+        }
+        auto hash = std::string(g_checksum_get_string(checksum));
+        g_checksum_free(checksum);
+        return hash;
+    });
+}
+
+// Removes the entries used longest ago until the cache fits its limit. Other
+// workers may be reading entries as they go, which is harmless, since an open
+// entry stays readable.
+void trim_source_cache(const PageTask &task) {
+    struct Entry {
+        fs::path path;
+        fs::file_time_type used;
+        uintmax_t size;
+    };
+
+    auto entries = std::vector<Entry>();
+    uintmax_t total = 0;
+    auto ec = std::error_code();
+    for (const auto &item : fs::directory_iterator(task.source_cache_dir, ec)) {
+        // Skips files that are still being written, whose names end in a
+        // temporary suffix.
+        if (item.path().extension() != ".v") {
+            continue;
+        }
+        auto size = item.file_size(ec);
+        auto used = item.last_write_time(ec);
+        if (ec) {
+            continue;
+        }
+        entries.push_back(
+            Entry{.path = item.path(), .used = used, .size = size}
+        );
+        total += size;
+    }
+
+    auto limit = static_cast<uintmax_t>(task.source_cache_limit_mb) << 20;
+    if (total <= limit) {
+        return;
+    }
+    std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) {
+        return a.used < b.used;
+    });
+    for (const auto &entry : entries) {
+        if (total <= limit) {
+            break;
+        }
+        if (fs::remove(entry.path, ec)) {
+            total -= entry.size;
+        }
+    }
+}
+
+// Whether a page’s output depends on the other pages of its book, through the
+// margins or palette that the whole book shares.
+bool depends_on_book(const PageTask &task) {
+    return (task.crop_margins && task.crop_margins_per_book)
+        || (task.quantize_pages && task.share_book_palette);
+}
+
+// Entries are found by their keys alone, so a collision would silently serve
+// another page’s files. SHA-256 makes one practically impossible.
+std::string sha256_hex(std::string_view text) {
+    auto checksum = g_compute_checksum_for_data(
+        G_CHECKSUM_SHA256,
+        reinterpret_cast<const guchar *>(text.data()),
+        text.size()
+    );
+    auto hex = std::string(checksum);
+    g_free(checksum);
+    return hex;
+}
+
+fs::path part_path(const fs::path &entry_dir, const std::string &suffix) {
+    return entry_dir / ("part" + suffix + ".v");
+}
+
+// A name next to `path` that no other writer uses.
+fs::path temporary_path(const fs::path &path) {
+    thread_local auto generator = std::mt19937_64(std::random_device()());
+    auto stream = std::ostringstream();
+    stream << path.string() << ".tmp" << std::hex << generator();
+    return stream.str();
+}
@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include "../include/task.hpp"
+#include "include/book.hpp"
+#include "include/colour.hpp"
+
+// The number of grid points along each side of the lookup table. 33 is the
+// usual size for 8-bit colour; finer grids don’t change the rounded output.
+const auto LUT_SIZE = 33;
+// How much more saturated colours are made to make up for the panel.
+const auto EINK_SATURATION_BOOST = 1.5;
+// The chroma (in CIE LCh) beyond which the panel can’t show any difference.
+const auto EINK_MAX_CHROMA = 60.0;
+// Kaleido panels show 4096 colours: 16 levels for each channel.
+const auto EINK_LEVELS = 16;
+// Fixed-point interpolation weights have this many fractional bits.
+const auto LUT_FRACTION_BITS = 16;
+
+static std::string build_colour_eink_lut();
+static void map_pixel(const uint8_t *lut, const uint8_t *in, uint8_t *out);
+
+bool should_map_colour_eink(const vips::VImage &img, const PageTask &task) {
+    return task.map_colour_eink && !task.convert_pages_to_greyscale
+        && img.bands() >= 3;
+}
+
+vips::VImage map_colour_eink(const vips::VImage &img, const PageTask &task) {
+    // The table only depends on constants, so the first worker of the run to
+    // need it builds it and every other page of every book reads it back.
+    auto lut = load_or_compute_run_value(
+        task, "colour_eink_lut", build_colour_eink_lut
+    );
+    if (lut.size() != LUT_SIZE * LUT_SIZE * LUT_SIZE * 3) {
+        throw std::runtime_error("Invalid colour e-ink lookup table");
+    }
+
+    auto rgb = img;
+    if (rgb.has_alpha()) {
+        rgb = rgb.flatten(vips::VImage::option()->set("background", 255.0));
+    }
+    rgb = rgb.colourspace(VIPS_INTERPRETATION_sRGB).cast(VIPS_FORMAT_UCHAR);
+
+    size_t size = 0;
+    auto pixels = static_cast<uint8_t *>(rgb.write_to_memory(&size));
+    auto table = reinterpret_cast<const uint8_t *>(lut.data());
+    for (size_t i = 0; i + 3 <= size; i += 3) {
+        map_pixel(table, pixels + i, pixels + i);
+    }
+
+    return vips::VImage::new_from_memory_steal(
+        pixels, size, rgb.width(), rgb.height(), 3, VIPS_FORMAT_UCHAR
+    );
+}
+
+// Runs every grid point through the gamut mapping at once, as one small image.
+std::string build_colour_eink_lut() {
+    auto grid = std::string();
+    grid.reserve(LUT_SIZE * LUT_SIZE * LUT_SIZE * 3);
+    for (auto r = 0; r < LUT_SIZE; r += 1) {
+        for (auto g = 0; g < LUT_SIZE; g += 1) {
+            for (auto b = 0; b < LUT_SIZE; b += 1) {
+                for (auto value : {r, g, b}) {
+                    grid.push_back(
+                        static_cast<char>((value * 255 + 16) / (LUT_SIZE - 1))
+                    );
+                }
+            }
+        }
+    }
+
+    auto image = vips::VImage::new_from_memory(
+        grid.data(),
+        grid.size(),
+        LUT_SIZE,
+        LUT_SIZE * LUT_SIZE,
+        3,
+        VIPS_FORMAT_UCHAR
+    );
+    image = image.copy(
+        vips::VImage::option()->set("interpretation", VIPS_INTERPRETATION_sRGB)
+    );
+
+    // Boost chroma, then compress it with a soft knee so that it approaches
+    // but never exceeds what the panel can show. Clipping instead would turn
+    // smooth gradients of saturated colour into flat patches.
+    auto lch = image.colourspace(VIPS_INTERPRETATION_LCH);
+    auto boosted = lch[1] * EINK_SATURATION_BOOST;
+    auto chroma = boosted / (boosted / EINK_MAX_CHROMA + 1.0);
+    auto mapped = lch[0]
+                      .bandjoin(chroma)
+                      .bandjoin(lch[2])
+                      .copy(vips::VImage::option()->set(
+                          "interpretation", VIPS_INTERPRETATION_LCH
+                      ))
+                      .colourspace(VIPS_INTERPRETATION_sRGB)
+                      .cast(VIPS_FORMAT_UCHAR);
+
+    size_t size = 0;
+    auto data = static_cast<char *>(mapped.write_to_memory(&size));
+    auto lut = std::string(data, size);
+    g_free(data);
+    return lut;
+}
+
+// Tetrahedral interpolation: the cube around the input colour is split into
+// six tetrahedra, and the one holding the colour is picked by the order of its
+// fractional coordinates. This only needs four table entries instead of the
+// eight of trilinear interpolation, and keeps neutral greys neutral.
+void map_pixel(const uint8_t *lut, const uint8_t *in, uint8_t *out) {
+    const int strides[3] = {LUT_SIZE * LUT_SIZE * 3, LUT_SIZE * 3, 3};
+    const auto one = 1 << LUT_FRACTION_BITS;
+
+    int offset = 0;
+    int fractions[3];
+    for (auto channel = 0; channel < 3; channel += 1) {
+        auto position = (in[channel] * (LUT_SIZE - 1) << LUT_FRACTION_BITS)
+                      / 255;
+        auto index = std::min(position >> LUT_FRACTION_BITS, LUT_SIZE - 2);
+        fractions[channel] = position - (index << LUT_FRACTION_BITS);
+        offset += index * strides[channel];
+    }
+
+    // Walk from the cube’s low corner to its high corner along the axes in
+    // order of decreasing fraction.
+    int axes[3] = {0, 1, 2};
+    std::sort(axes, axes + 3, [&](int a, int b) {
+        return fractions[a] > fractions[b];
+    });
+    auto corner1 = offset + strides[axes[0]];
+    auto corner2 = corner1 + strides[axes[1]];
+    auto corner3 = corner2 + strides[axes[2]];
+    auto weight0 = one - fractions[axes[0]];
+    auto weight1 = fractions[axes[0]] - fractions[axes[1]];
+    auto weight2 = fractions[axes[1]] - fractions[axes[2]];
+    auto weight3 = fractions[axes[2]];
+
+    for (auto channel = 0; channel < 3; channel += 1) {
+        auto value = weight0 * lut[offset + channel]
+                   + weight1 * lut[corner1 + channel]
+                   + weight2 * lut[corner2 + channel]
+                   + weight3 * lut[corner3 + channel];
+        // Round to the nearest of the panel’s levels, which are evenly
+        // spaced from 0 to 255.
+        auto level = (static_cast<int64_t>(value) * (EINK_LEVELS - 1)
+                      + (static_cast<int64_t>(255) << (LUT_FRACTION_BITS - 1)))
+                   / (static_cast<int64_t>(255) << LUT_FRACTION_BITS);
+        out[channel] = static_cast<uint8_t>(level * 255 / (EINK_LEVELS - 1));
+    }
+}
@@ -0,0 +1,81 @@
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include "../include/task.hpp"
+#include "include/book.hpp"
+#include "include/duplicates.hpp"
+#include "include/processing.hpp"
+
+// A page is blank when its tones barely vary. This allows for scanner noise
+// and paper texture but not for a single line of text.
+const auto BLANK_MAX_DEVIATION = 3.0;
+
+static bool page_output_exists(const PageTask &task, const std::string &output);
+
+bool is_blank_page(const vips::VImage &proxy) {
+    auto grey = proxy.colourspace(VIPS_INTERPRETATION_B_W)[0];
+    return grey.deviate() <= BLANK_MAX_DEVIATION;
+}
+
+std::string page_identity(const vips::VImage &image, bool blank) {
+    if (blank) {
+        return "blank";
+    }
+
+    // The size and layout are part of it, since the same bytes can make up
+    // pages of different shapes.
+    size_t size = 0;
+    auto pixels = image.write_to_memory(&size);
+    auto checksum = g_compute_checksum_for_data(
+        G_CHECKSUM_SHA256, static_cast<const guchar *>(pixels), size
+    );
+    auto identity = std::to_string(image.width()) + "x"
+                  + std::to_string(image.height()) + "x"
+                  + std::to_string(image.bands()) + " "
+                  + std::to_string(image.format()) + " " + checksum;
+    g_free(checksum);
+    g_free(pixels);
+    return identity;
+}
+
+std::optional<std::string>
+find_page_to_reuse(const PageTask &task, const std::string &identity) {
+    return find_registered_page(task, identity);
+}
+
+void register_page_output(
+    const PageTask &task, const std::string &identity, const std::string &output
+) {
+    if (page_output_exists(task, output)) {
+        register_page(task, identity, output);
+    }
+}
+
+void write_page_reference(const PageTask &task, const std::string &target) {
+    auto path = task.output_dir / (task.output_base_name + ".ref");
+    auto stream = std::ofstream(path, std::ios::binary);
+    stream << target;
+    if (!stream) {
+        throw std::runtime_error("Could not write " + path.string());
+    }
+}
+
+// Pages saved in the “Auto” image format are recorded without an extension, so
+// any of the formats that it chooses between will do.
+bool page_output_exists(const PageTask &task, const std::string &output) {
+    auto ec = std::error_code();
+    if (task.image_format != "Auto") {
+        return fs::is_regular_file(task.output_dir / output, ec);
+    }
+    for (const auto &format : task.auto_image_formats) {
+        auto format_task = task;
+        format_task.image_format = format;
+        auto path = task.output_dir / (output + output_extension(format_task));
+        if (fs::is_regular_file(path, ec)) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "../../include/task.hpp"
+#include "processing.hpp"
+#include <string>
+#include <vips/vips8>
+
+// What a page is made of, as far as choosing its image format goes.
+enum class PageKind { LINE_ART, PHOTOGRAPHIC, AMBIGUOUS };
+
+// Classifies a page from its tones and colour, without encoding it.
+PageKind classify_page(const vips::VImage &img);
+
+// Saves a page in whichever of `task.auto_image_formats` suits it. Line art is
+// saved as a PNG, which is only quantized when pages are, and colour
+// photographs in the first lossy format. Other pages are encoded in every
+// format at once and the smallest file is kept. The decision is logged as an
+// `@info` status line. Returns the path of the file that was kept.
+std::string save_page_auto(
+    const vips::VImage &img,
+    bool stretch_page_contrast,
+    const PageTask &task,
+    const std::string &base_path,
+    Logger log
+);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "../../include/task.hpp"
+#include <string>
+#include <vips/vips8>
+
+// Whether pages are saved as 1-bit PNGs. These skip palette quantization and
+// go from 8-bit greyscale straight to packed bits.
+bool is_bilevel_output(const PageTask &task);
+
+// Saves a page as a 1-bit greyscale PNG, either thresholding it at mid-grey or,
+// when dithering is enabled, error-diffusing it into black and white.
+void save_bilevel_png(
+    vips::VImage img, const PageTask &task, const std::string &path
+);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "../../include/task.hpp"
+#include "processing.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+#include <vips/vips8>
+
+namespace fs = std::filesystem;
+
+// Every page of a book is processed by its own worker process, so state that
+// depends on the whole book is computed once by whichever worker needs it first
+// and shared with the others through files in the run’s temporary directory.
+fs::path book_state_dir(const PageTask &task);
+// The same for state that’s shared by every book in the run.
+fs::path run_state_dir(const PageTask &task);
+
+// Returns the contents of the book state file `name`, calling `compute` to
+// create it if no worker has done so yet. Concurrent callers wait for the first
+// one to finish instead of repeating the work.
+std::string load_or_compute_book_value(
+    const PageTask &task,
+    const std::string &name,
+    const std::function<std::string()> &compute
+);
+std::string load_or_compute_run_value(
+    const PageTask &task,
+    const std::string &name,
+    const std::function<std::string()> &compute
+);
+
+// Returns the output recorded for an earlier page of the book with the same
+// identity, if there is one.
+std::optional<std::string>
+find_registered_page(const PageTask &task, const std::string &identity);
+
+// Records a page’s identity with its output, so that later pages can find it.
+void register_page(
+    const PageTask &task,
+    const std::string &identity,
+    const std::string &output
+);
+
+// Calls `callback` with a small, cheaply decoded rendition of every page in the
+// book, in archive or document order. Entries that aren’t images are skipped.
+void for_each_book_preview(
+    const PageTask &task,
+    const std::function<void(const vips::VImage &)> &callback
+);
+
+// The content box shared by the portrait pages of the book, scaled to the page
+// whose analysis proxy is `proxy`. Each side is cropped by a margin that most
+// pages have, ignoring pages with content up to every edge. Empty when no page
+// has any content. When another worker has been finding the book’s margins for
+// too long, the page’s own content box is returned instead.
+std::optional<ContentBox>
+book_content_box(const PageTask &task, const vips::VImage &proxy);
+
+// The grey levels shared by every greyscale page of the book, found from the
+// combined histogram of all its pages.
+std::vector<uint8_t> book_grey_palette(const PageTask &task);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "../../include/task.hpp"
+#include "processing.hpp"
+#include <optional>
+#include <string>
+#include <vector>
+#include <vips/vips8>
+
+// Pages can be cached after processing and before encoding, in libvips’ own
+// lossless format, so that a later run that only changes how pages are encoded
+// (their image format, quality or compression effort) can skip straight to
+// encoding. Entries live in `task.cache_dir`, under a key made from the source
+// file and every option that changes a page before it’s encoded. Caching is
+// off when `task.cache_dir` is empty.
+
+// Encodes a page from its cache entry, if it has a complete one. Returns false
+// when it hasn’t, and the page needs processing as usual.
+bool encode_cached_page(const PageTask &task, Logger log);
+
+// Caches one part of a page, as it is just before encoding.
+void cache_page_part(
+    const PageTask &task, const std::string &suffix, const vips::VImage &img
+);
+
+// Completes a page’s cache entry once all of its parts are cached. The page’s
+// identity, from `page_identity`, is kept for finding duplicate pages, which
+// depends on the other pages of the run and so is never cached. It’s empty for
+// pages that aren’t deduplicated.
+void cache_page(
+    const PageTask &task,
+    const std::string &identity,
+    bool stretch_page_contrast,
+    const std::vector<std::string> &suffixes
+);
+
+// Decoded source pages are cached separately, so that runs with different
+// processing options still skip rendering PDF pages and decoding images from
+// archives. Entries are uncompressed libvips images, which are mapped into
+// memory instead of being read, in `task.source_cache_dir`. They’re keyed by a
+// hash of the source file’s contents, so renamed or copied files still hit.
+// At the start of each run that adds to the cache, the entries that were used
+// longest ago are removed until it fits in `task.source_cache_limit_mb`, so it
+// can grow past that by what one run adds. Caching is off when the directory
+// is empty.
+
+// Returns the decoded page from the cache, if it’s there, and marks its entry
+// as just used.
+std::optional<vips::VImage> load_cached_source_page(const PageTask &task);
+
+// Caches a decoded page, trimming the cache to its size limit first if this is
+// the run’s first addition.
+void cache_source_page(const PageTask &task, const vips::VImage &img);
+
+// Finished pages can be cached too, so that re-running a batch after a crash or
+// with a few files added only copies the pages that haven’t changed. Entries in
+// `task.output_cache_dir` are keyed by the page’s bytes in its archive, every
+// option that changes its output and the version of comicpress. Pages of PDFs,
+// and pages that depend on the rest of their book, are keyed by the whole
+// source file instead. Caching is off when the directory is empty.
+
+// The key of a page’s entry in the output cache, or an empty string when the
+// cache is off. `page_data` is the page as stored in its archive, and empty for
+// PDF pages.
+std::string
+output_cache_key(const PageTask &task, const std::vector<char> &page_data);
+
+// Copies a page’s files from its output cache entry, if it has one. Returns
+// false when it hasn’t, and the page needs converting as usual.
+bool restore_cached_output(const PageTask &task, const std::string &key);
+
+// Caches the files that were just saved for a page, as reported by the
+// `@output` status lines of its conversion. Pages saved as a reference to
+// another page depend on the rest of the run, and report no files, so they
+// aren’t cached.
+void cache_output(
+    const PageTask &task,
+    const std::string &key,
+    const std::vector<fs::path> &outputs
+);
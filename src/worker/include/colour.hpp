@@ -0,0 +1,13 @@
+#pragma once
+
+#include "../../include/task.hpp"
+#include <vips/vips8>
+
+// Whether a page is mapped to the colours of a colour e-ink panel.
+bool should_map_colour_eink(const vips::VImage &img, const PageTask &task);
+
+// Maps a page to the colours a colour e-ink panel can show. Colour e-ink is
+// dull, so colours are made more saturated, with their chroma compressed into
+// what the panel can reproduce, and then every channel is rounded to one of
+// the panel’s 16 levels. This replaces palette quantization for colour pages.
+vips::VImage map_colour_eink(const vips::VImage &img, const PageTask &task);
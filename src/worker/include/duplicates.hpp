@@ -0,0 +1,32 @@
+#pragma once
+
+#include "../../include/task.hpp"
+#include <optional>
+#include <string>
+#include <vips/vips8>
+
+// Whether a page has no content at all, judged from its analysis proxy.
+bool is_blank_page(const vips::VImage &proxy);
+
+// What decides whether two pages are duplicates. Blank pages all share one, and
+// other pages are only duplicates when every pixel of the full-resolution page
+// is the same, so that pages that merely look alike are never merged. `image`
+// should already be in memory, since all of it is read.
+std::string page_identity(const vips::VImage &image, bool blank);
+
+// Returns the output of an earlier page of the book with the same identity,
+// relative to the book’s output directory.
+std::optional<std::string>
+find_page_to_reuse(const PageTask &task, const std::string &identity);
+
+// Records a page as the one that later pages with the same identity reuse, once
+// its output has been saved at `output`. With the “Auto” image format, `output`
+// has no extension, since the page’s format isn’t known until it’s saved. Pages
+// whose output is missing, because saving it failed, aren’t recorded.
+void register_page_output(
+    const PageTask &task, const std::string &identity, const std::string &output
+);
+
+// Writes a `.ref` file in place of a page’s output, naming the output of the
+// page to show in its place. `create_epub` and `create_cbz` resolve these.
+void write_page_reference(const PageTask &task, const std::string &target);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "processing.hpp"
+#include <filesystem>
+
+// Lowers the priority of this process as far as it goes, so that it only uses
+// cores that nothing else wants. Threads started afterwards inherit it.
+void lower_process_priority();
+
+// Recompresses the pages of a finished EPUB or CBZ file losslessly, spending
+// more effort than the conversion did: PNG pages with every filter type and
+// the strongest compression, and lossless WebP pages at the highest effort.
+// Pages are only replaced when they got smaller, and the archive is only
+// rewritten when one did.
+void optimize_archive(const std::filesystem::path &path, Logger log);
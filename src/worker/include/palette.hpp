@@ -0,0 +1,29 @@
+#pragma once
+
+#include "../../include/task.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <vips/vips8>
+
+// Whether a page is remapped to the palette shared by its whole book, rather
+// than getting a palette of its own.
+bool should_use_book_palette(const vips::VImage &img, const PageTask &task);
+
+// The `count` grey levels that best represent a histogram of 256 grey levels,
+// in the sense of least squared error (a Lloyd–Max quantizer). Sorted, with
+// duplicates removed.
+std::vector<uint8_t>
+optimal_grey_levels(const std::vector<double> &histogram, int count);
+
+// Maps every pixel of a greyscale page to the nearest of `levels`, diffusing
+// the error to neighbouring pixels by the `dither` amount.
+vips::VImage remap_to_palette(
+    vips::VImage img, const std::vector<uint8_t> &levels, double dither
+);
+
+// Saves a greyscale page that has no more distinct values than its bit depth
+// allows as an indexed PNG, without searching for a palette.
+void save_indexed_grey_png(
+    const vips::VImage &img, const PageTask &task, const std::string &path
+);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "../../include/task.hpp"
+#include "processing.hpp"
+#include <string>
+#include <vector>
+
+// The image format of an encoded image, named as in `PageTask::image_format`,
+// judged from its signature. Empty if it isn’t one that pages are saved in.
+std::string encoded_image_format(const std::vector<char> &data);
+
+// Whether an archive page can be saved without decoding its pixels, because
+// processing it wouldn’t change it: it’s already in the requested format, no
+// larger than the display, greyscale or quantized if that was asked for, and
+// no other option applies. JPEG pages can also be saved as JPEG XL when built
+// with libjxl. Only reads the image header.
+bool can_pass_through(const std::vector<char> &data, const PageTask &task);
+
+// Saves a page accepted by `can_pass_through`. Pages already in the requested
+// format are copied as they are. JPEG pages saved as JPEG XL are recompressed
+// losslessly from the JPEG’s coefficients, so the original JPEG can be rebuilt
+// from them bit for bit. The file is reported as an `@output` status line.
+void pass_through_page(
+    const std::vector<char> &data, const PageTask &task, Logger log
+);
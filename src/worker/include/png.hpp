@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Packs 8-bit grey pixels into rows of indices for `encode_grey_png`, leftmost
+// pixel in the highest bits, and returns the grey level of each index in
+// `palette`. The palette is whichever levels the pixels use. Throws when they
+// use more than `bit_depth` allows.
+std::vector<uint8_t> pack_grey_indices(
+    const uint8_t *pixels,
+    int width,
+    int height,
+    int bit_depth,
+    std::vector<uint8_t> &palette
+);
+
+// Encodes a greyscale PNG from `rows`, which are already packed to `bit_depth`
+// bits per pixel, each after a spare byte for its filter type. When `palette`
+// isn’t empty, the pixels are indices into it instead, and it lists the grey
+// level of each index. `compression` runs from 0 to 9, as for `pngsave`.
+std::vector<uint8_t> encode_grey_png(
+    int width,
+    int height,
+    int bit_depth,
+    const std::vector<uint8_t> &palette,
+    std::vector<uint8_t> rows,
+    int compression
+);
+
+// The same, written to `path`.
+void write_grey_png(
+    const std::string &path,
+    int width,
+    int height,
+    int bit_depth,
+    const std::vector<uint8_t> &palette,
+    std::vector<uint8_t> rows,
+    int compression
+);
+
+// Recompresses a PNG losslessly, trying every filter type and the strongest
+// compression. Returns `png` itself when that doesn’t make it smaller, or when
+// it is interlaced or can’t be read.
+std::vector<uint8_t> optimize_png(const std::vector<uint8_t> &png);
@@ -2,19 +2,102 @@
 
 #include "../../include/task.hpp"
 #include <functional>
+#include <optional>
 #include <string>
+#include <vector>
 #include <vips/vips8>
 
 using Logger = const std::function<void(const std::string &)> &;
 
 struct LoadPageReturn {
     vips::VImage image;
+    // A downsampled copy of `image`. The page analysis (greyscale detection,
+    // margin cropping and spine detection) runs on this instead of the full
+    // page, which can be a 1200 PPI render.
+    vips::VImage proxy;
     bool stretch_page_contrast;
 };
 
+// The part of a page left after cropping its margins.
+struct ContentBox {
+    int left;
+    int top;
+    int width;
+    int height;
+};
+
 #if defined(PDF_ENABLED)
 LoadPageReturn load_pdf_page(const PageTask &task);
+vips::VImage
+render_pdf_page_preview(FPDF_PAGE page, int page_number, double ppi);
 #endif
-LoadPageReturn load_archive_image(const PageTask &task);
+std::vector<char> read_archive_entry(const PageTask &task);
+LoadPageReturn
+load_archive_image(const std::vector<char> &data, const PageTask &task);
+
+// Makes the colour decisions that depend on the source image, for an image
+// that has already been decoded.
+LoadPageReturn prepare_loaded_image(vips::VImage img, const PageTask &task);
+
+// The task of each device that a page is converted for: the task itself, then
+// one for each of its extra targets.
+std::vector<PageTask> target_tasks(const PageTask &task);
+
+// A task that loads a page well enough for all of `tasks`: in colour if any of
+// them keeps colour, and in shades of grey unless all of them are 1-bit.
+PageTask loading_task(const std::vector<PageTask> &tasks);
+
+// A page loaded for `load_task`, prepared for `task` instead. The decoded page
+// is shared; only the analysis proxy and the contrast decision can differ.
+LoadPageReturn retarget_loaded_page(
+    const LoadPageReturn &page_info,
+    const PageTask &load_task,
+    const PageTask &task
+);
+
+std::optional<ContentBox> find_content_box(const vips::VImage &img);
+
+// Whether a page fits the display better turned on its side, as two-page
+// spreads do.
+bool should_image_rotate(
+    double image_width,
+    double image_height,
+    double display_width,
+    double display_height
+);
+std::vector<double> image_to_doubles(const vips::VImage &img);
+
+// Stretches a page’s tones to cover the full range from black to white.
+vips::VImage stretch_image_contrast(vips::VImage img);
 
 void process_vimage(LoadPageReturn page_info, PageTask task, Logger log);
+
+// Quantizes, stretches and saves a page that is already at its final size, in
+// the task’s image format, to `base_path` plus the format’s extension.
+void encode_page(
+    vips::VImage img,
+    bool stretch_page_contrast,
+    const PageTask &task,
+    const std::string &base_path,
+    Logger log
+);
+
+// Encodes a page with `encode_page`, or in the format that suits it for the
+// “Auto” image format, and reports the encode time to the GUI. The file that
+// it saved is reported as an `@output` status line.
+void encode_and_report(
+    const vips::VImage &img,
+    bool stretch_page_contrast,
+    const PageTask &task,
+    const std::string &base_path,
+    Logger log
+);
+
+// The file extension of pages saved with the task’s image format. Empty for
+// “Auto”, since each page then gets the extension of its own format.
+std::string output_extension(const PageTask &task);
+
+// Encoder options for the task’s AVIF, JPEG, JPEG XL or WebP settings. A
+// VOption is consumed by the operation it’s passed to, so each save needs its
+// own.
+vips::VOption *save_options(const PageTask &task);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "../../include/task.hpp"
+#include "processing.hpp"
+#include <vector>
+
+// Whether an encoded image is a long strip (as in webtoons) that should be cut
+// into several pages rather than shrunk to fit on one screen. Only reads the
+// image header.
+bool is_long_strip(const std::vector<char> &data, const PageTask &task);
+
+// Cuts a long strip into pages with the display’s aspect ratio, preferring to
+// cut through the gutters between panels, and processes each page as soon as
+// it’s cut. The strip is decoded top to bottom a slice at a time, so memory use
+// doesn’t grow with the length of the strip.
+void slice_long_strip(
+    const std::vector<char> &data, const PageTask &task, Logger log
+);
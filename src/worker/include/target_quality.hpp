@@ -0,0 +1,24 @@
+#pragma once
+
+#include "../../include/task.hpp"
+#include "processing.hpp"
+#include <string>
+#include <vips/vips8>
+
+// Whether the page’s lossy quality setting is searched for, to reach
+// `task.target_quality`, instead of being taken from `task.quality`.
+bool has_quality_target(const PageTask &task);
+
+// Returns `task` with the lowest quality setting (the highest distance, for
+// JPEG XL) at which a downscaled probe of the page still reaches the target
+// SSIM. Colour pages are scored on chroma as well as lightness, so that chroma
+// can’t be lost without lowering the score. The setting is found by binary
+// search over trial encodes of the probe, and logged as an `@info` status line
+// prefixed with `name`, with the probe’s score at that setting. When no
+// setting reaches the target, the best one is returned, and the log says so.
+PageTask with_target_quality(
+    const vips::VImage &img,
+    const PageTask &task,
+    const std::string &name,
+    Logger log
+);
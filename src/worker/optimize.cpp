@@ -0,0 +1,250 @@
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "include/optimize.hpp"
+#include "include/png.hpp"
+
+namespace fs = std::filesystem;
+
+// The highest effort of `webpsave`.
+const auto WEBP_MAX_EFFORT = 6;
+
+struct ArchiveEntry {
+    std::string name;
+    std::vector<uint8_t> data;
+};
+
+static std::vector<ArchiveEntry> read_archive(const fs::path &path);
+static void
+write_archive(const fs::path &path, const std::vector<ArchiveEntry> &entries);
+static std::vector<uint8_t> optimize_image(const std::vector<uint8_t> &data);
+static std::vector<uint8_t>
+optimize_lossless_webp(const std::vector<uint8_t> &data);
+static bool is_image_entry(const std::string &name);
+
+void lower_process_priority() {
+#if defined(_WIN32)
+    SetPriorityClass(GetCurrentProcess(), IDLE_PRIORITY_CLASS);
+#else
+    setpriority(PRIO_PROCESS, 0, 19);
+#endif
+}
+
+void optimize_archive(const fs::path &path, Logger log) {
+    auto entries = read_archive(path);
+
+    auto images = 0;
+    auto smaller_images = 0;
+    uintmax_t saved = 0;
+    for (auto &entry : entries) {
+        if (!is_image_entry(entry.name)) {
+            continue;
+        }
+        images += 1;
+        auto optimized = optimize_image(entry.data);
+        if (optimized.size() < entry.data.size()) {
+            saved += entry.data.size() - optimized.size();
+            smaller_images += 1;
+            entry.data = std::move(optimized);
+        }
+    }
+
+    auto name = path.filename().string();
+    if (smaller_images == 0) {
+        log("Optimized " + name + ": no page got smaller");
+        return;
+    }
+
+    // Written next to the original and renamed over it, so that the archive is
+    // never left half written.
+    auto temp_path = path;
+    temp_path += ".optimizing";
+    try {
+        write_archive(temp_path, entries);
+        fs::rename(temp_path, path);
+    }
+    catch (...) {
+        auto ec = std::error_code();
+        fs::remove(temp_path, ec);
+        throw;
+    }
+    log("Optimized " + name + ": " + std::to_string(smaller_images) + " of "
+        + std::to_string(images) + " pages smaller, "
+        + std::to_string(saved) + " bytes saved");
+}
+
+std::vector<ArchiveEntry> read_archive(const fs::path &path) {
+    auto archive = archive_read_new();
+    archive_read_support_filter_all(archive);
+    archive_read_support_format_all(archive);
+
+    if (archive_read_open_filename(archive, path.string().c_str(), 10240)
+        != ARCHIVE_OK) {
+        std::string err = archive_error_string(archive);
+        archive_read_free(archive);
+        throw std::runtime_error("LibArchive: Could not open file: " + err);
+    }
+
+    // Anything short of reaching the end is an error, since writing back only
+    // the entries read so far would lose the rest of the archive.
+    auto entries = std::vector<ArchiveEntry>();
+    struct archive_entry *entry;
+    for (;;) {
+        auto status = archive_read_next_header(archive, &entry);
+        if (status == ARCHIVE_EOF) {
+            break;
+        }
+        if (status != ARCHIVE_OK) {
+            const auto *error = archive_error_string(archive);
+            auto message = std::string(error ? error : "unknown error");
+            archive_read_close(archive);
+            archive_read_free(archive);
+            throw std::runtime_error(
+                "LibArchive: Could not read " + path.filename().string() + ": "
+                + message
+            );
+        }
+        if (archive_entry_filetype(entry) != AE_IFREG) {
+            continue;
+        }
+        auto archive_entry = ArchiveEntry{
+            .name = archive_entry_pathname(entry),
+            .data = {},
+        };
+        char buffer[8192];
+        for (;;) {
+            auto bytes_read
+                = archive_read_data(archive, buffer, sizeof(buffer));
+            if (bytes_read < 0) {
+                std::string err = archive_error_string(archive);
+                archive_read_close(archive);
+                archive_read_free(archive);
+                throw std::runtime_error(
+                    "LibArchive: Read error for '" + archive_entry.name
+                    + "': " + err
+                );
+            }
+            if (bytes_read == 0) {
+                break;
+            }
+            archive_entry.data.insert(
+                archive_entry.data.end(), buffer, buffer + bytes_read
+            );
+        }
+        entries.push_back(std::move(archive_entry));
+    }
+
+    archive_read_close(archive);
+    archive_read_free(archive);
+    return entries;
+}
+
+// Entries keep their order. As when the archive was created, the EPUB
+// `mimetype` file and the images are stored and everything else is deflated.
+void write_archive(
+    const fs::path &path, const std::vector<ArchiveEntry> &entries
+) {
+    auto archive = archive_write_new();
+    archive_write_set_format_zip(archive);
+
+    if (archive_write_open_filename(archive, path.string().c_str())
+        != ARCHIVE_OK) {
+        const auto *error = archive_error_string(archive);
+        auto message = std::string(error ? error : "");
+        archive_write_free(archive);
+        throw std::runtime_error(message);
+    }
+
+    for (const auto &entry : entries) {
+        if (entry.name == "mimetype" || is_image_entry(entry.name)) {
+            archive_write_zip_set_compression_store(archive);
+        }
+        else {
+            archive_write_zip_set_compression_deflate(archive);
+        }
+
+        auto header = archive_entry_new();
+        archive_entry_set_pathname(header, entry.name.c_str());
+        archive_entry_set_size(header, static_cast<int64_t>(entry.data.size()));
+        archive_entry_set_filetype(header, AE_IFREG);
+        archive_entry_set_perm(header, 0644);
+        auto written = archive_write_header(archive, header) == ARCHIVE_OK
+                    && archive_write_data(
+                           archive, entry.data.data(), entry.data.size()
+                       ) == static_cast<la_ssize_t>(entry.data.size());
+        archive_entry_free(header);
+        if (!written) {
+            const auto *error = archive_error_string(archive);
+            auto message = std::string(error ? error : "");
+            archive_write_free(archive);
+            throw std::runtime_error(
+                "LibArchive: Write error for '" + entry.name + "': " + message
+            );
+        }
+    }
+
+    if (archive_write_close(archive) != ARCHIVE_OK) {
+        const auto *error = archive_error_string(archive);
+        auto message = std::string(error ? error : "");
+        archive_write_free(archive);
+        throw std::runtime_error(message);
+    }
+    archive_write_free(archive);
+}
+
+// Returns `data` itself for images that can’t be recompressed losslessly.
+// Lossy WebP, JPEG and the rest would lose quality with every encode.
+std::vector<uint8_t> optimize_image(const std::vector<uint8_t> &data) {
+    auto starts_with = [&](size_t offset, const char *signature) {
+        auto length = std::strlen(signature);
+        return data.size() >= offset + length
+            && std::memcmp(data.data() + offset, signature, length) == 0;
+    };
+
+    if (starts_with(0, "\x89PNG\r\n\x1A\n")) {
+        return optimize_png(data);
+    }
+    if (starts_with(0, "RIFF") && starts_with(8, "WEBP")
+        && starts_with(12, "VP8L")) {
+        return optimize_lossless_webp(data);
+    }
+    return data;
+}
+
+std::vector<uint8_t> optimize_lossless_webp(const std::vector<uint8_t> &data) {
+    auto img = vips::VImage::new_from_buffer(data.data(), data.size(), "");
+    auto blob = img.webpsave_buffer(
+        vips::VImage::option()
+            ->set("lossless", true)
+            ->set("exact", true)
+            ->set("effort", WEBP_MAX_EFFORT)
+    );
+    size_t size = 0;
+    const auto *bytes
+        = static_cast<const uint8_t *>(vips_blob_get(blob, &size));
+    auto optimized = std::vector<uint8_t>(bytes, bytes + size);
+    vips_area_unref(VIPS_AREA(blob));
+    return optimized.size() < data.size() ? optimized : data;
+}
+
+bool is_image_entry(const std::string &name) {
+    auto extension = fs::path(name).extension().string();
+    for (auto &c : extension) {
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<char>(c - 'A' + 'a');
+        }
+    }
+    return extension == ".png" || extension == ".jpg" || extension == ".jpeg"
+        || extension == ".webp" || extension == ".avif" || extension == ".jxl";
+}
@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../include/task.hpp"
+#include "include/palette.hpp"
+#include "include/png.hpp"
+
+// The Lloyd–Max iteration stops when no level moves by more than this, or
+// after this many rounds.
+const auto LEVEL_TOLERANCE = 0.01;
+const auto MAX_LEVEL_ITERATIONS = 100;
+
+bool should_use_book_palette(const vips::VImage &img, const PageTask &task) {
+    // Indexed PNGs hold at most 256 colours.
+    return task.quantize_pages && task.share_book_palette
+        && task.bit_depth <= 8 && img.bands() == 1;
+}
+
+std::vector<uint8_t>
+optimal_grey_levels(const std::vector<double> &histogram, int count) {
+    auto total = 0.0;
+    for (auto weight : histogram) {
+        total += weight;
+    }
+
+    // Start from the quantiles of the histogram, which is already close for
+    // the mostly black and white pages of comics, then alternate between
+    // putting each boundary halfway between two levels and moving each level
+    // to the mean of the values between its boundaries.
+    auto levels = std::vector<double>(count);
+    auto cumulative = 0.0;
+    auto level = 0;
+    for (auto value = 0; value < 256 && level < count; value += 1) {
+        cumulative += histogram[value];
+        while (level < count && cumulative >= total * (level + 0.5) / count) {
+            levels[level] = value;
+            level += 1;
+        }
+    }
+    if (total == 0) {
+        for (auto i = 0; i < count; i += 1) {
+            levels[i] = count > 1 ? 255.0 * i / (count - 1) : 0.0;
+        }
+    }
+
+    for (auto iteration = 0; iteration < MAX_LEVEL_ITERATIONS; iteration += 1) {
+        auto largest_move = 0.0;
+        auto value = 0;
+        for (auto i = 0; i < count; i += 1) {
+            auto upper
+                = i + 1 < count ? (levels[i] + levels[i + 1]) / 2.0 : 256.0;
+            auto weight = 0.0;
+            auto sum = 0.0;
+            for (; value < 256 && value < upper; value += 1) {
+                weight += histogram[value];
+                sum += histogram[value] * value;
+            }
+            // An empty cell keeps its level.
+            if (weight > 0) {
+                auto mean = sum / weight;
+                largest_move
+                    = std::max(largest_move, std::abs(mean - levels[i]));
+                levels[i] = mean;
+            }
+        }
+        if (largest_move < LEVEL_TOLERANCE) {
+            break;
+        }
+    }
+
+    auto rounded = std::vector<uint8_t>();
+    for (auto value : levels) {
+        rounded.push_back(
+            static_cast<uint8_t>(std::clamp(std::lround(value), 0L, 255L))
+        );
+    }
+    std::sort(rounded.begin(), rounded.end());
+    rounded.erase(std::unique(rounded.begin(), rounded.end()), rounded.end());
+    return rounded;
+}
+
+vips::VImage remap_to_palette(
+    vips::VImage img, const std::vector<uint8_t> &levels, double dither
+) {
+    img = img.colourspace(VIPS_INTERPRETATION_B_W).cast(VIPS_FORMAT_UCHAR);
+
+    // The nearest level to every grey value, so that the remapping itself is a
+    // table lookup.
+    auto nearest = std::array<uint8_t, 256>();
+    for (auto value = 0; value < 256; value += 1) {
+        nearest[value] = *std::min_element(
+            levels.begin(), levels.end(), [&](uint8_t a, uint8_t b) {
+                return std::abs(a - value) < std::abs(b - value);
+            }
+        );
+    }
+
+    auto width = img.width();
+    auto height = img.height();
+    size_t size = 0;
+    auto pixels = static_cast<uint8_t *>(img.write_to_memory(&size));
+
+    if (dither <= 0) {
+        for (size_t i = 0; i < size; i += 1) {
+            pixels[i] = nearest[pixels[i]];
+        }
+    }
+    else {
+        // Floyd–Steinberg error diffusion. The error rows have a slot of
+        // padding on each side so that the edges need no special cases.
+        auto strength = static_cast<float>(dither);
+        auto error = std::vector<float>(width + 2, 0.0f);
+        auto next_error = std::vector<float>(width + 2, 0.0f);
+        for (auto y = 0; y < height; y += 1) {
+            auto row = pixels + static_cast<size_t>(y) * width;
+            std::fill(next_error.begin(), next_error.end(), 0.0f);
+            for (auto x = 0; x < width; x += 1) {
+                auto value = std::clamp(row[x] + error[x + 1], 0.0f, 255.0f);
+                row[x] = nearest[static_cast<int>(value + 0.5f)];
+                auto diffused = (value - row[x]) * strength;
+                error[x + 2] += diffused * 7.0f / 16.0f;
+                next_error[x] += diffused * 3.0f / 16.0f;
+                next_error[x + 1] += diffused * 5.0f / 16.0f;
+                next_error[x + 2] += diffused * 1.0f / 16.0f;
+            }
+            std::swap(error, next_error);
+        }
+    }
+
+    return vips::VImage::new_from_memory_steal(
+        pixels, size, width, height, 1, VIPS_FORMAT_UCHAR
+    );
+}
+
+void save_indexed_grey_png(
+    const vips::VImage &img, const PageTask &task, const std::string &path
+) {
+    auto grey = img.cast(VIPS_FORMAT_UCHAR);
+    auto width = grey.width();
+    auto height = grey.height();
+    size_t size = 0;
+    auto pixels = static_cast<uint8_t *>(grey.write_to_memory(&size));
+
+    // The palette is whatever values the page ended up with, which are the
+    // book’s levels.
+    auto palette = std::vector<uint8_t>();
+    auto rows = std::vector<uint8_t>();
+    try {
+        rows = pack_grey_indices(
+            pixels, width, height, task.bit_depth, palette
+        );
+    }
+    catch (...) {
+        g_free(pixels);
+        throw;
+    }
+    g_free(pixels);
+
+    write_grey_png(
+        path,
+        width,
+        height,
+        task.bit_depth,
+        palette,
+        std::move(rows),
+        task.compression_effort
+    );
+}
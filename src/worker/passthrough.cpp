@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#if defined(JXL_ENABLED)
+#include <jxl/encode.h>
+#endif
+
+#include "../include/task.hpp"
+#include "include/passthrough.hpp"
+#include "include/processing.hpp"
+
+#if defined(JXL_ENABLED)
+static std::vector<uint8_t>
+recompress_jpeg_to_jxl(const std::vector<char> &data, const PageTask &task);
+#endif
+// Whether a page’s pixels already hold no more levels than quantization to
+// the task’s bit depth would leave.
+static bool is_quantized(const vips::VImage &img, const PageTask &task);
+
+std::string encoded_image_format(const std::vector<char> &data) {
+    auto starts_with = [&](size_t offset, const char *signature) {
+        auto length = std::strlen(signature);
+        return data.size() >= offset + length
+            && std::memcmp(data.data() + offset, signature, length) == 0;
+    };
+
+    if (starts_with(0, "\xFF\xD8\xFF")) {
+        return "JPEG";
+    }
+    if (starts_with(0, "\x89PNG\r\n\x1A\n")) {
+        return "PNG";
+    }
+    if (starts_with(0, "RIFF") && starts_with(8, "WEBP")) {
+        return "WebP";
+    }
+    if (starts_with(0, "\xFF\x0A") || starts_with(4, "JXL ")) {
+        return "JPEG XL";
+    }
+    if (starts_with(4, "ftypavif") || starts_with(4, "ftypavis")) {
+        return "AVIF";
+    }
+    return "";
+}
+
+bool can_pass_through(const std::vector<char> &data, const PageTask &task) {
+    auto source_format = encoded_image_format(data);
+    const auto &auto_formats = task.auto_image_formats;
+    auto is_auto_format
+        = task.image_format == "Auto"
+       && std::find(auto_formats.begin(), auto_formats.end(), source_format)
+              != auto_formats.end();
+    auto format_allowed
+        = !source_format.empty()
+       && (source_format == task.image_format || is_auto_format);
+#if defined(JXL_ENABLED)
+    auto is_jpeg_to_jxl
+        = source_format == "JPEG" && task.image_format == "JPEG XL";
+    format_allowed = format_allowed || is_jpeg_to_jxl;
+#endif
+    // Every one of these options reads or changes the page’s pixels.
+    if (!format_allowed || task.crop_margins || task.remove_spine
+        || task.deduplicate_pages || task.stretch_page_contrast) {
+        return false;
+    }
+
+    // Loading from a buffer only reads the header until pixels are requested.
+    auto img = vips::VImage::new_from_buffer(data.data(), data.size(), "");
+    auto interpretation = img.interpretation();
+    if (img.format() != VIPS_FORMAT_UCHAR
+        || (interpretation != VIPS_INTERPRETATION_sRGB
+            && interpretation != VIPS_INTERPRETATION_B_W)) {
+        return false;
+    }
+
+    auto colour = img.bands() >= 3;
+    if (colour && (task.convert_pages_to_greyscale || task.map_colour_eink)) {
+        return false;
+    }
+    // Only PNG records its bit depth. The other formats are lossy, so their
+    // pixels don’t keep a palette’s exact levels.
+    if (task.quantize_pages
+        && (source_format != "PNG" || !is_quantized(img, task))) {
+        return false;
+    }
+
+    // Pages that fit the display are left at their size rather than scaled
+    // up, which would only add pixels for the reader to scale down again.
+    auto fits = img.width() <= task.page_width
+             && img.height() <= task.page_height;
+    if (task.scale_pages && !fits) {
+        return false;
+    }
+
+    auto is_spread = task.double_page_spread_action != NONE
+                  && should_image_rotate(
+                         img.width(),
+                         img.height(),
+                         task.page_width,
+                         task.page_height
+                  );
+    return !is_spread;
+}
+
+void pass_through_page(
+    const std::vector<char> &data, const PageTask &task, Logger log
+) {
+    auto base_path = task.output_dir / task.output_base_name;
+    fs::create_directories(base_path.parent_path());
+
+    // With the “Auto” image format, the page keeps the format it’s in.
+    auto source_format = encoded_image_format(data);
+    auto saved_as = task;
+    if (task.image_format == "Auto") {
+        saved_as.image_format = source_format;
+    }
+    auto output_path = base_path.string() + output_extension(saved_as);
+
+    // The page is recompressed in memory first, so that a failure never
+    // leaves an empty or partial file to be packaged.
+    auto bytes = std::string_view(data.data(), data.size());
+#if defined(JXL_ENABLED)
+    auto jxl = std::vector<uint8_t>();
+    if (source_format != saved_as.image_format) {
+        jxl = recompress_jpeg_to_jxl(data, task);
+        bytes = std::string_view(
+            reinterpret_cast<const char *>(jxl.data()), jxl.size()
+        );
+    }
+#endif
+
+    auto stream = std::ofstream(output_path, std::ios::binary);
+    stream.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    stream.close();
+    if (!stream) {
+        auto ec = std::error_code();
+        fs::remove(output_path, ec);
+        log("  -> Error writing " + fs::path(output_path).filename().string());
+        return;
+    }
+    log("@output " + output_path);
+}
+
+bool is_quantized(const vips::VImage &img, const PageTask &task) {
+    auto bits = 8;
+    if (img.get_typeof("palette-bit-depth") != 0) {
+        bits = img.get_int("palette-bit-depth");
+    }
+    else if (img.get_typeof("bits-per-sample") != 0) {
+        bits = img.get_int("bits-per-sample");
+    }
+    auto is_palette = img.get_typeof("palette-bit-depth") != 0
+                   || (img.get_typeof("palette") != 0
+                       && img.get_int("palette") != 0);
+    auto is_grey = img.bands() == 1;
+    return (is_palette || is_grey) && bits <= task.bit_depth;
+}
+
+#if defined(JXL_ENABLED)
+std::vector<uint8_t>
+recompress_jpeg_to_jxl(const std::vector<char> &data, const PageTask &task) {
+    auto encoder = JxlEncoderCreate(nullptr);
+    if (encoder == nullptr) {
+        throw std::runtime_error("libjxl: Cannot create encoder");
+    }
+
+    auto output = std::vector<uint8_t>(64 * 1024);
+    try {
+        // The reconstruction data is what lets the JPEG be rebuilt exactly.
+        auto settings = JxlEncoderFrameSettingsCreate(encoder, nullptr);
+        if (JxlEncoderStoreJPEGMetadata(encoder, JXL_TRUE) != JXL_ENC_SUCCESS
+            || JxlEncoderFrameSettingsSetOption(
+                   settings,
+                   JXL_ENC_FRAME_SETTING_EFFORT,
+                   task.compression_effort
+               ) != JXL_ENC_SUCCESS
+            || JxlEncoderAddJPEGFrame(
+                   settings,
+                   reinterpret_cast<const uint8_t *>(data.data()),
+                   data.size()
+               ) != JXL_ENC_SUCCESS) {
+            throw std::runtime_error("libjxl: Cannot recompress JPEG");
+        }
+        JxlEncoderCloseInput(encoder);
+
+        auto next_out = output.data();
+        auto avail_out = output.size();
+        auto status = JxlEncoderProcessOutput(encoder, &next_out, &avail_out);
+        while (status == JXL_ENC_NEED_MORE_OUTPUT) {
+            auto offset = static_cast<size_t>(next_out - output.data());
+            output.resize(output.size() * 2);
+            next_out = output.data() + offset;
+            avail_out = output.size() - offset;
+            status = JxlEncoderProcessOutput(encoder, &next_out, &avail_out);
+        }
+        if (status != JXL_ENC_SUCCESS) {
+            throw std::runtime_error("libjxl: Cannot recompress JPEG");
+        }
+        output.resize(static_cast<size_t>(next_out - output.data()));
+    }
+    catch (...) {
+        JxlEncoderDestroy(encoder);
+        throw;
+    }
+
+    JxlEncoderDestroy(encoder);
+    return output;
+}
+#endif
@@ -0,0 +1,453 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+
+#if defined(DEFLATE_ENABLED)
+#include <libdeflate.h>
+#endif
+
+#include "include/png.hpp"
+
+// PNG’s filter types.
+const uint8_t FILTER_NONE = 0;
+const uint8_t FILTER_SUB = 1;
+const uint8_t FILTER_UP = 2;
+const uint8_t FILTER_AVERAGE = 3;
+const uint8_t FILTER_PAETH = 4;
+
+static void filter_rows(
+    std::vector<uint8_t> &rows,
+    int height,
+    size_t pixel_bytes,
+    std::optional<uint8_t> filter
+);
+static void
+unfilter_rows(std::vector<uint8_t> &rows, int height, size_t pixel_bytes);
+static int paeth_predictor(int left, int up, int up_left);
+static std::vector<uint8_t>
+compress_rows(const std::vector<uint8_t> &rows, int compression);
+static void append_png_chunk(
+    std::vector<uint8_t> &png,
+    const char *type,
+    const uint8_t *data,
+    size_t size
+);
+
+std::vector<uint8_t> pack_grey_indices(
+    const uint8_t *pixels,
+    int width,
+    int height,
+    int bit_depth,
+    std::vector<uint8_t> &palette
+) {
+    auto size = static_cast<size_t>(width) * height;
+    auto used = std::array<bool, 256>();
+    for (size_t i = 0; i < size; i += 1) {
+        used[pixels[i]] = true;
+    }
+    palette.clear();
+    auto indices = std::array<uint8_t, 256>();
+    for (auto value = 0; value < 256; value += 1) {
+        if (used[value]) {
+            indices[value] = static_cast<uint8_t>(palette.size());
+            palette.push_back(static_cast<uint8_t>(value));
+        }
+    }
+    if (palette.size() > (1u << bit_depth)) {
+        throw std::runtime_error(
+            "Page has more grey levels than its bit depth allows"
+        );
+    }
+
+    // Each row comes after a spare byte for its filter type, which
+    // `encode_grey_png` chooses.
+    auto stride = (static_cast<size_t>(width) * bit_depth + 7) / 8 + 1;
+    auto rows = std::vector<uint8_t>(stride * height, 0);
+    for (auto y = 0; y < height; y += 1) {
+        auto row = pixels + static_cast<size_t>(y) * width;
+        auto out = rows.data() + y * stride + 1;
+        for (auto x = 0; x < width; x += 1) {
+            auto bit = static_cast<size_t>(x) * bit_depth;
+            out[bit / 8] |= static_cast<uint8_t>(
+                indices[row[x]] << (8 - bit_depth - bit % 8)
+            );
+        }
+    }
+    return rows;
+}
+
+std::vector<uint8_t> encode_grey_png(
+    int width,
+    int height,
+    int bit_depth,
+    const std::vector<uint8_t> &palette,
+    std::vector<uint8_t> rows,
+    int compression
+) {
+    // Below 8 bits, several pixels share a byte, so the filters predict from
+    // unrelated pixels and only make the data harder to compress. This is
+    // also what libpng does.
+    filter_rows(
+        rows,
+        height,
+        1,
+        bit_depth < 8 ? std::optional(FILTER_NONE) : std::nullopt
+    );
+    auto compressed = compress_rows(rows, compression);
+
+    auto png = std::vector<uint8_t>{137, 80, 78, 71, 13, 10, 26, 10};
+
+    // Width and height, then the bit depth, colour type 3 (indexed) or 0
+    // (greyscale) and the default compression, filter and interlace methods.
+    uint8_t header[13] = {};
+    for (auto i = 0; i < 4; i += 1) {
+        header[i] = static_cast<uint8_t>(width >> (24 - 8 * i));
+        header[4 + i] = static_cast<uint8_t>(height >> (24 - 8 * i));
+    }
+    header[8] = static_cast<uint8_t>(bit_depth);
+    header[9] = palette.empty() ? 0 : 3;
+    append_png_chunk(png, "IHDR", header, sizeof(header));
+
+    if (!palette.empty()) {
+        auto entries = std::vector<uint8_t>();
+        for (auto level : palette) {
+            entries.insert(entries.end(), {level, level, level});
+        }
+        append_png_chunk(png, "PLTE", entries.data(), entries.size());
+    }
+    append_png_chunk(png, "IDAT", compressed.data(), compressed.size());
+    append_png_chunk(png, "IEND", nullptr, 0);
+    return png;
+}
+
+void write_grey_png(
+    const std::string &path,
+    int width,
+    int height,
+    int bit_depth,
+    const std::vector<uint8_t> &palette,
+    std::vector<uint8_t> rows,
+    int compression
+) {
+    auto png = encode_grey_png(
+        width, height, bit_depth, palette, std::move(rows), compression
+    );
+
+    auto file = std::ofstream(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Could not open '" + path + "' for writing");
+    }
+    file.write(
+        reinterpret_cast<const char *>(png.data()),
+        static_cast<std::streamsize>(png.size())
+    );
+    if (!file) {
+        throw std::runtime_error("Could not write '" + path + "'");
+    }
+}
+
+std::vector<uint8_t> optimize_png(const std::vector<uint8_t> &png) {
+    const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    if (png.size() < 8 || !std::equal(signature, signature + 8, png.begin())) {
+        return png;
+    }
+
+    // Split the file into its chunks, with the image data joined together.
+    struct Chunk {
+        std::string type;
+        std::vector<uint8_t> data;
+    };
+    auto chunks = std::vector<Chunk>();
+    auto image_data = std::vector<uint8_t>();
+    auto image_data_index = std::optional<size_t>();
+    for (size_t offset = 8; offset + 12 <= png.size();) {
+        size_t size = 0;
+        for (auto i = 0; i < 4; i += 1) {
+            size = size << 8 | png[offset + i];
+        }
+        if (size > png.size() - offset - 12) {
+            return png;
+        }
+        auto type = std::string(
+            reinterpret_cast<const char *>(png.data() + offset + 4), 4
+        );
+        auto data = png.begin() + static_cast<std::ptrdiff_t>(offset + 8);
+        if (type == "IDAT") {
+            if (!image_data_index) {
+                image_data_index = chunks.size();
+                chunks.push_back({type, {}});
+            }
+            image_data.insert(
+                image_data.end(), data, data + static_cast<std::ptrdiff_t>(size)
+            );
+        }
+        else {
+            chunks.push_back(
+                {type,
+                 std::vector<uint8_t>(
+                     data, data + static_cast<std::ptrdiff_t>(size)
+                 )}
+            );
+        }
+        offset += size + 12;
+    }
+    if (chunks.empty() || chunks[0].type != "IHDR"
+        || chunks[0].data.size() != 13 || !image_data_index) {
+        return png;
+    }
+
+    // Interlaced images are left alone, since their rows are split into
+    // passes.
+    const auto &header = chunks[0].data;
+    size_t width = 0;
+    auto height = 0;
+    for (auto i = 0; i < 4; i += 1) {
+        width = width << 8 | header[i];
+        height = height << 8 | header[4 + i];
+    }
+    auto bit_depth = header[8];
+    auto colour_type = header[9];
+    auto interlaced = header[12] != 0;
+    auto channels = colour_type == 0   ? 1
+                  : colour_type == 2 ? 3
+                  : colour_type == 3 ? 1
+                  : colour_type == 4 ? 2
+                  : colour_type == 6 ? 4
+                                     : 0;
+    if (interlaced || channels == 0 || width == 0 || height <= 0) {
+        return png;
+    }
+    auto pixel_bytes = std::max<size_t>(1, channels * bit_depth / 8);
+    auto stride = (width * channels * bit_depth + 7) / 8 + 1;
+
+    auto rows = std::vector<uint8_t>(stride * height);
+    auto rows_size = static_cast<uLongf>(rows.size());
+    if (uncompress(
+            rows.data(), &rows_size, image_data.data(), image_data.size()
+        ) != Z_OK
+        || rows_size != rows.size()) {
+        return png;
+    }
+    unfilter_rows(rows, height, pixel_bytes);
+
+    // Every filter type on every row, then the filter chosen row by row, each
+    // at the strongest compression.
+    auto best = image_data;
+    auto filters = std::vector<std::optional<uint8_t>>{
+        FILTER_NONE,
+        FILTER_SUB,
+        FILTER_UP,
+        FILTER_AVERAGE,
+        FILTER_PAETH,
+        std::nullopt,
+    };
+    for (const auto &filter : filters) {
+        auto filtered = rows;
+        filter_rows(filtered, height, pixel_bytes, filter);
+        auto compressed = compress_rows(filtered, 9);
+        if (compressed.size() < best.size()) {
+            best = std::move(compressed);
+        }
+    }
+    if (best.size() >= image_data.size()) {
+        return png;
+    }
+
+    auto optimized = std::vector<uint8_t>(signature, signature + 8);
+    for (size_t i = 0; i < chunks.size(); i += 1) {
+        const auto &data = i == *image_data_index ? best : chunks[i].data;
+        append_png_chunk(
+            optimized, chunks[i].type.c_str(), data.data(), data.size()
+        );
+    }
+    return optimized;
+}
+
+void filter_rows(
+    std::vector<uint8_t> &rows,
+    int height,
+    size_t pixel_bytes,
+    std::optional<uint8_t> filter
+) {
+    if (height == 0) {
+        return;
+    }
+    auto stride = rows.size() / height;
+
+    // Unless `filter` is given, each row gets the filter that leaves the
+    // smallest sum of absolute differences, the heuristic that the PNG
+    // specification suggests. Palettes here are sorted by grey level, so
+    // neighbouring indices are close in tone and the filters predict them
+    // well.
+    auto width = stride - 1;
+    auto previous = std::vector<uint8_t>(width, 0);
+    auto candidates = std::array<std::vector<uint8_t>, 5>();
+    for (auto &candidate : candidates) {
+        candidate.resize(width);
+    }
+
+    for (auto y = 0; y < height; y += 1) {
+        auto row = rows.data() + y * stride + 1;
+        for (size_t x = 0; x < width; x += 1) {
+            int left = x >= pixel_bytes ? row[x - pixel_bytes] : 0;
+            int up = previous[x];
+            int up_left = x >= pixel_bytes ? previous[x - pixel_bytes] : 0;
+
+            auto paeth = paeth_predictor(left, up, up_left);
+            candidates[FILTER_NONE][x] = row[x];
+            candidates[FILTER_SUB][x] = static_cast<uint8_t>(row[x] - left);
+            candidates[FILTER_UP][x] = static_cast<uint8_t>(row[x] - up);
+            candidates[FILTER_AVERAGE][x]
+                = static_cast<uint8_t>(row[x] - (left + up) / 2);
+            candidates[FILTER_PAETH][x] = static_cast<uint8_t>(row[x] - paeth);
+        }
+
+        auto best = filter.value_or(FILTER_NONE);
+        auto best_sum = UINT64_MAX;
+        for (uint8_t candidate = 0; !filter && candidate < candidates.size();
+             candidate += 1) {
+            uint64_t sum = 0;
+            for (auto value : candidates[candidate]) {
+                sum += std::abs(static_cast<int8_t>(value));
+            }
+            if (sum < best_sum) {
+                best = candidate;
+                best_sum = sum;
+            }
+        }
+
+        std::copy(row, row + width, previous.begin());
+        row[-1] = best;
+        std::copy(candidates[best].begin(), candidates[best].end(), row);
+    }
+}
+
+// Undoes the filter of each row, leaving it with filter type None.
+void unfilter_rows(std::vector<uint8_t> &rows, int height, size_t pixel_bytes) {
+    if (height == 0) {
+        return;
+    }
+    auto stride = rows.size() / height;
+    auto width = stride - 1;
+    for (auto y = 0; y < height; y += 1) {
+        auto row = rows.data() + y * stride + 1;
+        auto previous = y > 0 ? row - stride : nullptr;
+        for (size_t x = 0; x < width; x += 1) {
+            int left = x >= pixel_bytes ? row[x - pixel_bytes] : 0;
+            int up = previous ? previous[x] : 0;
+            int up_left
+                = previous && x >= pixel_bytes ? previous[x - pixel_bytes] : 0;
+            auto prediction = 0;
+            switch (row[-1]) {
+            case FILTER_SUB:
+                prediction = left;
+                break;
+            case FILTER_UP:
+                prediction = up;
+                break;
+            case FILTER_AVERAGE:
+                prediction = (left + up) / 2;
+                break;
+            case FILTER_PAETH:
+                prediction = paeth_predictor(left, up, up_left);
+                break;
+            }
+            row[x] = static_cast<uint8_t>(row[x] + prediction);
+        }
+        row[-1] = FILTER_NONE;
+    }
+}
+
+// Whichever of the three neighbours is closest to `left + up - up_left`.
+int paeth_predictor(int left, int up, int up_left) {
+    auto estimate = left + up - up_left;
+    auto left_distance = std::abs(estimate - left);
+    auto up_distance = std::abs(estimate - up);
+    auto up_left_distance = std::abs(estimate - up_left);
+    if (left_distance <= up_distance && left_distance <= up_left_distance) {
+        return left;
+    }
+    if (up_distance <= up_left_distance) {
+        return up;
+    }
+    return up_left;
+}
+
+std::vector<uint8_t>
+compress_rows(const std::vector<uint8_t> &rows, int compression) {
+#if defined(DEFLATE_ENABLED)
+    // libdeflate’s levels run from 0 to 12, so the top of the range maps onto
+    // its strongest level.
+    auto level = (std::clamp(compression, 0, 9) * 12 + 4) / 9;
+    auto compressor = libdeflate_alloc_compressor(level);
+    if (compressor == nullptr) {
+        throw std::runtime_error("libdeflate: Failed to create compressor");
+    }
+    auto compressed = std::vector<uint8_t>(
+        libdeflate_zlib_compress_bound(compressor, rows.size())
+    );
+    auto size = libdeflate_zlib_compress(
+        compressor,
+        rows.data(),
+        rows.size(),
+        compressed.data(),
+        compressed.size()
+    );
+    libdeflate_free_compressor(compressor);
+    if (size == 0) {
+        throw std::runtime_error("libdeflate: Failed to compress PNG data");
+    }
+    compressed.resize(size);
+    return compressed;
+#else
+    auto compressed = std::vector<uint8_t>(compressBound(rows.size()));
+    auto compressed_size = static_cast<uLongf>(compressed.size());
+    auto result = compress2(
+        compressed.data(),
+        &compressed_size,
+        rows.data(),
+        rows.size(),
+        compression
+    );
+    if (result != Z_OK) {
+        throw std::runtime_error(
+            "zlib: Failed to compress PNG data. Error code: "
+            + std::to_string(result)
+        );
+    }
+    compressed.resize(compressed_size);
+    return compressed;
+#endif
+}
+
+void append_png_chunk(
+    std::vector<uint8_t> &png,
+    const char *type,
+    const uint8_t *data,
+    size_t size
+) {
+    for (auto i = 0; i < 4; i += 1) {
+        png.push_back(static_cast<uint8_t>(size >> (24 - 8 * i)));
+    }
+    png.insert(png.end(), type, type + 4);
+    if (size > 0) {
+        png.insert(png.end(), data, data + size);
+    }
+
+    // The CRC covers the chunk type and data, but not the length.
+    auto crc = crc32(0, reinterpret_cast<const Bytef *>(type), 4);
+    if (size > 0) {
+        crc = crc32(crc, data, size);
+    }
+    for (auto i = 0; i < 4; i += 1) {
+        png.push_back(static_cast<uint8_t>(crc >> (24 - 8 * i)));
+    }
+}
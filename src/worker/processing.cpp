@@ -1,11 +1,25 @@
 #include <algorithm>
+#include <chrono>
 #include <filesystem>
+#include <cmath>
 #include <functional>
+#include <future>
+#include <limits>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "../include/task.hpp"
+#include "include/auto_format.hpp"
+#include "include/bilevel.hpp"
+#include "include/book.hpp"
+#include "include/cache.hpp"
+#include "include/colour.hpp"
+#include "include/duplicates.hpp"
+#include "include/palette.hpp"
 #include "include/processing.hpp"
+#include "include/target_quality.hpp"
 
 using Logger = const std::function<void(const std::string &)> &;
 
@@ -22,23 +36,58 @@ static vips::VImage get_vips_img_from_pdf_page(
 );
 
 static bool is_preview_greyscale(FPDF_PAGE page, int page_number);
+static vips::VImage render_pdf_page(const PageTask &task);
 #endif
 
-static vips::VImage remove_uniform_middle_columns(const vips::VImage &img);
-static bool is_greyscale(vips::VImage img, double threshold);
-static bool should_image_rotate(
-    double image_width,
-    double image_height,
-    double display_width,
-    double display_height
+static vips::VImage make_analysis_proxy(const vips::VImage &img);
+static vips::VImage remove_uniform_middle_columns(
+    const vips::VImage &img, const vips::VImage &proxy
+);
+static LoadPageReturn
+crop_page_margins(LoadPageReturn page_info, const PageTask &task);
+static ContentBox scale_content_box(
+    const ContentBox &box, const vips::VImage &from, const vips::VImage &to
 );
-static bool
-is_uniform_column(const vips::VImage &img, int col, double threshold);
-static bool should_image_stretch_contrast(vips::VImage img, PageTask task);
+static bool is_greyscale(vips::VImage img, double threshold);
+static bool should_image_stretch_contrast(vips::VImage proxy, PageTask task);
 
 static vips::VImage
 rotate_image(vips::VImage img, RotationDirection rotation_direction);
 
+// One output page made from a source page. Two-page spreads can produce more
+// than one. Rotation is left to `save_page` so that it can run after scaling.
+struct PagePart {
+    std::string suffix;
+    vips::VImage image;
+    bool rotate;
+};
+
+static std::vector<PagePart>
+split_double_page_spread(const vips::VImage &img, const PageTask &task);
+
+// The order of the transforms that give the same result whether they run
+// before or after scaling. Crop and spine removal aren’t planned: they are
+// views that shrink the page for free, so they always come first.
+struct TransformPlan {
+    bool rotate;
+    bool rotate_after_scaling;
+    bool greyscale;
+    bool greyscale_after_scaling;
+    double pixel_operations_saved;
+};
+
+static TransformPlan
+plan_transforms(const vips::VImage &img, bool rotate, const PageTask &task);
+static std::string describe_plan(const TransformPlan &plan);
+
+static void save_page(
+    const PagePart &part,
+    bool stretch_page_contrast,
+    const PageTask &task,
+    const std::string &base_path,
+    Logger log
+);
+
 static vips::VImage scale_image(
     vips::VImage img,
     double source_width,
@@ -49,12 +98,33 @@ static vips::VImage scale_image(
     bool linear_resample
 );
 
-static vips::VImage stretch_image_contrast(vips::VImage img);
 
 #if defined(PDF_ENABLED)
 const auto PDF_DEFAULT_RENDER_FLAGS = FPDF_ANNOT | FPDF_NO_NATIVETEXT;
 
 LoadPageReturn load_pdf_page(const PageTask &task) {
+    auto img = load_cached_source_page(task);
+    if (!img) {
+        img = render_pdf_page(task);
+        cache_source_page(task, *img);
+    }
+
+    auto proxy = make_analysis_proxy(*img);
+    auto stretch_page_contrast = should_image_stretch_contrast(proxy, task);
+    // The page itself is converted to greyscale by `save_page`, once it’s been
+    // scaled down. Pages that were rendered in greyscale have one band.
+    if (task.convert_pages_to_greyscale && img->bands() >= 3) {
+        proxy = proxy.colourspace(VIPS_INTERPRETATION_B_W);
+    }
+
+    return LoadPageReturn{
+        .image = *img,
+        .proxy = proxy,
+        .stretch_page_contrast = stretch_page_contrast
+    };
+}
+
+vips::VImage render_pdf_page(const PageTask &task) {
     FPDF_DOCUMENT doc
         = FPDF_LoadDocument(task.source_file.string().c_str(), nullptr);
     if (!doc) {
@@ -75,8 +145,10 @@ LoadPageReturn load_pdf_page(const PageTask &task) {
     try {
         auto render_flags = PDF_DEFAULT_RENDER_FLAGS;
 
-        auto render_page_greyscale = false;
-        if (task.convert_pages_to_greyscale) {
+        // 1-bit output is black and white whatever the source, so there’s no
+        // point rendering colour only to throw it away.
+        auto render_page_greyscale = is_bilevel_output(task);
+        if (task.convert_pages_to_greyscale && !render_page_greyscale) {
             render_page_greyscale
                 = is_preview_greyscale(page, task.page_number);
         }
@@ -101,17 +173,9 @@ LoadPageReturn load_pdf_page(const PageTask &task) {
             render_flags
         );
 
-        auto stretch_page_contrast = should_image_stretch_contrast(img, task);
-        if (task.convert_pages_to_greyscale && !render_page_greyscale) {
-            img = img.colourspace(VIPS_INTERPRETATION_B_W);
-        }
-
         FPDF_ClosePage(page);
         FPDF_CloseDocument(doc);
-
-        return LoadPageReturn{
-            .image = img, .stretch_page_contrast = stretch_page_contrast
-        };
+        return img;
     }
     catch (...) {
         FPDF_ClosePage(page);
@@ -121,7 +185,7 @@ LoadPageReturn load_pdf_page(const PageTask &task) {
 }
 #endif
 
-LoadPageReturn load_archive_image(const PageTask &task) {
+std::vector<char> read_archive_entry(const PageTask &task) {
     auto archive = archive_read_new();
     archive_read_support_filter_all(archive);
     archive_read_support_format_all(archive);
@@ -184,65 +248,465 @@ LoadPageReturn load_archive_image(const PageTask &task) {
         );
     }
 
+    return buffer;
+}
+
+LoadPageReturn
+load_archive_image(const std::vector<char> &data, const PageTask &task) {
+    if (auto img = load_cached_source_page(task)) {
+        return prepare_loaded_image(*img, task);
+    }
+
     vips::VImage img
-        = vips::VImage::new_from_buffer(buffer.data(), buffer.size(), "");
+        = vips::VImage::new_from_buffer(data.data(), data.size(), "");
     img = img.copy_memory();
+    cache_source_page(task, img);
 
-    auto stretch_page_contrast = should_image_stretch_contrast(img, task);
+    return prepare_loaded_image(img, task);
+}
+
+LoadPageReturn prepare_loaded_image(vips::VImage img, const PageTask &task) {
+    auto proxy = make_analysis_proxy(img);
+    auto stretch_page_contrast = should_image_stretch_contrast(proxy, task);
     if (task.convert_pages_to_greyscale) {
-        img = img.colourspace(VIPS_INTERPRETATION_B_W);
+        proxy = proxy.colourspace(VIPS_INTERPRETATION_B_W);
     }
 
     return LoadPageReturn{
-        .image = img, .stretch_page_contrast = stretch_page_contrast
+        .image = img,
+        .proxy = proxy,
+        .stretch_page_contrast = stretch_page_contrast
     };
 }
 
+std::vector<PageTask> target_tasks(const PageTask &task) {
+    auto tasks = std::vector<PageTask>{task};
+    for (const auto &target : task.extra_targets) {
+        auto target_task = task;
+        target_task.extra_targets.clear();
+        target_task.output_dir = target.output_dir;
+        target_task.scale_pages = true;
+        target_task.page_width = target.page_width;
+        target_task.page_height = target.page_height;
+        target_task.bit_depth = target.bit_depth;
+        target_task.convert_pages_to_greyscale
+            = target.convert_pages_to_greyscale;
+        target_task.map_colour_eink = target.map_colour_eink;
+        tasks.push_back(std::move(target_task));
+    }
+    tasks[0].extra_targets.clear();
+    return tasks;
+}
+
+PageTask loading_task(const std::vector<PageTask> &tasks) {
+    auto load_task = tasks[0];
+    for (const auto &task : tasks) {
+        load_task.convert_pages_to_greyscale
+            = load_task.convert_pages_to_greyscale
+           && task.convert_pages_to_greyscale;
+        load_task.bit_depth = std::max(load_task.bit_depth, task.bit_depth);
+    }
+    return load_task;
+}
+
+LoadPageReturn retarget_loaded_page(
+    const LoadPageReturn &page_info,
+    const PageTask &load_task,
+    const PageTask &task
+) {
+    if (task.convert_pages_to_greyscale
+        == load_task.convert_pages_to_greyscale) {
+        return page_info;
+    }
+
+    // The page was loaded in colour for another device, so its proxy is still
+    // in colour, as the greyscale decision expects.
+    return LoadPageReturn{
+        .image = page_info.image,
+        .proxy = page_info.proxy.colourspace(VIPS_INTERPRETATION_B_W),
+        .stretch_page_contrast
+        = should_image_stretch_contrast(page_info.proxy, task),
+    };
+}
+
+// The largest number of pixels in an analysis proxy. Every heuristic only
+// needs the page’s overall layout and tones, which survive downsampling.
+const auto ANALYSIS_PROXY_PIXELS = 1000000.0;
+
+vips::VImage make_analysis_proxy(const vips::VImage &img) {
+    auto pixels = static_cast<double>(img.width()) * img.height();
+    if (pixels <= ANALYSIS_PROXY_PIXELS) {
+        return img;
+    }
+
+    // A linear kernel averages neighbouring pixels without the overshoot of
+    // Lanczos, which would invent tones that aren’t on the page. The proxy is
+    // kept in memory because every heuristic reads it again.
+    auto scale = std::sqrt(ANALYSIS_PROXY_PIXELS / pixels);
+    return img
+        .resize(
+            scale, vips::VImage::option()->set("kernel", VIPS_KERNEL_LINEAR)
+        )
+        .copy_memory();
+}
+
+// The longest side of the image shared by a book’s blank pages. Readers
+// stretch it to fill the screen, and being blank, it looks the same.
+const auto BLANK_PAGE_SIZE = 64.0;
+
 void process_vimage(LoadPageReturn page_info, PageTask task, Logger log) {
-    VipsBlob *png_blob = nullptr;
     try {
         auto base_path = task.output_dir / task.output_base_name;
-        auto png_path = base_path.string() + ".png";
         fs::create_directories(base_path.parent_path());
 
-        bool rotate_option;
-        switch (task.double_page_spread_action) {
-        case ROTATE:
-        case BOTH:
-            rotate_option = true;
-            break;
-        default:
-            rotate_option = false;
-            break;
+        // Crop before anything else so that every later stage works on fewer
+        // pixels, and so that the rotation decision sees the page’s real
+        // proportions.
+        if (task.crop_margins) {
+            page_info = crop_page_margins(page_info, task);
         }
 
         auto img = page_info.image;
-
         auto image_should_rotate = should_image_rotate(
             img.width(), img.height(), task.page_width, task.page_height
         );
 
+        if (image_should_rotate && task.remove_spine) {
+            img = remove_uniform_middle_columns(img, page_info.proxy);
+        }
+
+        auto parts = std::vector<PagePart>{
+            {.suffix = "", .image = img, .rotate = false}
+        };
         if (image_should_rotate) {
-            if (task.remove_spine) {
-                img = remove_uniform_middle_columns(img);
+            parts = split_double_page_spread(img, task);
+        }
+
+        if (parts.size() == 1) {
+            // A page identical to an earlier page of the book reuses its
+            // output, and blank pages all share one tiny image. Spreads cut
+            // into several parts are always encoded.
+            auto identity = std::string();
+            auto output
+                = fs::path(task.output_base_name + output_extension(task))
+                      .generic_string();
+            if (task.deduplicate_pages) {
+                auto blank = is_blank_page(page_info.proxy);
+                // Every pixel is read to identify the page, so it’s decoded
+                // once into memory rather than again when it’s saved.
+                auto &image = parts[0].image;
+                if (!blank) {
+                    image = image.copy_memory();
+                }
+                identity = page_identity(image, blank);
+                if (auto reuse = find_page_to_reuse(task, identity)) {
+                    write_page_reference(task, *reuse);
+                    return;
+                }
+                if (blank) {
+                    auto longest_side = std::max(image.width(), image.height());
+                    image = image.resize(BLANK_PAGE_SIZE / longest_side);
+                    task.scale_pages = false;
+                }
+            }
+
+            save_page(
+                parts[0],
+                page_info.stretch_page_contrast,
+                task,
+                base_path.string() + parts[0].suffix,
+                log
+            );
+            if (task.deduplicate_pages) {
+                register_page_output(task, identity, output);
             }
-            if (rotate_option) {
-                img = rotate_image(img, task.rotation_direction);
+            cache_page(
+                task,
+                identity,
+                page_info.stretch_page_contrast,
+                {parts[0].suffix}
+            );
+            return;
+        }
+
+        // The parts of a spread don’t depend on each other, so process them
+        // concurrently. They share the already decoded page.
+        auto log_mutex = std::mutex();
+        auto locked_log = [&](const std::string &message) {
+            auto lock = std::lock_guard(log_mutex);
+            log(message);
+        };
+
+        auto futures = std::vector<std::future<void>>();
+        for (const auto &part : parts) {
+            futures.push_back(std::async(std::launch::async, [&, part] {
+                save_page(
+                    part,
+                    page_info.stretch_page_contrast,
+                    task,
+                    base_path.string() + part.suffix,
+                    locked_log
+                );
+            }));
+        }
+        for (auto &future : futures) {
+            future.get();
+        }
+
+        auto suffixes = std::vector<std::string>();
+        for (const auto &part : parts) {
+            suffixes.push_back(part.suffix);
+        }
+        cache_page(task, "", page_info.stretch_page_contrast, suffixes);
+    }
+    catch (const vips::VError &e) {
+        log("  -> VIPS Error processing in-memory image "
+            + task.output_base_name + ": " + e.what());
+    }
+}
+
+std::vector<PagePart>
+split_double_page_spread(const vips::VImage &img, const PageTask &task) {
+    auto rotated = [&] {
+        return PagePart{.suffix = "", .image = img, .rotate = true};
+    };
+
+    // Split at the middle. The halves are views onto the decoded spread, so
+    // this doesn’t copy any pixels.
+    auto halves = [&] {
+        auto width = img.width();
+        auto height = img.height();
+        auto mid = width / 2;
+        auto left = img.extract_area(0, 0, mid, height);
+        auto right = img.extract_area(mid, 0, width - mid, height);
+        if (task.reading_direction == RIGHT_TO_LEFT) {
+            std::swap(left, right);
+        }
+        return std::vector<PagePart>{
+            {.suffix = "", .image = left, .rotate = false},
+            {.suffix = "", .image = right, .rotate = false}
+        };
+    };
+
+    auto parts = std::vector<PagePart>();
+    switch (task.double_page_spread_action) {
+    case ROTATE:
+        parts.push_back(rotated());
+        break;
+    case SPLIT:
+        parts = halves();
+        break;
+    case BOTH:
+        parts = halves();
+        parts.insert(parts.begin(), rotated());
+        break;
+    case NONE:
+        parts.push_back({.suffix = "", .image = img, .rotate = false});
+        break;
+    }
+
+    // Number the parts in reading order. Page order in the output comes from
+    // a natural sort of the file names, so `_1`, `_2`, … sort right after
+    // the pages before and right before the pages after.
+    if (parts.size() > 1) {
+        for (size_t i = 0; i < parts.size(); i += 1) {
+            parts[i].suffix = "_" + std::to_string(i + 1);
+        }
+    }
+
+    return parts;
+}
+
+TransformPlan
+plan_transforms(const vips::VImage &img, bool rotate, const PageTask &task) {
+    auto plan = TransformPlan{
+        .rotate = rotate,
+        .rotate_after_scaling = false,
+        .greyscale
+        = (task.convert_pages_to_greyscale || is_bilevel_output(task))
+       && img.bands() >= 3,
+        .greyscale_after_scaling = false,
+        .pixel_operations_saved = 0.0,
+    };
+    if (!task.scale_pages || (!plan.rotate && !plan.greyscale)) {
+        return plan;
+    }
+
+    // A rotated page is scaled to fit the display with its sides swapped.
+    double width = rotate ? img.height() : img.width();
+    double height = rotate ? img.width() : img.height();
+    auto scale = std::min(task.page_width / width, task.page_height / height);
+    auto source_pixels = width * height;
+    auto scaled_pixels = source_pixels * scale * scale;
+
+    // The cost of an order, in pixel operations per band. Every transform
+    // reads each pixel of its input once; scaling has to read the whole source
+    // page, so it’s cheaper with fewer bands.
+    double colour_bands = img.bands();
+    auto final_bands = plan.greyscale ? 1.0 : colour_bands;
+    auto cost = [&](bool rotate_after, bool greyscale_after) {
+        auto bands_when_scaling = greyscale_after ? colour_bands : final_bands;
+        auto total = source_pixels * bands_when_scaling;
+        if (plan.greyscale) {
+            total += colour_bands
+                   * (greyscale_after ? scaled_pixels : source_pixels);
+        }
+        if (plan.rotate) {
+            total += rotate_after ? scaled_pixels * final_bands
+                                  : source_pixels * bands_when_scaling;
+        }
+        return total;
+    };
+
+    auto default_cost = cost(false, false);
+    auto best_cost = default_cost;
+    for (auto rotate_after : {false, true}) {
+        for (auto greyscale_after : {false, true}) {
+            if ((rotate_after && !plan.rotate)
+                || (greyscale_after && !plan.greyscale)) {
+                continue;
+            }
+            auto order_cost = cost(rotate_after, greyscale_after);
+            if (order_cost < best_cost) {
+                best_cost = order_cost;
+                plan.rotate_after_scaling = rotate_after;
+                plan.greyscale_after_scaling = greyscale_after;
             }
         }
+    }
+    plan.pixel_operations_saved = default_cost - best_cost;
+
+    return plan;
+}
+
+std::string describe_plan(const TransformPlan &plan) {
+    auto steps = std::vector<std::string>();
+    if (plan.greyscale && !plan.greyscale_after_scaling) {
+        steps.push_back("greyscale");
+    }
+    if (plan.rotate && !plan.rotate_after_scaling) {
+        steps.push_back("rotate");
+    }
+    steps.push_back("scale");
+    if (plan.greyscale && plan.greyscale_after_scaling) {
+        steps.push_back("greyscale");
+    }
+    if (plan.rotate && plan.rotate_after_scaling) {
+        steps.push_back("rotate");
+    }
+
+    auto description = std::string("transform order:");
+    for (const auto &step : steps) {
+        description += " " + step;
+    }
+    description += " (saves about "
+                 + std::to_string(std::llround(plan.pixel_operations_saved))
+                 + " pixel operations)";
+    return description;
+}
+
+void save_page(
+    const PagePart &part,
+    bool stretch_page_contrast,
+    const PageTask &task,
+    const std::string &base_path,
+    Logger log
+) {
+    try {
+        auto img = part.image;
+
+        // Rotation and greyscale conversion touch every pixel, so run them on
+        // whichever side of scaling has fewer.
+        auto plan = plan_transforms(img, part.rotate, task);
+        if (task.scale_pages && (plan.rotate || plan.greyscale)) {
+            log("@info " + fs::path(base_path).filename().string() + ": "
+                + describe_plan(plan));
+        }
+
+        if (plan.greyscale && !plan.greyscale_after_scaling) {
+            img = img.colourspace(VIPS_INTERPRETATION_B_W);
+        }
+        if (plan.rotate && !plan.rotate_after_scaling) {
+            img = rotate_image(img, task.rotation_direction);
+        }
 
         if (task.scale_pages) {
+            auto rotation_pending = plan.rotate && plan.rotate_after_scaling;
             img = scale_image(
                 img,
                 img.width(),
                 img.height(),
-                task.page_width,
-                task.page_height,
+                rotation_pending ? task.page_height : task.page_width,
+                rotation_pending ? task.page_width : task.page_height,
                 task.page_resampler,
                 task.linear_light_resampling
             );
         }
 
+        if (plan.greyscale && plan.greyscale_after_scaling) {
+            img = img.colourspace(VIPS_INTERPRETATION_B_W);
+        }
+        if (plan.rotate && plan.rotate_after_scaling) {
+            img = rotate_image(img, task.rotation_direction);
+        }
+
+        // Cached in memory first, since the page is read again to encode it.
+        if (!task.cache_dir.empty()) {
+            img = img.copy_memory();
+            cache_page_part(task, part.suffix, img);
+        }
+        encode_and_report(img, stretch_page_contrast, task, base_path, log);
+    }
+    catch (const vips::VError &e) {
+        log("  -> VIPS Error processing in-memory image "
+            + fs::path(base_path).filename().string() + ": " + e.what());
+    }
+}
+
+void encode_and_report(
+    const vips::VImage &img,
+    bool stretch_page_contrast,
+    const PageTask &task,
+    const std::string &base_path,
+    Logger log
+) {
+    // The encode time goes to the GUI as a status line, for the time budget.
+    auto encode_start = std::chrono::steady_clock::now();
+    auto output_path = base_path + output_extension(task);
+    if (task.image_format == "Auto") {
+        output_path
+            = save_page_auto(img, stretch_page_contrast, task, base_path, log);
+    }
+    else {
+        encode_page(img, stretch_page_contrast, task, base_path, log);
+    }
+    auto encode_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now() - encode_start
+    )
+                         .count();
+    log("@encode_ms " + std::to_string(encode_ms));
+    log("@output " + output_path);
+}
+
+void encode_page(
+    vips::VImage img,
+    bool stretch_page_contrast,
+    const PageTask &task,
+    const std::string &base_path,
+    Logger log
+) {
+    auto output_path = base_path + output_extension(task);
+    VipsBlob *png_blob = nullptr;
+    try {
+        // 1-bit pages skip palette quantization and the generic PNG encoder.
+        if (is_bilevel_output(task)) {
+            if (stretch_page_contrast) {
+                img = stretch_image_contrast(img);
+            }
+            save_bilevel_png(img, task, output_path);
+            return;
+        }
+
         // Build fresh palette options per save: a VOption is consumed by the
         // operation it is passed to, so it must not be reused across calls.
         auto make_palette_options = [&] {
@@ -253,10 +717,40 @@ void process_vimage(LoadPageReturn page_info, PageTask task, Logger log) {
                 ->set("effort", 10);
         };
 
+        // Colour e-ink pages are mapped to the panel’s fixed colours instead of
+        // an adaptive palette. The stretch comes first here, since stretching
+        // afterwards would move colours off the panel’s levels.
+        auto map_colours = should_map_colour_eink(img, task);
+        if (map_colours) {
+            if (stretch_page_contrast) {
+                img = stretch_image_contrast(img);
+                stretch_page_contrast = false;
+            }
+            img = map_colour_eink(img, task);
+        }
+
+        // Greyscale pages can share one palette, found once for the whole
+        // book, instead of searching for a palette of their own. As with the
+        // panel’s colours, the stretch comes first, so that every page keeps
+        // exactly the book’s levels.
+        auto use_book_palette
+            = !map_colours && should_use_book_palette(img, task);
+        if (use_book_palette) {
+            if (stretch_page_contrast) {
+                img = stretch_image_contrast(img);
+                stretch_page_contrast = false;
+            }
+            img = remap_to_palette(img, book_grey_palette(task), task.dither);
+        }
+
+        auto quantize
+            = task.quantize_pages && !map_colours && !use_book_palette;
+        auto grey_page = img.bands() == 1;
+
         // Quantize FIRST so the palette is built from the original tones.
         // Doing this before the contrast stretch matters: it ensures that each
         // page stretches the full colour range.
-        if (task.quantize_pages) {
+        if (quantize) {
             png_blob = img.pngsave_buffer(
                 make_palette_options()->set("compression", 0)
             );
@@ -265,17 +759,32 @@ void process_vimage(LoadPageReturn page_info, PageTask task, Logger log) {
             img = vips::VImage::new_from_buffer(buffer_data, buffer_size, "");
         }
 
-        if (page_info.stretch_page_contrast) {
+        if (stretch_page_contrast) {
             img = stretch_image_contrast(img);
         }
 
+        // Indexed greyscale pages skip `pngsave` for the faster encoder in
+        // png.cpp. Quantized pages come back from the palette round trip with
+        // the grey repeated in every band, so any band will do.
+        if (task.image_format == "PNG" && use_book_palette) {
+            save_indexed_grey_png(img, task, output_path);
+            return;
+        }
+        if (task.image_format == "PNG" && quantize && grey_page) {
+            save_indexed_grey_png(img[0], task, output_path);
+            if (png_blob != nullptr) {
+                vips_area_unref(VIPS_AREA(png_blob));
+            }
+            return;
+        }
+
         if (task.image_format == "PNG") {
-            // When `task.quantize_pages` is true, the image has already been
-            // quantized, so re-quantizing here is a no-op.
-            auto base_options = task.quantize_pages ? make_palette_options()
-                                                    : vips::VImage::option();
+            // When `quantize` is true, the image has already been quantized,
+            // so re-quantizing here is a no-op.
+            auto base_options = quantize ? make_palette_options()
+                                         : vips::VImage::option();
             img.pngsave(
-                png_path.c_str(),
+                output_path.c_str(),
                 base_options->set("compression", task.compression_effort)
             );
             if (png_blob != nullptr) {
@@ -284,64 +793,99 @@ void process_vimage(LoadPageReturn page_info, PageTask task, Logger log) {
             return;
         }
 
-        auto options = vips::VImage::option();
+        // With a target quality, each page gets the lowest quality setting
+        // that still reaches it.
+        auto settings = task;
+        if (has_quality_target(task)) {
+            settings = with_target_quality(
+                img, task, fs::path(base_path).filename().string(), log
+            );
+        }
+
         if (task.image_format == "AVIF") {
-            auto output_path = base_path.string() + ".avif";
-            options
-                = options->set("compression", VIPS_FOREIGN_HEIF_COMPRESSION_AV1)
-                      ->set("effort", task.compression_effort)
-                      ->set("subsample_mode", VIPS_FOREIGN_SUBSAMPLE_ON);
-            if (task.is_lossy) {
-                options = options->set("Q", task.quality);
-            }
-            else {
-                options = options->set("lossless", true);
-            }
-            img.heifsave(output_path.c_str(), options);
+            img.heifsave(output_path.c_str(), save_options(settings));
         }
         else if (task.image_format == "JPEG") {
-            auto output_path = base_path.string() + ".jpg";
-            img.jpegsave(output_path.c_str(), options->set("Q", task.quality));
+            img.jpegsave(output_path.c_str(), save_options(settings));
         }
         else if (task.image_format == "JPEG XL") {
-            auto output_path = base_path.string() + ".jxl";
-            options = options->set("effort", task.compression_effort);
-            if (!task.is_lossy) {
-                options = options->set("distance", 0.0);
-            }
-            else if (task.quality_type_is_distance) {
-                options = options->set("distance", task.quality);
-            }
-            else {
-                options = options->set("Q", task.quality);
-            }
-            img.jxlsave(output_path.c_str(), options);
+            img.jxlsave(output_path.c_str(), save_options(settings));
         }
         else if (task.image_format == "WebP") {
-            auto output_path = base_path.string() + ".webp";
-            options = options->set("effort", task.compression_effort);
-            if (task.is_lossy) {
-                options = options->set("Q", task.quality);
-            }
-            else {
-                options = options->set("lossless", true);
-            }
-            img.webpsave(output_path.c_str(), options);
+            img.webpsave(output_path.c_str(), save_options(settings));
         }
 
         if (png_blob != nullptr) {
             vips_area_unref(VIPS_AREA(png_blob));
         }
     }
-    catch (const vips::VError &e) {
+    catch (...) {
         if (png_blob != nullptr) {
             vips_area_unref(VIPS_AREA(png_blob));
         }
-        log("  -> VIPS Error processing in-memory image "
-            + task.output_base_name + ": " + e.what());
+        throw;
     }
 }
 
+std::string output_extension(const PageTask &task) {
+    if (task.image_format == "AVIF") {
+        return ".avif";
+    }
+    if (task.image_format == "JPEG") {
+        return ".jpg";
+    }
+    if (task.image_format == "JPEG XL") {
+        return ".jxl";
+    }
+    if (task.image_format == "WebP") {
+        return ".webp";
+    }
+    if (task.image_format == "Auto") {
+        return "";
+    }
+    return ".png";
+}
+
+vips::VOption *save_options(const PageTask &task) {
+    auto options = vips::VImage::option();
+    if (task.image_format == "AVIF") {
+        options = options->set("compression", VIPS_FOREIGN_HEIF_COMPRESSION_AV1)
+                      ->set("effort", task.compression_effort)
+                      ->set("subsample_mode", VIPS_FOREIGN_SUBSAMPLE_ON);
+        if (task.is_lossy) {
+            options = options->set("Q", task.quality);
+        }
+        else {
+            options = options->set("lossless", true);
+        }
+    }
+    else if (task.image_format == "JPEG") {
+        options = options->set("Q", task.quality);
+    }
+    else if (task.image_format == "JPEG XL") {
+        options = options->set("effort", task.compression_effort);
+        if (!task.is_lossy) {
+            options = options->set("distance", 0.0);
+        }
+        else if (task.quality_type_is_distance) {
+            options = options->set("distance", task.quality);
+        }
+        else {
+            options = options->set("Q", task.quality);
+        }
+    }
+    else if (task.image_format == "WebP") {
+        options = options->set("effort", task.compression_effort);
+        if (task.is_lossy) {
+            options = options->set("Q", task.quality);
+        }
+        else {
+            options = options->set("lossless", true);
+        }
+    }
+    return options;
+}
+
 #if defined(PDF_ENABLED)
 vips::VImage get_vips_img_from_pdf_page(
     FPDF_PAGE page,
@@ -391,26 +935,47 @@ vips::VImage get_vips_img_from_pdf_page(
 }
 #endif
 
-vips::VImage remove_uniform_middle_columns(const vips::VImage &img) {
+vips::VImage remove_uniform_middle_columns(
+    const vips::VImage &img, const vips::VImage &proxy
+) {
     double max_fraction = 0.1;
-    int width = img.width();
-    int height = img.height();
+    int width = proxy.width();
     int mid = width / 2;
 
-    double global_range = img.max() - img.min();
-    if (global_range == 0) {
+    // Find the range of values in every column of the proxy in one pass, rather
+    // than extracting and scanning each column of the full page separately.
+    auto bands = proxy.bands();
+    auto values = image_to_doubles(proxy);
+    auto column_min
+        = std::vector<double>(width, std::numeric_limits<double>::max());
+    auto column_max
+        = std::vector<double>(width, std::numeric_limits<double>::lowest());
+    for (size_t i = 0; i < values.size(); i += 1) {
+        auto column = static_cast<int>(i / bands) % width;
+        column_min[column] = std::min(column_min[column], values[i]);
+        column_max[column] = std::max(column_max[column], values[i]);
+    }
+
+    double global_range
+        = *std::max_element(column_max.begin(), column_max.end())
+        - *std::min_element(column_min.begin(), column_min.end());
+    if (global_range <= 0) {
         return img.copy();
     }
 
+    auto is_uniform_column = [&](int column, double threshold) {
+        return column_max[column] - column_min[column] < threshold;
+    };
+
     // Helper lambda to find the bounds of the uniform middle section
     auto get_uniform_bounds = [&](double threshold) {
         int left = mid;
-        while (left >= 0 && is_uniform_column(img, left, threshold)) {
+        while (left >= 0 && is_uniform_column(left, threshold)) {
             left -= 1;
         }
 
         int right = mid + 1;
-        while (right < width && is_uniform_column(img, right, threshold)) {
+        while (right < width && is_uniform_column(right, threshold)) {
             right += 1;
         }
         return std::make_pair(left, right);
@@ -453,6 +1018,15 @@ vips::VImage remove_uniform_middle_columns(const vips::VImage &img) {
         }
     }
 
+    // Map the uniform columns found on the proxy onto the full page, rounding
+    // inwards so that no column that might hold content is removed.
+    auto scale = static_cast<double>(img.width()) / width;
+    width = img.width();
+    auto height = img.height();
+    best_left_bound
+        = static_cast<int>(std::ceil((best_left_bound + 1) * scale)) - 1;
+    best_right_bound = static_cast<int>(std::floor(best_right_bound * scale));
+
     int remove_width = best_right_bound - best_left_bound - 1;
 
     if (remove_width <= 0) {
@@ -477,16 +1051,149 @@ vips::VImage remove_uniform_middle_columns(const vips::VImage &img) {
 }
 
 #if defined(PDF_ENABLED)
-bool is_preview_greyscale(FPDF_PAGE page, int page_number) {
+vips::VImage
+render_pdf_page_preview(FPDF_PAGE page, int page_number, double ppi) {
     auto render_flags = PDF_DEFAULT_RENDER_FLAGS | FPDF_RENDER_NO_SMOOTHTEXT
-                      | FPDF_RENDER_NO_SMOOTHIMAGE | FPDF_RENDER_NO_SMOOTHPATH;
-    auto preview_img = get_vips_img_from_pdf_page(
-        page, page_number, FPDFBitmap_BGR, 3, 10.0, render_flags
+                      | FPDF_RENDER_NO_SMOOTHIMAGE | FPDF_RENDER_NO_SMOOTHPATH
+                      | FPDF_REVERSE_BYTE_ORDER;
+    return get_vips_img_from_pdf_page(
+        page, page_number, FPDFBitmap_BGR, 3, ppi, render_flags
     );
+}
+
+bool is_preview_greyscale(FPDF_PAGE page, int page_number) {
+    auto preview_img = render_pdf_page_preview(page, page_number, 10.0);
     return is_greyscale(preview_img, 10);
 }
 #endif
 
+// Margins are pixels close to the paper colour. Anything darker counts as
+// content, with some allowance so that scanner noise and JPEG ringing in an
+// otherwise blank margin don’t stop the crop.
+const auto CROP_PAPER_THRESHOLD = 230.0;
+// A row or column needs at least this fraction of content pixels to count, so
+// that isolated specks of dust are ignored.
+const auto CROP_MIN_CONTENT_FRACTION = 0.002;
+// Keep a sliver of margin so that content isn’t cut flush with the page edge.
+const auto CROP_PADDING_FRACTION = 0.01;
+// Never crop more than this fraction of the page from any one side.
+const auto CROP_MAX_SIDE_FRACTION = 0.2;
+
+std::optional<ContentBox> find_content_box(const vips::VImage &img) {
+    auto width = img.width();
+    auto height = img.height();
+
+    // A single pass over the page yields both projections: the number of
+    // content pixels in every column and in every row (times 255, since the
+    // mask is 0 or 255).
+    auto grey = img.colourspace(VIPS_INTERPRETATION_B_W)[0];
+    auto mask = grey < CROP_PAPER_THRESHOLD;
+    vips::VImage row_image;
+    auto column_image = mask.project(&row_image);
+    auto columns = image_to_doubles(column_image);
+    auto rows = image_to_doubles(row_image);
+
+    auto min_column = 255.0 * std::max(1.0, height * CROP_MIN_CONTENT_FRACTION);
+    auto min_row = 255.0 * std::max(1.0, width * CROP_MIN_CONTENT_FRACTION);
+
+    auto is_content_column = [&](double count) { return count >= min_column; };
+    auto is_content_row = [&](double count) { return count >= min_row; };
+
+    auto first_column
+        = std::find_if(columns.begin(), columns.end(), is_content_column);
+    auto first_row = std::find_if(rows.begin(), rows.end(), is_content_row);
+    if (first_column == columns.end() || first_row == rows.end()) {
+        // A blank page has no content to crop to.
+        return std::nullopt;
+    }
+    auto last_column
+        = std::find_if(columns.rbegin(), columns.rend(), is_content_column);
+    auto last_row = std::find_if(rows.rbegin(), rows.rend(), is_content_row);
+
+    auto trim = [](long margin, int size) {
+        auto padding = static_cast<long>(size * CROP_PADDING_FRACTION);
+        auto max_margin = static_cast<long>(size * CROP_MAX_SIDE_FRACTION);
+        return static_cast<int>(
+            std::clamp(margin - padding, 0L, std::max(max_margin, 0L))
+        );
+    };
+
+    auto left = trim(first_column - columns.begin(), width);
+    auto right = trim(last_column - columns.rbegin(), width);
+    auto top = trim(first_row - rows.begin(), height);
+    auto bottom = trim(last_row - rows.rbegin(), height);
+
+    return ContentBox{
+        .left = left,
+        .top = top,
+        .width = width - left - right,
+        .height = height - top - bottom,
+    };
+}
+
+LoadPageReturn
+crop_page_margins(LoadPageReturn page_info, const PageTask &task) {
+    auto &img = page_info.image;
+    auto &proxy = page_info.proxy;
+
+    // Two-page spreads have different proportions to single pages, so they are
+    // always cropped on their own.
+    auto use_book_box
+        = task.crop_margins_per_book && img.height() >= img.width();
+
+    auto box = use_book_box
+                 ? book_content_box(task, proxy)
+                 : find_content_box(proxy);
+    if (!box) {
+        return page_info;
+    }
+
+    // `extract_area` is a view onto the decoded page, not a copy. The proxy is
+    // cropped too so that it keeps matching the page for spine detection.
+    auto page_box = scale_content_box(*box, proxy, img);
+    img = img.extract_area(
+        page_box.left, page_box.top, page_box.width, page_box.height
+    );
+    proxy = proxy.extract_area(box->left, box->top, box->width, box->height);
+    return page_info;
+}
+
+// Maps a box found on one image onto a larger copy of it, rounding outwards so
+// that nothing inside the box is cut off.
+ContentBox scale_content_box(
+    const ContentBox &box, const vips::VImage &from, const vips::VImage &to
+) {
+    auto scale_x = static_cast<double>(to.width()) / from.width();
+    auto scale_y = static_cast<double>(to.height()) / from.height();
+
+    auto left = static_cast<int>(std::floor(box.left * scale_x));
+    auto top = static_cast<int>(std::floor(box.top * scale_y));
+    auto right = std::min(
+        static_cast<int>(std::ceil((box.left + box.width) * scale_x)),
+        to.width()
+    );
+    auto bottom = std::min(
+        static_cast<int>(std::ceil((box.top + box.height) * scale_y)),
+        to.height()
+    );
+
+    return ContentBox{
+        .left = left,
+        .top = top,
+        .width = right - left,
+        .height = bottom - top,
+    };
+}
+
+std::vector<double> image_to_doubles(const vips::VImage &img) {
+    auto doubles = img.cast(VIPS_FORMAT_DOUBLE);
+    size_t size = 0;
+    auto data = static_cast<double *>(doubles.write_to_memory(&size));
+    auto values = std::vector<double>(data, data + size / sizeof(double));
+    g_free(data);
+    return values;
+}
+
 bool is_greyscale(vips::VImage img, double threshold) {
     if (img.bands() < 3) {
         return true;
@@ -512,28 +1219,24 @@ bool should_image_rotate(
     return rotated_diff < original_diff;
 }
 
-bool should_image_stretch_contrast(vips::VImage img, PageTask task) {
+bool should_image_stretch_contrast(vips::VImage proxy, PageTask task) {
     return task.stretch_page_contrast
-        && (!task.convert_pages_to_greyscale || is_greyscale(img, 10.0));
-}
-
-bool is_uniform_column(const vips::VImage &img, int col, double threshold) {
-    vips::VImage column = img.extract_area(col, 0, 1, img.height());
-    return column.max() - column.min() < threshold;
+        && (!task.convert_pages_to_greyscale || is_greyscale(proxy, 10.0));
 }
 
 vips::VImage
 rotate_image(vips::VImage img, RotationDirection rotation_direction) {
-    double angle = 0.0;
+    // `rot` moves pixels without resampling, unlike `rotate`.
+    auto angle = VIPS_ANGLE_D0;
     switch (rotation_direction) {
     case CLOCKWISE:
-        angle = 90.0;
+        angle = VIPS_ANGLE_D90;
         break;
     case COUNTERCLOCKWISE:
-        angle = -90.0;
+        angle = VIPS_ANGLE_D270;
         break;
     }
-    return img.rotate(angle);
+    return img.rot(angle);
 }
 
 vips::VImage scale_image(
@@ -0,0 +1,227 @@
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "../include/protocol.hpp"
+
+// Every frame starts with this, so that a worker fed anything else stops at
+// once instead of decoding garbage.
+const auto TASK_FRAME_MAGIC = std::string_view("CPTK");
+// Payloads larger than this are taken as corrupt rather than allocated.
+const auto MAX_TASK_PAYLOAD_SIZE = uint32_t(1) << 24;
+
+// Where decoding has got to in a frame.
+struct FrameReader {
+    std::string_view data;
+    size_t offset = 0;
+};
+
+template <typename T>
+    requires std::is_arithmetic_v<T> || std::is_enum_v<T>
+static void put(std::string &out, T value);
+static void put(std::string &out, bool value);
+static void put(std::string &out, const std::string &value);
+static void put(std::string &out, const fs::path &value);
+static void put(std::string &out, const std::vector<std::string> &values);
+static void put(std::string &out, const std::vector<DisplayTarget> &targets);
+static std::string_view take(FrameReader &reader, size_t size);
+template <typename T>
+    requires std::is_arithmetic_v<T>
+static void get(FrameReader &reader, T &value);
+template <typename T>
+    requires std::is_enum_v<T>
+static void get(FrameReader &reader, T &value);
+static long long enum_max(DoublePageSpreadActions);
+static long long enum_max(RotationDirection);
+static long long enum_max(ReadingDirection);
+static long long enum_max(VipsKernel);
+static void get(FrameReader &reader, bool &value);
+static void get(FrameReader &reader, std::string &value);
+static void get(FrameReader &reader, fs::path &value);
+static void get(FrameReader &reader, std::vector<std::string> &values);
+static void get(FrameReader &reader, std::vector<DisplayTarget> &targets);
+
+std::string encode_task(const PageTask &task) {
+    auto payload = std::string();
+#define PUT_FIELD(name) put(payload, task.name);
+    PAGE_TASK_FIELDS(PUT_FIELD)
+#undef PUT_FIELD
+
+    auto frame = std::string(TASK_FRAME_MAGIC);
+    put(frame, TASK_PROTOCOL_VERSION);
+    put(frame, static_cast<uint32_t>(payload.size()));
+    return frame + payload;
+}
+
+std::optional<PageTask> read_task(std::istream &in) {
+    auto header = std::string(
+        TASK_FRAME_MAGIC.size() + sizeof(uint16_t) + sizeof(uint32_t), '\0'
+    );
+    in.read(header.data(), static_cast<std::streamsize>(header.size()));
+    if (in.gcount() == 0) {
+        return std::nullopt;
+    }
+    if (static_cast<size_t>(in.gcount()) != header.size()) {
+        throw std::runtime_error("Task frame cut short");
+    }
+
+    auto header_reader = FrameReader{.data = header, .offset = 0};
+    if (take(header_reader, TASK_FRAME_MAGIC.size()) != TASK_FRAME_MAGIC) {
+        throw std::runtime_error("Not a task frame");
+    }
+    auto version = uint16_t();
+    auto payload_size = uint32_t();
+    get(header_reader, version);
+    get(header_reader, payload_size);
+    if (version != TASK_PROTOCOL_VERSION) {
+        throw std::runtime_error(
+            "Task frame has protocol version " + std::to_string(version)
+            + ", expected " + std::to_string(TASK_PROTOCOL_VERSION)
+        );
+    }
+    if (payload_size > MAX_TASK_PAYLOAD_SIZE) {
+        throw std::runtime_error("Task frame is too large");
+    }
+
+    auto payload = std::string(payload_size, '\0');
+    in.read(payload.data(), static_cast<std::streamsize>(payload.size()));
+    if (static_cast<size_t>(in.gcount()) != payload.size()) {
+        throw std::runtime_error("Task frame cut short");
+    }
+
+    auto reader = FrameReader{.data = payload, .offset = 0};
+    auto task = PageTask();
+#define GET_FIELD(name) get(reader, task.name);
+    PAGE_TASK_FIELDS(GET_FIELD)
+#undef GET_FIELD
+    if (reader.offset != payload.size()) {
+        throw std::runtime_error("Task frame has unexpected data at its end");
+    }
+    return task;
+}
+
+template <typename T>
+    requires std::is_arithmetic_v<T> || std::is_enum_v<T>
+void put(std::string &out, T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    out.append(bytes, sizeof(T));
+}
+
+// As a byte, since only 0 and 1 are valid when it’s read back.
+void put(std::string &out, bool value) {
+    put(out, static_cast<uint8_t>(value));
+}
+
+void put(std::string &out, const std::string &value) {
+    put(out, static_cast<uint32_t>(value.size()));
+    out += value;
+}
+
+void put(std::string &out, const fs::path &value) {
+    put(out, value.string());
+}
+
+void put(std::string &out, const std::vector<std::string> &values) {
+    put(out, static_cast<uint32_t>(values.size()));
+    for (const auto &value : values) {
+        put(out, value);
+    }
+}
+
+void put(std::string &out, const std::vector<DisplayTarget> &targets) {
+    put(out, static_cast<uint32_t>(targets.size()));
+    for (const auto &target : targets) {
+#define PUT_FIELD(name) put(out, target.name);
+        DISPLAY_TARGET_FIELDS(PUT_FIELD)
+#undef PUT_FIELD
+    }
+}
+
+std::string_view take(FrameReader &reader, size_t size) {
+    if (size > reader.data.size() - reader.offset) {
+        throw std::runtime_error("Task frame ends in the middle of a field");
+    }
+    auto bytes = reader.data.substr(reader.offset, size);
+    reader.offset += size;
+    return bytes;
+}
+
+template <typename T>
+    requires std::is_arithmetic_v<T>
+void get(FrameReader &reader, T &value) {
+    std::memcpy(&value, take(reader, sizeof(T)).data(), sizeof(T));
+}
+
+// Read as their underlying integers, since a value outside the enumeration
+// can’t be held by it.
+template <typename T>
+    requires std::is_enum_v<T>
+void get(FrameReader &reader, T &value) {
+    auto raw = std::underlying_type_t<T>();
+    get(reader, raw);
+    auto number = static_cast<long long>(raw);
+    if (number < 0 || number > enum_max(T())) {
+        throw std::runtime_error(
+            "Task frame has an out-of-range setting: " + std::to_string(number)
+        );
+    }
+    value = static_cast<T>(raw);
+}
+
+long long enum_max(DoublePageSpreadActions) {
+    return NONE;
+}
+
+long long enum_max(RotationDirection) {
+    return COUNTERCLOCKWISE;
+}
+
+long long enum_max(ReadingDirection) {
+    return RIGHT_TO_LEFT;
+}
+
+long long enum_max(VipsKernel) {
+    return VIPS_KERNEL_LAST - 1;
+}
+
+void get(FrameReader &reader, bool &value) {
+    auto byte = uint8_t();
+    get(reader, byte);
+    value = byte != 0;
+}
+
+void get(FrameReader &reader, std::string &value) {
+    auto size = uint32_t();
+    get(reader, size);
+    value = std::string(take(reader, size));
+}
+
+void get(FrameReader &reader, fs::path &value) {
+    auto string = std::string();
+    get(reader, string);
+    value = string;
+}
+
+void get(FrameReader &reader, std::vector<std::string> &values) {
+    auto count = uint32_t();
+    get(reader, count);
+    values.clear();
+    for (uint32_t i = 0; i < count; i += 1) {
+        get(reader, values.emplace_back());
+    }
+}
+
+void get(FrameReader &reader, std::vector<DisplayTarget> &targets) {
+    auto count = uint32_t();
+    get(reader, count);
+    targets.clear();
+    for (uint32_t i = 0; i < count; i += 1) {
+        auto &target = targets.emplace_back();
+#define GET_FIELD(name) get(reader, target.name);
+        DISPLAY_TARGET_FIELDS(GET_FIELD)
+#undef GET_FIELD
+    }
+}
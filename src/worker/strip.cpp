@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../include/task.hpp"
+#include "include/processing.hpp"
+#include "include/strip.hpp"
+
+// An image counts as a long strip when it’s this many times taller, relative
+// to its width, than the display.
+const auto LONG_STRIP_ASPECT_FACTOR = 2.0;
+// How far up from the bottom of a full slice to look for a gutter to cut
+// through, as a fraction of the slice height.
+const auto GUTTER_SEARCH_FRACTION = 0.25;
+// Output pages are numbered with at least this many digits so that they sort
+// in order; the number of slices isn’t known until the strip has been read.
+const auto SLICE_NUMBER_WIDTH = 4;
+
+static int find_gutter_row(const vips::VImage &window, int from, int to);
+static std::string slice_suffix(int index);
+
+bool is_long_strip(const std::vector<char> &data, const PageTask &task) {
+    // Loading from a buffer only reads the header until pixels are requested.
+    auto img = vips::VImage::new_from_buffer(data.data(), data.size(), "");
+    double strip_aspect = static_cast<double>(img.height()) / img.width();
+    double display_aspect
+        = static_cast<double>(task.page_height) / task.page_width;
+    return strip_aspect > LONG_STRIP_ASPECT_FACTOR * display_aspect;
+}
+
+void slice_long_strip(
+    const std::vector<char> &data, const PageTask &task, Logger log
+) {
+    auto strip = vips::VImage::new_from_buffer(
+        data.data(),
+        data.size(),
+        "",
+        vips::VImage::option()->set("access", VIPS_ACCESS_SEQUENTIAL)
+    );
+    auto width = strip.width();
+    auto height = strip.height();
+
+    auto slice_height = std::max(
+        static_cast<int>(
+            static_cast<double>(width) * task.page_height / task.page_width
+        ),
+        1
+    );
+    auto search_height
+        = static_cast<int>(slice_height * GUTTER_SEARCH_FRACTION);
+
+    // Rows that have been decoded but not yet cut off into a slice. With
+    // sequential access the strip can only be read forwards, so these are kept
+    // in memory rather than read again.
+    auto pending = vips::VImage();
+    auto pending_rows = 0;
+    auto rows_read = 0;
+    auto index = 1;
+
+    while (rows_read < height || pending_rows > 0) {
+        if (pending_rows < slice_height && rows_read < height) {
+            auto rows
+                = std::min(slice_height - pending_rows, height - rows_read);
+            auto chunk
+                = strip.extract_area(0, rows_read, width, rows).copy_memory();
+            rows_read += rows;
+            pending = pending_rows > 0
+                        ? pending.join(chunk, VIPS_DIRECTION_VERTICAL)
+                              .copy_memory()
+                        : chunk;
+            pending_rows += rows;
+        }
+
+        auto cut = pending_rows;
+        if (rows_read < height) {
+            cut = find_gutter_row(
+                pending, slice_height - search_height, slice_height
+            );
+        }
+
+        auto slice = pending.extract_area(0, 0, width, cut);
+        // Slices are cut to the display’s shape, but the last one can be
+        // short enough to be wider than tall. It isn’t a spread, so it’s
+        // never rotated or split.
+        auto slice_task = task;
+        slice_task.output_base_name += slice_suffix(index);
+        slice_task.double_page_spread_action = NONE;
+        process_vimage(
+            prepare_loaded_image(slice, slice_task), slice_task, log
+        );
+
+        if (cut < pending_rows) {
+            pending = pending.extract_area(0, cut, width, pending_rows - cut)
+                          .copy_memory();
+        }
+        pending_rows -= cut;
+        index += 1;
+    }
+}
+
+// Returns the row between `from` and `to` to cut at, which is the one with the
+// least variation in tone: ideally a blank gutter between panels. Ties go to
+// the lowest row so that pages are as full as possible.
+int find_gutter_row(const vips::VImage &window, int from, int to) {
+    from = std::max(from, 1);
+    if (to <= from) {
+        return std::max(to, 1);
+    }
+
+    auto grey = window.extract_area(0, from, window.width(), to - from)
+                    .colourspace(VIPS_INTERPRETATION_B_W)[0]
+                    .cast(VIPS_FORMAT_FLOAT);
+
+    // The variance of each row from the row sums of the values and their
+    // squares, which takes one projection each.
+    vips::VImage sum_image;
+    vips::VImage square_sum_image;
+    grey.project(&sum_image);
+    (grey * grey).project(&square_sum_image);
+    auto sums = image_to_doubles(sum_image);
+    auto square_sums = image_to_doubles(square_sum_image);
+
+    double n = window.width();
+    auto best_row = to;
+    auto best_variance = -1.0;
+    for (size_t i = 0; i < sums.size(); i += 1) {
+        auto mean = sums[i] / n;
+        auto variance = square_sums[i] / n - mean * mean;
+        if (best_variance < 0 || variance <= best_variance) {
+            best_variance = variance;
+            best_row = from + static_cast<int>(i);
+        }
+    }
+
+    return best_row;
+}
+
+std::string slice_suffix(int index) {
+    auto number = std::to_string(index);
+    if (number.size() < SLICE_NUMBER_WIDTH) {
+        number.insert(0, SLICE_NUMBER_WIDTH - number.size(), '0');
+    }
+    return "_" + number;
+}
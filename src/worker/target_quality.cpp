@@ -0,0 +1,275 @@
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../include/task.hpp"
+#include "include/processing.hpp"
+#include "include/target_quality.hpp"
+
+// Trial encodes are of a copy at most this many pixels on its longest side.
+const auto PROBE_SIZE = 512.0;
+// The range searched for Q, and for JPEG XL’s distance. Distances beyond the
+// upper bound look visibly broken on any page.
+const auto MIN_TARGET_Q = 5;
+const auto MAX_TARGET_Q = 100;
+const auto MIN_TARGET_DISTANCE = 0.1;
+const auto MAX_TARGET_DISTANCE = 8.0;
+// The distance search stops after this many trial encodes, which narrows it to
+// within about 0.06 of the best distance. The Q search needs about as many.
+const auto DISTANCE_SEARCH_STEPS = 7;
+// SSIM is computed over windows of this many pixels square.
+const auto SSIM_WINDOW = 8;
+// Colour pages are scored on their chroma as well as their lightness. Each
+// chroma channel counts for this much of the score, and lightness for the rest,
+// since the eye is less sensitive to chroma.
+const auto SSIM_CHROMA_WEIGHT = 0.1;
+
+static double mean_ssim(
+    const std::vector<double> &a,
+    const std::vector<double> &b,
+    int width,
+    int height
+);
+static std::vector<std::vector<double>>
+ssim_channels(const vips::VImage &img);
+static double weighted_ssim(
+    const std::vector<std::vector<double>> &a,
+    const std::vector<std::vector<double>> &b,
+    int width,
+    int height
+);
+static double trial_ssim(
+    const vips::VImage &probe,
+    const std::vector<std::vector<double>> &reference,
+    PageTask task
+);
+
+bool has_quality_target(const PageTask &task) {
+    auto format = task.image_format;
+    return task.is_lossy && task.target_quality > 0
+        && (format == "AVIF" || format == "JPEG" || format == "JPEG XL"
+            || format == "WebP");
+}
+
+PageTask with_target_quality(
+    const vips::VImage &img,
+    const PageTask &task,
+    const std::string &name,
+    Logger log
+) {
+    auto longest_side = std::max(img.width(), img.height());
+    auto probe = longest_side > PROBE_SIZE
+                   ? img.resize(PROBE_SIZE / longest_side).copy_memory()
+                   : img.copy_memory();
+    auto reference = ssim_channels(probe);
+
+    auto settings = task;
+    auto trials = 0;
+    // The setting that `ssim` is the score of.
+    auto scored_quality = -1.0;
+    auto ssim = 0.0;
+
+    // JPEG XL is searched by distance, its native perceptual scale. Lower
+    // distances are better, so the search looks for the highest distance
+    // that reaches the target.
+    if (task.image_format == "JPEG XL") {
+        settings.quality_type_is_distance = true;
+        auto low = MIN_TARGET_DISTANCE;
+        auto high = MAX_TARGET_DISTANCE;
+        for (auto step = 0; step < DISTANCE_SEARCH_STEPS; step += 1) {
+            settings.quality = (low + high) / 2;
+            auto score = trial_ssim(probe, reference, settings);
+            trials += 1;
+            if (score >= task.target_quality) {
+                low = settings.quality;
+                scored_quality = settings.quality;
+                ssim = score;
+            }
+            else {
+                high = settings.quality;
+            }
+        }
+        settings.quality = std::round(low * 100) / 100;
+    }
+    else {
+        auto low = MIN_TARGET_Q;
+        auto high = MAX_TARGET_Q;
+        while (low < high) {
+            auto mid = (low + high) / 2;
+            settings.quality = mid;
+            auto score = trial_ssim(probe, reference, settings);
+            trials += 1;
+            if (score >= task.target_quality) {
+                high = mid;
+                scored_quality = mid;
+                ssim = score;
+            }
+            else {
+                low = mid + 1;
+            }
+        }
+        settings.quality = low;
+    }
+
+    // When no trial reached the target, the search ends on the best setting
+    // without having tried it, and rounding the distance can move it from
+    // the one tried. Either way, the setting returned is scored as it is.
+    if (scored_quality != settings.quality) {
+        ssim = trial_ssim(probe, reference, settings);
+        trials += 1;
+    }
+
+    auto report = std::ostringstream();
+    report << name << ": target SSIM " << task.target_quality << ": ";
+    if (ssim < task.target_quality) {
+        report << "not reached, ";
+    }
+    report << (settings.quality_type_is_distance ? "distance " : "Q ")
+           << settings.quality << " after " << trials
+           << " trial encodes (probe SSIM " << ssim << ")";
+    log("@info " + report.str());
+    return settings;
+}
+
+// The mean structural similarity of two greyscale images of the same size,
+// given as rows of 8-bit values, over 8×8 windows.
+double mean_ssim(
+    const std::vector<double> &a,
+    const std::vector<double> &b,
+    int width,
+    int height
+) {
+    const auto c1 = std::pow(0.01 * 255, 2);
+    const auto c2 = std::pow(0.03 * 255, 2);
+
+    // Sums over each window come from summed-area tables of the two images,
+    // their squares and their product.
+    auto stride = static_cast<size_t>(width) + 1;
+    auto table_size = stride * (static_cast<size_t>(height) + 1);
+    auto sum_a = std::vector<double>(table_size, 0.0);
+    auto sum_b = std::vector<double>(table_size, 0.0);
+    auto sum_aa = std::vector<double>(table_size, 0.0);
+    auto sum_bb = std::vector<double>(table_size, 0.0);
+    auto sum_ab = std::vector<double>(table_size, 0.0);
+    for (auto y = 0; y < height; y += 1) {
+        for (auto x = 0; x < width; x += 1) {
+            auto i = static_cast<size_t>(y) * width + x;
+            auto t = (y + 1) * stride + x + 1;
+            auto add = [&](std::vector<double> &table, double value) {
+                table[t] = value + table[t - 1] + table[t - stride]
+                         - table[t - stride - 1];
+            };
+            add(sum_a, a[i]);
+            add(sum_b, b[i]);
+            add(sum_aa, a[i] * a[i]);
+            add(sum_bb, b[i] * b[i]);
+            add(sum_ab, a[i] * b[i]);
+        }
+    }
+
+    auto window = std::min({SSIM_WINDOW, width, height});
+    if (window == 0) {
+        return 1.0;
+    }
+    auto n = static_cast<double>(window * window);
+    auto total = 0.0;
+    auto count = 0;
+    for (auto y = 0; y + window <= height; y += 1) {
+        for (auto x = 0; x + window <= width; x += 1) {
+            auto top_left = y * stride + x;
+            auto bottom_right = (y + window) * stride + x + window;
+            auto window_sum = [&](const std::vector<double> &table) {
+                return table[bottom_right] - table[top_left + window]
+                     - table[bottom_right - window] + table[top_left];
+            };
+            auto mean_a = window_sum(sum_a) / n;
+            auto mean_b = window_sum(sum_b) / n;
+            auto var_a = window_sum(sum_aa) / n - mean_a * mean_a;
+            auto var_b = window_sum(sum_bb) / n - mean_b * mean_b;
+            auto covariance = window_sum(sum_ab) / n - mean_a * mean_b;
+            total += ((2 * mean_a * mean_b + c1) * (2 * covariance + c2))
+                   / ((mean_a * mean_a + mean_b * mean_b + c1)
+                      * (var_a + var_b + c2));
+            count += 1;
+        }
+    }
+    return total / count;
+}
+
+// Greyscale pages are scored on their grey levels. Colour pages are scored on
+// each channel of their Lab values, scaled to the range of 8-bit values that
+// SSIM’s constants assume.
+std::vector<std::vector<double>> ssim_channels(const vips::VImage &img) {
+    if (img.bands() < 3) {
+        auto grey = img.colourspace(VIPS_INTERPRETATION_B_W)[0].cast(
+            VIPS_FORMAT_UCHAR
+        );
+        return {image_to_doubles(grey)};
+    }
+    auto lab = img.colourspace(VIPS_INTERPRETATION_LAB);
+    return {
+        image_to_doubles(lab[0] * 2.55),
+        image_to_doubles(lab[1] + 128),
+        image_to_doubles(lab[2] + 128),
+    };
+}
+
+double weighted_ssim(
+    const std::vector<std::vector<double>> &a,
+    const std::vector<std::vector<double>> &b,
+    int width,
+    int height
+) {
+    if (a.size() != b.size()) {
+        return 0.0;
+    }
+    for (size_t i = 0; i < a.size(); i += 1) {
+        if (a[i].size() != b[i].size()) {
+            return 0.0;
+        }
+    }
+
+    auto lightness = mean_ssim(a[0], b[0], width, height);
+    if (a.size() == 1) {
+        return lightness;
+    }
+    return (1 - 2 * SSIM_CHROMA_WEIGHT) * lightness
+         + SSIM_CHROMA_WEIGHT * mean_ssim(a[1], b[1], width, height)
+         + SSIM_CHROMA_WEIGHT * mean_ssim(a[2], b[2], width, height);
+}
+
+double trial_ssim(
+    const vips::VImage &probe,
+    const std::vector<std::vector<double>> &reference,
+    PageTask task
+) {
+    VipsBlob *blob = nullptr;
+    if (task.image_format == "AVIF") {
+        blob = probe.heifsave_buffer(save_options(task));
+    }
+    else if (task.image_format == "JPEG") {
+        blob = probe.jpegsave_buffer(save_options(task));
+    }
+    else if (task.image_format == "JPEG XL") {
+        blob = probe.jxlsave_buffer(save_options(task));
+    }
+    else {
+        blob = probe.webpsave_buffer(save_options(task));
+    }
+
+    auto decoded = std::vector<std::vector<double>>();
+    try {
+        size_t size = 0;
+        const void *data = vips_blob_get(blob, &size);
+        decoded = ssim_channels(vips::VImage::new_from_buffer(data, size, ""));
+    }
+    catch (...) {
+        vips_area_unref(VIPS_AREA(blob));
+        throw;
+    }
+    vips_area_unref(VIPS_AREA(blob));
+
+    return weighted_ssim(reference, decoded, probe.width(), probe.height());
+}
@@ -1,41 +1,25 @@
 #include "include/worker.hpp"
+#include "../include/protocol.hpp"
 #include "../include/task.hpp"
+#include "include/cache.hpp"
+#include "include/optimize.hpp"
+#include "include/passthrough.hpp"
 #include "include/processing.hpp"
+#include "include/strip.hpp"
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
-// Helper function to parse arguments with error handling and cleanup
-template <typename T>
-T parse_arg(const std::string &arg_str, const std::string &error_msg) {
-    try {
-        if constexpr (std::is_same_v<T, int>) {
-            return std::stoi(arg_str);
-        }
-        else if constexpr (std::is_same_v<T, float>) {
-            return std::stof(arg_str);
-        }
-        else if constexpr (std::is_same_v<T, double>) {
-            return std::stod(arg_str);
-        }
-        else {
-            throw std::invalid_argument("Unsupported type");
-        }
-    }
-    catch (const std::exception &e) {
-        std::cerr << "Worker error: " << error_msg << " - " << e.what() << "\n";
-#if defined(PDF_ENABLED)
-        FPDF_DestroyLibrary();
-#endif
-        vips_shutdown();
-        exit(1);
-    }
-}
+static int convert_page(const PageTask &task);
 
-// This is the main entry point for the worker executable. It takes task details
-// as command-line arguments, performs the processing, and prints logs to
+// This is the main entry point for the worker executable. It reads page tasks
+// from standard input until it closes, converts each, and prints logs to
 // standard output for the main application to capture.
 int worker_main(int argc, char *argv[]) {
     // Parse arguments into a map
@@ -46,6 +30,14 @@ int worker_main(int argc, char *argv[]) {
         args[flag] = value;
     }
 
+    // An optimization pass over a finished archive runs at the lowest
+    // priority. This is set before libvips starts any threads, so that they
+    // inherit it.
+    auto optimize_archive_path = args.find("-optimize_archive");
+    if (optimize_archive_path != args.end()) {
+        lower_process_priority();
+    }
+
     // Initialize libraries required for processing.
     if (VIPS_INIT(argv[0])) {
         vips_error_exit(nullptr);
@@ -56,142 +48,154 @@ int worker_main(int argc, char *argv[]) {
     FPDF_InitLibrary();
 #endif
 
-    // Reconstruct the PageTask from command-line arguments.
-    PageTask task;
-    try {
-        task.source_file = args.at("-source_file");
-        task.output_dir = args.at("-output_dir");
-        task.output_base_name = args.at("-output_base_name");
-
-        task.page_number = parse_arg<int>(
-            args.at("-page_number"), "Invalid page number format"
-        );
-
-        task.path_in_archive
-            = args.at("-path_in_archive"); // Can be empty string
-
+    if (optimize_archive_path != args.end()) {
+        auto result = 0;
+        try {
+            optimize_archive(
+                optimize_archive_path->second,
+                [](const std::string &msg) { std::cout << msg << std::endl; }
+            );
+        }
+        catch (const std::exception &e) {
+            std::cout << "Worker error optimizing "
+                      << optimize_archive_path->second << ": " << e.what()
+                      << std::endl;
+            result = 1;
+        }
 #if defined(PDF_ENABLED)
-        task.pdf_pixel_density = parse_arg<int>(
-            args.at("-pdf_pixel_density"), "Invalid PDF pixel density"
-        );
+        FPDF_DestroyLibrary();
 #endif
+        vips_shutdown();
+        return result;
+    }
 
-        task.convert_pages_to_greyscale
-            = parse_arg<int>(
-                  args.at("-convert_pages_to_greyscale"),
-                  "Invalid convert pages to greyscale"
-              )
-           != 0;
-
-        task.double_page_spread_action
-            = (DoublePageSpreadActions)parse_arg<int>(
-                args.at("-double_page_spread_actions"),
-                "Invalid double page spread options"
+    // Tasks come as frames on standard input. The protocol version is also
+    // passed as an argument, so that a mismatch is caught before any is read.
+    auto protocol = args.find("-task_protocol");
+    auto result = 0;
+    try {
+        if (protocol == args.end()
+            || protocol->second != std::to_string(TASK_PROTOCOL_VERSION)) {
+            throw std::runtime_error(
+                "Unsupported task protocol, expected version "
+                + std::to_string(TASK_PROTOCOL_VERSION)
             );
-
-        task.rotation_direction = (RotationDirection)parse_arg<int>(
-            args.at("-rotation_direction"), "Invalid rotation direction"
-        );
-
-        task.linear_light_resampling = parse_arg<int>(
-                                           args.at("-linear_light_resampling"),
-                                           "Invalid linear light resampling"
-                                       )
-                                    != 0;
-
-        task.remove_spine
-            = parse_arg<int>(args.at("-remove_spine"), "Invalid remove spine")
-           != 0;
-
-        task.stretch_page_contrast = parse_arg<int>(
-                                         args.at("-stretch_page_contrast"),
-                                         "Invalid stretch page contrast"
-                                     )
-                                  != 0;
-        task.scale_pages
-            = parse_arg<int>(args.at("-scale_pages"), "Invalid scale pages")
-           != 0;
-
-        task.page_width
-            = parse_arg<int>(args.at("-page_width"), "Invalid page width");
-        task.page_height
-            = parse_arg<int>(args.at("-page_height"), "Invalid page height");
-        task.page_resampler = static_cast<VipsKernel>(
-            parse_arg<int>(args.at("-page_resampler"), "Invalid page resampler")
-        );
-
-        task.quantize_pages
-            = parse_arg<int>(
-                  args.at("-quantize_pages"), "Invalid quantize pages"
-              )
-           != 0;
-
-        task.bit_depth
-            = parse_arg<int>(args.at("-bit_depth"), "Invalid bit depth");
-        task.dither
-            = parse_arg<double>(args.at("-dither"), "Invalid dither value");
-
-        task.image_format = args.at("-image_format");
-        task.is_lossy
-            = parse_arg<int>(args.at("-is_lossy"), "Invalid is lossy") != 0;
-        task.quality_type_is_distance
-            = parse_arg<int>(
-                  args.at("-quality_type_is_distance"),
-                  "Invalid quality type is distance"
-              )
-           != 0;
-
-        task.quality
-            = parse_arg<double>(args.at("-quality"), "Invalid quality value");
-
-        task.compression_effort = parse_arg<int>(
-            args.at("-compression_effort"), "Invalid compression effort"
-        );
+        }
+        while (auto task = read_task(std::cin)) {
+            result = std::max(result, convert_page(*task));
+        }
     }
-    catch (const std::out_of_range &e) {
-        std::cerr << "Worker error: Missing required argument - " << e.what()
-                  << "\n";
+    catch (const std::exception &e) {
+        std::cerr << "Worker error: " << e.what() << "\n";
+        result = 1;
+    }
+
+// Clean up libraries.
 #if defined(PDF_ENABLED)
-        FPDF_DestroyLibrary();
+    FPDF_DestroyLibrary();
 #endif
-        vips_shutdown();
-        return 1;
-    }
+    vips_shutdown();
+
+    return result;
+}
 
+// Converts a page for its own device and each extra one. Returns the worker’s
+// exit code for it.
+int convert_page(const PageTask &task) {
     // A simple logger that prints to standard output.
     auto logger = [](const std::string &msg) { std::cout << msg << std::endl; };
 
+    // With extra targets, the page is read and decoded once and then
+    // processed for each device in turn.
+    auto tasks = target_tasks(task);
+    auto load_task = loading_task(tasks);
+
+    // Converts a page for one target, unless its finished files are cached
+    // already. Errors while processing are logged rather than thrown, and any
+    // message other than a status line is one, so pages that logged one
+    // aren’t cached, and the worker exits with an error so that the GUI
+    // doesn’t record them as finished. The files saved are reported as
+    // `@output` status lines, which are only for the cache and don’t go to
+    // the GUI.
+    auto failed = false;
+    auto convert_target = [&](const PageTask &target_task,
+                              const std::vector<char> &page_data,
+                              const std::function<void(Logger)> &convert) {
+        auto output_key = output_cache_key(target_task, page_data);
+        if (restore_cached_output(target_task, output_key)) {
+            return;
+        }
+
+        auto logged_error = false;
+        auto outputs = std::vector<fs::path>();
+        convert([&](const std::string &msg) {
+            if (msg.starts_with("@output ")) {
+                outputs.push_back(msg.substr(8));
+                return;
+            }
+            logged_error = logged_error || !msg.starts_with("@");
+            logger(msg);
+        });
+        if (logged_error) {
+            failed = true;
+            return;
+        }
+        cache_output(target_task, output_key, outputs);
+    };
+
     try {
-        LoadPageReturn page_info;
         if (!task.path_in_archive.empty()) {
-            page_info = load_archive_image(task);
+            auto data = read_archive_entry(task);
+            auto page_info = std::optional<LoadPageReturn>();
+            for (const auto &target_task : tasks) {
+                convert_target(target_task, data, [&](Logger log) {
+                    if (target_task.slice_long_strips
+                        && is_long_strip(data, target_task)) {
+                        slice_long_strip(data, target_task, log);
+                    }
+                    else if (can_pass_through(data, target_task)) {
+                        pass_through_page(data, target_task, log);
+                    }
+                    else if (!encode_cached_page(target_task, log)) {
+                        if (!page_info) {
+                            page_info = load_archive_image(data, load_task);
+                        }
+                        auto target_page_info = retarget_loaded_page(
+                            *page_info, load_task, target_task
+                        );
+                        process_vimage(target_page_info, target_task, log);
+                    }
+                });
+            }
         }
         else {
 #if defined(PDF_ENABLED)
-            page_info = load_pdf_page(task);
+            auto page_info = std::optional<LoadPageReturn>();
+            for (const auto &target_task : tasks) {
+                convert_target(target_task, {}, [&](Logger log) {
+                    if (encode_cached_page(target_task, log)) {
+                        return;
+                    }
+                    if (!page_info) {
+                        page_info = load_pdf_page(load_task);
+                    }
+                    auto target_page_info = retarget_loaded_page(
+                        *page_info, load_task, target_task
+                    );
+                    process_vimage(target_page_info, target_task, log);
+                });
+            }
 #else
-            exit(1);
+            return 1;
 #endif
         }
-        process_vimage(page_info, task, logger);
     }
     catch (const std::exception &e) {
         logger(
             "Worker error processing task for "
             + task.source_file.stem().string() + ": " + e.what()
         );
-#if defined(PDF_ENABLED)
-        FPDF_DestroyLibrary();
-#endif
-        vips_shutdown();
         return 1;
     }
-
-// Clean up libraries.
-#if defined(PDF_ENABLED)
-    FPDF_DestroyLibrary();
-#endif
-    vips_shutdown();
-
-    return 0;
+    return failed ? 1 : 0;
 }
@@ -0,0 +1,188 @@
+// Checks that page tasks survive the trip from the GUI to a worker, and that
+// workers refuse frames that are damaged, come from another version or hold
+// settings out of range.
+
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "../src/include/protocol.hpp"
+
+// The size of a frame’s header: the magic number, the protocol version and the
+// payload’s size.
+const auto HEADER_SIZE = 4 + sizeof(uint16_t) + sizeof(uint32_t);
+
+static PageTask example_task();
+static void check(bool condition, const std::string &what);
+static void check_round_trip(const PageTask &task, const std::string &what);
+static void check_rejected(const std::string &frame, const std::string &what);
+
+// Failed checks are counted rather than stopping the test, so that one run
+// reports all of them.
+static auto failures = 0;
+
+int main() {
+    auto task = example_task();
+    check_round_trip(task, "task with extra targets");
+    task.extra_targets.clear();
+    check_round_trip(task, "task without extra targets");
+
+    // Frames follow each other on the stream, and the stream ends between
+    // them.
+    auto frame = encode_task(example_task());
+    auto stream = std::istringstream(frame + frame);
+    check(read_task(stream).has_value(), "first of two frames is read");
+    check(read_task(stream).has_value(), "second of two frames is read");
+    check(!read_task(stream).has_value(), "end of stream gives no task");
+
+    check_rejected(frame.substr(0, HEADER_SIZE - 1), "truncated header");
+    check_rejected(frame.substr(0, frame.size() - 1), "truncated payload");
+
+    auto wrong_magic = frame;
+    wrong_magic[0] = 'X';
+    check_rejected(wrong_magic, "wrong magic");
+
+    auto wrong_version = frame;
+    auto version = static_cast<uint16_t>(TASK_PROTOCOL_VERSION + 1);
+    std::memcpy(wrong_version.data() + 4, &version, sizeof(version));
+    check_rejected(wrong_version, "wrong version");
+
+    auto oversized = frame;
+    auto payload_size = uint32_t(1) << 30;
+    std::memcpy(
+        oversized.data() + 4 + sizeof(uint16_t),
+        &payload_size,
+        sizeof(payload_size)
+    );
+    check_rejected(oversized, "oversized payload");
+
+    // A payload that is longer than its fields, with the size to match, so
+    // that the extra byte is inside the frame.
+    auto trailing = frame + '\0';
+    auto trailing_size = static_cast<uint32_t>(trailing.size() - HEADER_SIZE);
+    std::memcpy(
+        trailing.data() + 4 + sizeof(uint16_t),
+        &trailing_size,
+        sizeof(trailing_size)
+    );
+    check_rejected(trailing, "trailing bytes");
+
+    // Written as any other value would be, and only caught when it’s read.
+    auto out_of_range = example_task();
+    out_of_range.page_resampler = VIPS_KERNEL_LAST;
+    check_rejected(encode_task(out_of_range), "out-of-range setting");
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    return 0;
+}
+
+// A task with every field set to something other than its default.
+PageTask example_task() {
+    auto task = PageTask();
+    task.image_format = "WebP";
+    task.auto_image_formats = {"JPEG XL", "PNG"};
+    task.cache_dir = "/tmp/cache";
+    task.source_cache_dir = "/tmp/source cache";
+    task.output_cache_dir = "/tmp/output cache";
+    task.dither = 0.5;
+    task.quality = 90.0;
+    task.target_quality = 0.98;
+    task.pdf_pixel_density = 300;
+    task.page_width = 1264;
+    task.page_height = 1680;
+    task.bit_depth = 4;
+    task.compression_effort = 7;
+    task.source_cache_limit_mb = 512;
+    task.double_page_spread_action = BOTH;
+    task.rotation_direction = COUNTERCLOCKWISE;
+    task.reading_direction = RIGHT_TO_LEFT;
+    task.page_resampler = VIPS_KERNEL_MITCHELL;
+    task.convert_pages_to_greyscale = true;
+    task.map_colour_eink = false;
+    task.remove_spine = true;
+    task.crop_margins = true;
+    task.crop_margins_per_book = true;
+    task.slice_long_strips = true;
+    task.deduplicate_pages = true;
+    task.stretch_page_contrast = true;
+    task.linear_light_resampling = true;
+    task.scale_pages = true;
+    task.quantize_pages = true;
+    task.share_book_palette = true;
+    task.is_lossy = true;
+    task.quality_type_is_distance = true;
+
+    task.source_file = "/books/a book.cbz";
+    task.output_dir = "/tmp/run/a book";
+    task.output_base_name = "chapter 1/page_001";
+    task.path_in_archive = "chapter 1/page_001.jpg";
+    task.page_number = 12;
+    task.extra_targets = {
+        DisplayTarget{
+            .output_dir = "/tmp/run/target1/a book",
+            .page_width = 1072,
+            .page_height = 1448,
+            .bit_depth = 16,
+            .convert_pages_to_greyscale = false,
+            .map_colour_eink = true,
+        },
+        DisplayTarget{
+            .output_dir = "/tmp/run/target2/a book",
+            .page_width = 758,
+            .page_height = 1024,
+            .bit_depth = 2,
+            .convert_pages_to_greyscale = true,
+            .map_colour_eink = false,
+        },
+    };
+    return task;
+}
+
+void check(bool condition, const std::string &what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << "\n";
+        failures += 1;
+    }
+}
+
+// Every field is compared through its encoding, so that a field that isn’t
+// read back shows up however it’s declared.
+void check_round_trip(const PageTask &task, const std::string &what) {
+    auto frame = encode_task(task);
+    auto stream = std::istringstream(frame);
+    try {
+        auto decoded = read_task(stream);
+        check(decoded.has_value(), what + ": read back");
+        if (!decoded) {
+            return;
+        }
+        check(encode_task(*decoded) == frame, what + ": fields match");
+        check(
+            decoded->extra_targets.size() == task.extra_targets.size(),
+            what + ": extra target count matches"
+        );
+        check(
+            decoded->output_base_name == task.output_base_name,
+            what + ": output base name matches"
+        );
+        check(stream.peek() == EOF, what + ": whole frame read");
+    }
+    catch (const std::exception &e) {
+        check(false, what + ": " + e.what());
+    }
+}
+
+void check_rejected(const std::string &frame, const std::string &what) {
+    auto stream = std::istringstream(frame);
+    try {
+        read_task(stream);
+        check(false, what + " is rejected");
+    }
+    catch (const std::runtime_error &) {
+    }
+}